@@ -0,0 +1,373 @@
+/**
+ * @file
+ * Locating the structures of a ZIP archive and walking its central directory.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "err.h"
+#include "io.h"
+#include "zip_format.h"
+#include "archive.h"
+
+
+/**
+ * Look for an APK signing block immediately in front of the central
+ * directory. It ends with its own size and a magic string:
+ *
+ *   uint64 size; <ID-value pairs>; uint64 size; "APK Sig Block 42"
+ *
+ * where size counts everything after the first size field.
+ */
+static int find_apk_sig_block(archive_t *archive, stats_t *stats)
+{
+  archive->sig_block_offset = 0;
+  archive->sig_block_len = 0;
+  if (archive->cd_offset < sizeof(apk_sig_block_footer_t) + sizeof(uint64_t))
+  {
+    return 0;
+  }
+
+  apk_sig_block_footer_t footer;
+  ERR_RET_IF_NEQ(io_read_at(archive->fd, &footer, sizeof(footer),
+                            archive->cd_offset - sizeof(footer), stats), 0, -1);
+  if (memcmp(footer.magic, APK_SIG_BLOCK_MAGIC, sizeof(footer.magic)) != 0)
+  {
+    return 0;
+  }
+
+  uint64_t size = ZIP_GET(&footer, size);
+  if (size < sizeof(footer) || size > archive->cd_offset - sizeof(uint64_t))
+  {
+    printf("APK signing block has a bad size (%" PRIu64 ")!\n", size);
+    return -1;
+  }
+  archive->sig_block_len = size + sizeof(uint64_t);
+  archive->sig_block_offset = archive->cd_offset - archive->sig_block_len;
+  return 0;
+}
+
+
+/**
+ * Find where the central directory of \a archive ends. That is where the
+ * EOCD starts, unless there is a Zip64 end of central directory record and
+ * locator in between. Info-ZIP writes those when it streams from a pipe,
+ * even when every size fits in 32 bits. The record is found either where
+ * the locator says, for archives without a prefix, or as a version 1 record
+ * just in front of the locator.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int find_cd_end(const archive_t *archive, uint64_t *cd_end, stats_t *stats)
+{
+  *cd_end = archive->eocd_offset;
+  zip64_eocd_locator_t locator;
+  if (archive->eocd_offset < sizeof(locator) + ZIP64_EOCD_V1_LEN)
+  {
+    return 0;
+  }
+  uint64_t locator_offset = archive->eocd_offset - sizeof(locator);
+  ERR_RET_IF_NEQ(io_read_at(archive->fd, &locator, sizeof(locator), locator_offset, stats), 0, -1);
+  if (ZIP_GET(&locator, signature) != ZIP64_EOCD_LOCATOR_SIGNATURE)
+  {
+    return 0;
+  }
+
+  uint64_t candidates[] = {ZIP_GET(&locator, zip64_eocd_offset), locator_offset - ZIP64_EOCD_V1_LEN};
+  for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++)
+  {
+    zip64_eocd_header_t record;
+    if (candidates[i] > locator_offset - sizeof(record))
+    {
+      continue;
+    }
+    ERR_RET_IF_NEQ(io_read_at(archive->fd, &record, sizeof(record), candidates[i], stats), 0, -1);
+    if (ZIP_GET(&record, signature) == ZIP64_EOCD_SIGNATURE &&
+        ZIP_GET(&record, size) == locator_offset - candidates[i] - sizeof(record))
+    {
+      *cd_end = candidates[i];
+      return 0;
+    }
+  }
+  printf("Zip64 end of central directory locator points at no record!\n");
+  return -1;
+}
+
+
+int archive_locate(int fd, archive_t *archive, stats_t *stats)
+{
+  memset(archive, 0, sizeof(*archive));
+  archive->fd = fd;
+
+  struct stat st;
+  ERR_RET_ON_ERRNO(fstat(fd, &st), -1);
+  archive->size = (uint64_t)st.st_size;
+  if (archive->size < sizeof(end_of_central_directory_header_t))
+  {
+    printf("File too small to be a ZIP archive!\n");
+    return -1;
+  }
+
+  end_of_central_directory_header_t *eocd = &archive->eocd;
+  archive->eocd_offset = archive->size - sizeof(end_of_central_directory_header_t);
+  ERR_RET_IF_NEQ(io_read_at(fd, eocd, sizeof(*eocd), archive->eocd_offset, stats), 0, -1);
+  if (ZIP_GET(eocd, signature) != EO_CENDIR_HEADER_SIGNATURE)
+  {
+    printf("Did not get a good end of directory header! There might be a ZIP file comment?\n");
+    return -1;
+  }
+  if (ZIP_GET(eocd, disk_number) != 0)
+  {
+    printf("Split archive! Only stripping deals with those.\n");
+    return -1;
+  }
+  if (ZIP_GET(eocd, size_of_cd) == 0xFFFFFFFF)
+  {
+    printf("This is a Zip64 file; and I don't know how to deal with those!\n");
+    return -1;
+  }
+
+  uint64_t stored_cd_offset = ZIP_GET(eocd, cd_offset_in_first_disk);
+  archive->cd_len = ZIP_GET(eocd, size_of_cd);
+  archive->num_entries = ZIP_GET(eocd, total_num_entries_cd);
+  uint64_t cd_end;
+  ERR_RET_IF_NEQ(find_cd_end(archive, &cd_end, stats), 0, -1);
+  if (stored_cd_offset + archive->cd_len > cd_end)
+  {
+    printf("File corrupted! Central directory overlaps the end of directory header.\n");
+    return -1;
+  }
+  /* Any shortfall between where the CD ends and where it says it does is a prefix */
+  archive->bias = cd_end - archive->cd_len - stored_cd_offset;
+  archive->cd_offset = stored_cd_offset + archive->bias;
+
+  return find_apk_sig_block(archive, stats);
+}
+
+
+int archive_locate_split(const volume_set_t *volumes, archive_t *archive, stats_t *stats)
+{
+  memset(archive, 0, sizeof(*archive));
+  archive->volumes = volumes;
+  archive->fd = volumes->fds[volumes->count - 1];
+  archive->size = volumes->size;
+  if (archive->size - volumes->starts[volumes->count - 1] < sizeof(end_of_central_directory_header_t))
+  {
+    printf("Last segment too small to hold the end of directory header!\n");
+    return -1;
+  }
+
+  end_of_central_directory_header_t *eocd = &archive->eocd;
+  archive->eocd_offset = archive->size - sizeof(end_of_central_directory_header_t);
+  ERR_RET_IF_NEQ(volume_read_at(volumes, eocd, sizeof(*eocd), archive->eocd_offset, stats), 0, -1);
+  if (ZIP_GET(eocd, signature) != EO_CENDIR_HEADER_SIGNATURE)
+  {
+    printf("Did not get a good end of directory header! There might be a ZIP file comment?\n");
+    return -1;
+  }
+  if (ZIP_GET(eocd, size_of_cd) == 0xFFFFFFFF)
+  {
+    printf("This is a Zip64 file; and I don't know how to deal with those!\n");
+    return -1;
+  }
+
+  /* The CD may itself be split, so it need not end on the disk it starts on */
+  archive->cd_len = ZIP_GET(eocd, size_of_cd);
+  archive->num_entries = ZIP_GET(eocd, total_num_entries_cd);
+  ERR_RET_IF_NEQ(volume_position(volumes, ZIP_GET(eocd, disk_num_start_of_cd),
+                                 ZIP_GET(eocd, cd_offset_in_first_disk), &archive->cd_offset), 0, -1);
+  if (archive->cd_offset + archive->cd_len > archive->eocd_offset)
+  {
+    printf("File corrupted! Central directory overlaps the end of directory header.\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+uint32_t archive_last_disk(int fd, stats_t *stats)
+{
+  struct stat st;
+  end_of_central_directory_header_t eocd;
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(eocd) ||
+      io_read_at(fd, &eocd, sizeof(eocd), (uint64_t)st.st_size - sizeof(eocd), stats) != 0 ||
+      ZIP_GET(&eocd, signature) != EO_CENDIR_HEADER_SIGNATURE)
+  {
+    return 0;
+  }
+  return ZIP_GET(&eocd, disk_number);
+}
+
+
+int archive_submit(const archive_t *archive, io_engine_t *io, io_op_t *ops, size_t count, stats_t *stats)
+{
+  if (archive->volumes)
+  {
+    return volume_submit_batch(archive->volumes, io, ops, count, stats);
+  }
+  return io_submit_batch(io, ops, count, stats);
+}
+
+
+/** Read the \a len bytes of the central directory of \a archive \a pos bytes into it. */
+static int read_cd_bytes(const archive_t *archive, char *buf, size_t len, uint64_t pos, stats_t *stats)
+{
+  if (archive->volumes)
+  {
+    return volume_read_at(archive->volumes, buf, len, archive->cd_offset + pos, stats);
+  }
+  return io_read_at(archive->fd, buf, len, archive->cd_offset + pos, stats);
+}
+
+
+/**
+ * Parse up to \a max_entries central directory entries from the \a len
+ * bytes at \a cd into \a entries, stopping at the first that doesn't fit.
+ *
+ * @param count Set to the number of entries parsed.
+ * @param used Set to the bytes they take up.
+ * @return 0 on success, -1 if an entry is corrupt.
+ */
+static int parse_cd(const archive_t *archive, char *cd, size_t len, size_t max_entries, cd_entry_t *entries,
+                    size_t *count, size_t *used)
+{
+  size_t cd_pos = 0;
+  size_t i;
+  for (i = 0; i < max_entries && cd_next_entry(cd, len, &cd_pos, &entries[i]); i++)
+  {
+    cd_entry_t *entry = &entries[i];
+    if (ZIP_GET(entry->header, signature) != CENDIR_HEADER_SIGNATURE)
+    {
+      printf("File corrupted! Central directory signature bad (0x%x).\n", ZIP_GET(entry->header, signature));
+      return -1;
+    }
+    if (archive->volumes)
+    {
+      ERR_RET_IF_NEQ(volume_position(archive->volumes, ZIP_GET(entry->header, disk_number_start),
+                                     entry->local_offset, &entry->local_offset), 0, -1);
+    }
+    else
+    {
+      entry->local_offset += archive->bias;
+    }
+  }
+  *count = i;
+  *used = cd_pos;
+  return 0;
+}
+
+
+int archive_read_cd(const archive_t *archive, scratch_t *scratch, stats_t *stats,
+                    char **cd, cd_entry_t **entries)
+{
+  ERR_RET_IF_NOT(*cd = scratch_alloc(scratch, archive->cd_len), -1);
+  ERR_RET_IF_NOT(*entries = scratch_alloc(scratch, archive->num_entries * sizeof(cd_entry_t)), -1);
+  ERR_RET_IF_NEQ(read_cd_bytes(archive, *cd, archive->cd_len, 0, stats), 0, -1);
+
+  size_t count;
+  size_t used;
+  ERR_RET_IF_NEQ(parse_cd(archive, *cd, archive->cd_len, archive->num_entries, *entries, &count, &used), 0, -1);
+  if (count < archive->num_entries)
+  {
+    printf("File corrupted! Central directory truncated.\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+int archive_read_cd_chunk(const archive_t *archive, uint64_t cd_pos, size_t max_len, size_t max_entries,
+                          scratch_t *scratch, stats_t *stats, char **cd, cd_entry_t **entries,
+                          size_t *count, size_t *len)
+{
+  size_t avail = archive->cd_len - cd_pos < max_len ? (size_t)(archive->cd_len - cd_pos) : max_len;
+  size_t most = avail / sizeof(central_directory_header_t);
+  most = most < max_entries ? most : max_entries;
+  ERR_RET_IF_NOT(*cd = scratch_alloc(scratch, avail), -1);
+  ERR_RET_IF_NOT(*entries = scratch_alloc(scratch, (most + 1) * sizeof(cd_entry_t)), -1);
+  ERR_RET_IF_NEQ(read_cd_bytes(archive, *cd, avail, cd_pos, stats), 0, -1);
+
+  ERR_RET_IF_NEQ(parse_cd(archive, *cd, avail, most, *entries, count, len), 0, -1);
+  if (*count == 0 && max_entries)
+  {
+    printf("File corrupted! Central directory truncated.\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+int archive_write_tail(const archive_t *archive, const char *cd, int out, uint64_t pos, stats_t *stats)
+{
+  if (pos - archive->bias > UINT32_MAX)
+  {
+    printf("Too much data to store without Zip64!\n");
+    return -1;
+  }
+  end_of_central_directory_header_t eocd = archive->eocd;
+  ZIP_SET(&eocd, cd_offset_in_first_disk, (uint32_t)(pos - archive->bias));
+  uint64_t comment_offset = archive->eocd_offset + sizeof(eocd);
+  ERR_RET_IF_NEQ(io_write_at(out, cd, archive->cd_len, pos, stats), 0, -1);
+  pos += archive->cd_len;
+  ERR_RET_IF_NEQ(io_write_at(out, &eocd, sizeof(eocd), pos, stats), 0, -1);
+  pos += sizeof(eocd);
+  return io_copy_range(out, pos, archive->fd, comment_offset, archive->size - comment_offset);
+}
+
+
+bool cd_next_entry(char *cd, size_t cd_len, size_t *pos, cd_entry_t *entry)
+{
+  if (cd_len - *pos < sizeof(central_directory_header_t))
+  {
+    return false;
+  }
+  central_directory_header_t *hdr = (central_directory_header_t *)(cd + *pos);
+  size_t var_len = (size_t)ZIP_GET(hdr, file_name_length) + ZIP_GET(hdr, extra_field_length) + ZIP_GET(hdr, file_comment_length);
+  if (cd_len - *pos - sizeof(central_directory_header_t) < var_len)
+  {
+    return false;
+  }
+
+  entry->header = hdr;
+  entry->local_offset = ZIP_GET(hdr, rel_offset_local_header);
+  entry->name.ptr = cd + *pos + sizeof(central_directory_header_t);
+  entry->name.len = ZIP_GET(hdr, file_name_length);
+  entry->extra.ptr = entry->name.ptr + entry->name.len;
+  entry->extra.len = ZIP_GET(hdr, extra_field_length);
+  entry->comment.ptr = entry->extra.ptr + entry->extra.len;
+  entry->comment.len = ZIP_GET(hdr, file_comment_length);
+  *pos += sizeof(central_directory_header_t) + var_len;
+  return true;
+}
+
+
+
+char *extra_find(char *extra, size_t len, uint16_t id, uint16_t *field_len)
+{
+  size_t offset = 0;
+  while (len - offset >= sizeof(extra_header_t))
+  {
+    extra_header_t *hdr = (extra_header_t *)(extra + offset);
+    uint16_t length = ZIP_GET(hdr, length);
+    offset += sizeof(extra_header_t);
+    if (len - offset < length)
+    {
+      return NULL;
+    }
+    if (ZIP_GET(hdr, id) == id)
+    {
+      *field_len = length;
+      return extra + offset;
+    }
+    offset += length;
+  }
+  return NULL;
+}
@@ -0,0 +1,152 @@
+/**
+ * @file
+ * Locating the structures of a ZIP archive and walking its central directory.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_ARCHIVE_H
+#define STRIPZIP_ARCHIVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "scratch.h"
+#include "io.h"
+#include "volume.h"
+#include "zip_format.h"
+
+/**
+ * A (pointer, length) view into a buffer owned by someone else. Views into
+ * the central directory buffer are only valid for the current archive.
+ */
+typedef struct
+{
+  char *ptr;
+  size_t len;
+} zip_view_t;
+
+/** A central directory entry parsed in place, without copying anything. */
+typedef struct
+{
+  central_directory_header_t *header;
+  uint64_t local_offset;      /**< File position of the local header, prefix included, or its
+                                   position in the joined segments of a split archive */
+  zip_view_t name;
+  zip_view_t extra;
+  zip_view_t comment;
+} cd_entry_t;
+
+/** Where everything is in an archive, as found from its EOCD. */
+typedef struct
+{
+  int fd;
+  const volume_set_t *volumes; /**< Segments of a split archive, or NULL */
+  uint64_t size;              /**< Total file size */
+  end_of_central_directory_header_t eocd;
+  uint64_t eocd_offset;
+  uint64_t cd_offset;         /**< File position of the CD, prefix included */
+  uint64_t cd_len;
+  uint64_t bias;              /**< Bytes in front of the archive proper, e.g. a launcher script */
+  size_t num_entries;
+  uint64_t sig_block_offset;  /**< Start of the APK signing block, if any */
+  uint64_t sig_block_len;     /**< Length of the APK signing block, 0 if none */
+} archive_t;
+
+/**
+ * Find and validate the end of central directory record of the archive open
+ * on \a fd and fill in \a archive. Archives we can't handle are reported.
+ *
+ * Offsets stored in an archive count from its first local header, so when
+ * something has been prepended to it (a self-extractor stub, a launcher
+ * script) they all fall short by the length of that prefix. Like Info-ZIP,
+ * the prefix is taken to be whatever separates the end of the central
+ * directory, as stored, from where the EOCD actually is.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int archive_locate(int fd, archive_t *archive, stats_t *stats);
+
+/**
+ * Like archive_locate(), for the split archive made up of \a volumes. All
+ * positions in \a archive are in the joined segments, and archive->fd is the
+ * last segment.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int archive_locate_split(const volume_set_t *volumes, archive_t *archive, stats_t *stats);
+
+/**
+ * Peek at the EOCD of the archive open on \a fd to find out which disk it is
+ * on, which is the number of segments less one for a split archive.
+ *
+ * @return The disk number, or 0 if there is no EOCD where it is expected.
+ */
+uint32_t archive_last_disk(int fd, stats_t *stats);
+
+/**
+ * Perform every operation in \a ops on \a archive, mapping them onto its
+ * segments if it is split.
+ *
+ * @return 0 if every operation transferred its full length, -1 otherwise.
+ */
+int archive_submit(const archive_t *archive, io_engine_t *io, io_op_t *ops, size_t count, stats_t *stats);
+
+/**
+ * Read the whole central directory of \a archive with one read and parse
+ * every entry in place.
+ *
+ * @param cd Set to the central directory, allocated from \a scratch.
+ * @param entries Set to the archive->num_entries parsed entries, which point
+ *                into \a cd. Their local offsets include archive->bias.
+ *
+ * @return 0 on success, -1 if the directory is truncated or corrupt.
+ */
+int archive_read_cd(const archive_t *archive, scratch_t *scratch, stats_t *stats,
+                    char **cd, cd_entry_t **entries);
+
+/**
+ * Read part of the central directory of \a archive: as many of the next
+ * \a max_entries entries as fit whole in the \a max_len bytes \a cd_pos
+ * bytes into it. \a max_len must be enough for the largest possible entry.
+ * Otherwise like archive_read_cd().
+ *
+ * @param count Set to the number of entries read.
+ * @param len Set to the bytes they take up, which the next chunk follows.
+ * @return 0 on success, -1 on failure.
+ */
+int archive_read_cd_chunk(const archive_t *archive, uint64_t cd_pos, size_t max_len, size_t max_entries,
+                          scratch_t *scratch, stats_t *stats, char **cd, cd_entry_t **entries,
+                          size_t *count, size_t *len);
+
+/**
+ * Finish a rewritten copy of \a archive in \a out: write the central
+ * directory \a cd at \a pos, then the EOCD, pointing at it, and the
+ * archive comment. The central directory must start within 4 GiB, as
+ * there is no Zip64 record to point at it otherwise.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int archive_write_tail(const archive_t *archive, const char *cd, int out, uint64_t pos, stats_t *stats);
+
+/**
+ * Parse the central directory entry at offset \a *pos of the \a cd_len byte
+ * buffer \a cd and advance \a *pos past it. The signature is not checked,
+ * and the local offset is left as stored.
+ *
+ * @return False if the entry runs off the end of the buffer.
+ */
+bool cd_next_entry(char *cd, size_t cd_len, size_t *pos, cd_entry_t *entry);
+
+/**
+ * Find the extra header \a id in the \a len byte extra field \a extra.
+ *
+ * @return The header's data (with its length in \a *field_len), or NULL if
+ *         it isn't present or the extra field is malformed.
+ */
+char *extra_find(char *extra, size_t len, uint16_t id, uint16_t *field_len);
+
+#endif /* STRIPZIP_ARCHIVE_H */
@@ -0,0 +1,98 @@
+/**
+ * @file
+ * Memory budget shared by the threads purifying archives at once.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "budget.h"
+
+struct budget
+{
+  uint64_t limit;
+  uint64_t used;
+  uint64_t next_ticket;   /**< Handed to the next thread to ask */
+  uint64_t serving;       /**< Ticket of the thread granted next */
+  pthread_mutex_t lock;
+  pthread_cond_t changed; /**< Broadcast when bytes are released or a ticket served */
+};
+
+
+budget_t *budget_open(uint64_t limit)
+{
+  budget_t *budget = calloc(1, sizeof(budget_t));
+  if (budget == NULL)
+  {
+    return NULL;
+  }
+  budget->limit = limit;
+  pthread_mutex_init(&budget->lock, NULL);
+  pthread_cond_init(&budget->changed, NULL);
+  return budget;
+}
+
+
+void budget_close(budget_t *budget)
+{
+  if (budget == NULL)
+  {
+    return;
+  }
+  pthread_cond_destroy(&budget->changed);
+  pthread_mutex_destroy(&budget->lock);
+  free(budget);
+}
+
+
+uint64_t budget_limit(const budget_t *budget)
+{
+  return budget->limit;
+}
+
+
+uint64_t budget_acquire(budget_t *budget, uint64_t bytes)
+{
+  if (bytes > budget->limit)
+  {
+    bytes = budget->limit;
+  }
+  pthread_mutex_lock(&budget->lock);
+  uint64_t ticket = budget->next_ticket++;
+  while (ticket != budget->serving || budget->limit - budget->used < bytes)
+  {
+    pthread_cond_wait(&budget->changed, &budget->lock);
+  }
+  budget->used += bytes;
+  budget->serving++;
+  pthread_cond_broadcast(&budget->changed);
+  pthread_mutex_unlock(&budget->lock);
+  return bytes;
+}
+
+
+bool budget_try_acquire(budget_t *budget, uint64_t bytes)
+{
+  pthread_mutex_lock(&budget->lock);
+  bool granted = budget->serving == budget->next_ticket && budget->limit - budget->used >= bytes;
+  if (granted)
+  {
+    budget->used += bytes;
+  }
+  pthread_mutex_unlock(&budget->lock);
+  return granted;
+}
+
+
+void budget_release(budget_t *budget, uint64_t bytes)
+{
+  pthread_mutex_lock(&budget->lock);
+  budget->used -= bytes;
+  pthread_cond_broadcast(&budget->changed);
+  pthread_mutex_unlock(&budget->lock);
+}
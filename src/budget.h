@@ -0,0 +1,55 @@
+/**
+ * @file
+ * Memory budget shared by the threads purifying archives at once.
+ *
+ * Before working on an archive, a thread reserves the memory it expects to
+ * need, as worked out from the size of the central directory, the number
+ * of entries and the options in use. Reservations are granted in the order
+ * they are asked for, each once everything granted before it leaves room,
+ * so a large archive holds back those behind it rather than being starved
+ * by them. A reservation larger than the whole budget is cut down to it,
+ * and then only runs alone.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_BUDGET_H
+#define STRIPZIP_BUDGET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct budget budget_t;
+
+/**
+ * Create a budget of \a limit bytes.
+ *
+ * @return The budget, or NULL if out of memory.
+ */
+budget_t *budget_open(uint64_t limit);
+
+void budget_close(budget_t *budget);
+
+/** The number of bytes \a budget was created with. */
+uint64_t budget_limit(const budget_t *budget);
+
+/**
+ * Reserve \a bytes of \a budget, waiting for room.
+ *
+ * @return The bytes reserved, which may be fewer than asked for, to be
+ *         handed back to budget_release().
+ */
+uint64_t budget_acquire(budget_t *budget, uint64_t bytes);
+
+/**
+ * Reserve \a bytes of \a budget if there is room now and nobody is waiting.
+ *
+ * @return True if they were reserved.
+ */
+bool budget_try_acquire(budget_t *budget, uint64_t bytes);
+
+/** Hand back \a bytes reserved before. */
+void budget_release(budget_t *budget, uint64_t bytes);
+
+#endif /* STRIPZIP_BUDGET_H */
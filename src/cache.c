@@ -0,0 +1,277 @@
+/**
+ * @file
+ * Content-addressed cache of purified archives.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "err.h"
+#include "hash.h"
+#include "io.h"
+#include "archive.h"
+#include "cache.h"
+
+/** Bump to invalidate existing caches when the output format changes */
+#define CACHE_FORMAT_VERSION 1
+
+/** Bytes read at a time when hashing an archive */
+#define CACHE_HASH_CHUNK (1024 * 1024)
+
+/** Length of an entry's name, "<16 hex digits>.zip", with its terminator */
+#define CACHE_NAME_LEN 21
+
+struct cache
+{
+  int dir_fd;
+  uint64_t max_bytes;
+  uint64_t salt;
+  unsigned tmp_counter;   /**< Makes temporary names unique; atomic */
+};
+
+typedef struct
+{
+  char name[CACHE_NAME_LEN];
+  uint64_t size;
+  struct timespec mtime;
+} cache_entry_t;
+
+
+cache_t *cache_open(const char *dir, uint64_t max_bytes, uint64_t salt)
+{
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+  {
+    printf("Could not create cache directory %s: %s\n", dir, strerror(errno));
+    return NULL;
+  }
+  int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0)
+  {
+    printf("Could not open cache directory %s: %s\n", dir, strerror(errno));
+    return NULL;
+  }
+
+  cache_t *cache = calloc(1, sizeof(cache_t));
+  if (cache == NULL)
+  {
+    close(dir_fd);
+    return NULL;
+  }
+  uint32_t version = CACHE_FORMAT_VERSION;
+  *cache = (cache_t){.dir_fd = dir_fd, .max_bytes = max_bytes, .salt = hash64(&version, sizeof(version), salt)};
+  return cache;
+}
+
+
+void cache_close(cache_t *cache)
+{
+  if (cache == NULL)
+  {
+    return;
+  }
+  close(cache->dir_fd);
+  free(cache);
+}
+
+
+/** Hash \a len bytes of \a fd at \a offset into \a h, a chunk at a time. */
+static int hash_range(int fd, uint64_t offset, uint64_t len, scratch_t *scratch, stats_t *stats, uint64_t *h)
+{
+  scratch_mark_t mark = scratch_mark(scratch);
+  size_t buf_len = len < CACHE_HASH_CHUNK ? (size_t)len : CACHE_HASH_CHUNK;
+  char *buf;
+  ERR_RET_IF_NOT(buf = scratch_alloc(scratch, buf_len + 1), -1);
+  for (uint64_t done = 0; done < len; done += buf_len)
+  {
+    buf_len = len - done < CACHE_HASH_CHUNK ? (size_t)(len - done) : CACHE_HASH_CHUNK;
+    ERR_RET_IF_NEQ(io_read_at(fd, buf, buf_len, offset + done, stats), 0, -1);
+    *h = hash64(buf, buf_len, *h);
+  }
+  scratch_release(scratch, mark);
+  return 0;
+}
+
+
+int cache_key(const cache_t *cache, int fd, scratch_t *scratch, stats_t *stats, uint64_t *key)
+{
+  archive_t archive;
+  ERR_RET_IF_NEQ(archive_locate(fd, &archive, stats), 0, -1);
+
+  /* The CD has every entry's CRC and sizes; the file size and the EOCD catch
+   * changes to anything else in the layout */
+  uint64_t layout[] = {archive.size, archive.bias, archive.sig_block_len};
+  uint64_t h = hash64(layout, sizeof(layout), cache->salt);
+  h = hash64(&archive.eocd, sizeof(archive.eocd), h);
+
+  /* Purifying leaves the prefix, the signing block and the archive comment
+   * alone, so they come out as they went in */
+  uint64_t comment_offset = archive.eocd_offset + sizeof(archive.eocd);
+  ERR_RET_IF_NEQ(hash_range(fd, 0, archive.bias, scratch, stats, &h), 0, -1);
+  ERR_RET_IF_NEQ(hash_range(fd, archive.sig_block_offset, archive.sig_block_len, scratch, stats, &h), 0, -1);
+  ERR_RET_IF_NEQ(hash_range(fd, comment_offset, archive.size - comment_offset, scratch, stats, &h), 0, -1);
+
+  /* A chunk at a time, like the rest, as no memory is reserved for it */
+  ERR_RET_IF_NEQ(hash_range(fd, archive.cd_offset, archive.cd_len, scratch, stats, &h), 0, -1);
+  *key = h;
+  return 0;
+}
+
+
+int cache_fetch(const cache_t *cache, uint64_t key, int fd, stats_t *stats)
+{
+  char name[CACHE_NAME_LEN];
+  snprintf(name, sizeof(name), "%016" PRIx64 ".zip", key);
+  int cached = openat(cache->dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (cached < 0)
+  {
+    stats->cache_misses++;
+    return 0;
+  }
+
+  /* Eviction may unlink the entry now, but our descriptor keeps it alive */
+  struct stat st;
+  int ret = fstat(cached, &st) == 0 && io_copy_file(fd, cached, (uint64_t)st.st_size) == 0 ? 1 : -1;
+  if (ret == 1)
+  {
+    /* Mark as recently used */
+    futimens(cached, NULL);
+    stats->cache_hits++;
+  }
+  close(cached);
+  return ret;
+}
+
+
+static int compare_mtime(const void *a, const void *b)
+{
+  const struct timespec *ta = &((const cache_entry_t *)a)->mtime;
+  const struct timespec *tb = &((const cache_entry_t *)b)->mtime;
+  if (ta->tv_sec != tb->tv_sec)
+  {
+    return ta->tv_sec < tb->tv_sec ? -1 : 1;
+  }
+  return ta->tv_nsec < tb->tv_nsec ? -1 : ta->tv_nsec > tb->tv_nsec;
+}
+
+
+/** Remove the least recently used entries until the cache fits its limit. */
+static void evict(cache_t *cache)
+{
+  int lock_fd = openat(cache->dir_fd, ".lock", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lock_fd < 0)
+  {
+    return;
+  }
+  /* If someone else is evicting already, they'll do our share too */
+  if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0)
+  {
+    close(lock_fd);
+    return;
+  }
+
+  int scan_fd = dup(cache->dir_fd);
+  DIR *dir = scan_fd < 0 ? NULL : fdopendir(scan_fd);
+  cache_entry_t *entries = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  uint64_t total = 0;
+  struct dirent *dirent;
+  while (dir && (dirent = readdir(dir)) != NULL)
+  {
+    struct stat st;
+    size_t len = strlen(dirent->d_name);
+    if (len != CACHE_NAME_LEN - 1 || strcmp(dirent->d_name + len - 4, ".zip") != 0 ||
+        fstatat(cache->dir_fd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      continue;
+    }
+    if (count == capacity)
+    {
+      size_t new_capacity = capacity ? capacity * 2 : 256;
+      cache_entry_t *grown = realloc(entries, new_capacity * sizeof(cache_entry_t));
+      if (grown == NULL)
+      {
+        break;
+      }
+      entries = grown;
+      capacity = new_capacity;
+    }
+    memcpy(entries[count].name, dirent->d_name, CACHE_NAME_LEN);
+    entries[count].size = (uint64_t)st.st_size;
+    entries[count].mtime = st.st_mtim;
+    total += entries[count].size;
+    count++;
+  }
+
+  if (total > cache->max_bytes)
+  {
+    qsort(entries, count, sizeof(cache_entry_t), compare_mtime);
+    for (size_t i = 0; i < count && total > cache->max_bytes; i++)
+    {
+      if (unlinkat(cache->dir_fd, entries[i].name, 0) == 0)
+      {
+        total -= entries[i].size;
+      }
+    }
+  }
+
+  free(entries);
+  if (dir)
+  {
+    closedir(dir);
+  }
+  else if (scan_fd >= 0)
+  {
+    close(scan_fd);
+  }
+  close(lock_fd);
+}
+
+
+void cache_store(cache_t *cache, uint64_t key, int fd, stats_t *stats)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    return;
+  }
+
+  /* Build the entry under a private name so that nobody sees it half written */
+  char tmp_name[64];
+  char name[CACHE_NAME_LEN];
+  snprintf(tmp_name, sizeof(tmp_name), ".tmp-%ld-%u", (long)getpid(),
+           __atomic_fetch_add(&cache->tmp_counter, 1, __ATOMIC_RELAXED));
+  snprintf(name, sizeof(name), "%016" PRIx64 ".zip", key);
+  int tmp = openat(cache->dir_fd, tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (tmp < 0)
+  {
+    printf("Could not add to the cache: %s\n", strerror(errno));
+    return;
+  }
+  int ret = io_copy_file(tmp, fd, (uint64_t)st.st_size);
+  close(tmp);
+  if (ret != 0 || renameat(cache->dir_fd, tmp_name, cache->dir_fd, name) != 0)
+  {
+    printf("Could not add to the cache\n");
+    unlinkat(cache->dir_fd, tmp_name, 0);
+    return;
+  }
+  stats->cache_stores++;
+
+  if (cache->max_bytes)
+  {
+    evict(cache);
+  }
+}
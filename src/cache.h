@@ -0,0 +1,67 @@
+/**
+ * @file
+ * Content-addressed cache of purified archives.
+ *
+ * Archives are keyed by a hash of their central directory, which carries the
+ * CRC and sizes of every entry, and of any prefix, APK signing block and
+ * archive comment, together with the archive size and the options that
+ * affect the output. A repeat input is then served from the cache with a
+ * reflink, or a copy where the filesystem can't share extents, instead of
+ * being purified again.
+ *
+ * Any number of processes may share a cache directory. Entries appear with
+ * an atomic rename, and eviction of the least recently used entries is
+ * serialised by an flock on the directory's lock file.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_CACHE_H
+#define STRIPZIP_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "scratch.h"
+
+/** Cache size used when none is given */
+#define CACHE_DEFAULT_MAX_BYTES (1ULL << 30)
+
+typedef struct cache cache_t;
+
+/**
+ * Open (creating if need be) the cache in directory \a dir.
+ *
+ * @param max_bytes Size to evict the cache down to, 0 for unbounded.
+ * @param salt Hash of everything besides the input that affects the output.
+ *
+ * @return The cache, or NULL if the directory can't be used.
+ */
+cache_t *cache_open(const char *dir, uint64_t max_bytes, uint64_t salt);
+
+void cache_close(cache_t *cache);
+
+/**
+ * Compute the cache key of the archive open on \a fd.
+ *
+ * @return 0 on success, -1 if the archive can't be parsed.
+ */
+int cache_key(const cache_t *cache, int fd, scratch_t *scratch, stats_t *stats, uint64_t *key);
+
+/**
+ * Replace the contents of \a fd with the cached result for \a key.
+ *
+ * @return 1 if the archive was served from the cache, 0 if it isn't cached,
+ *         -1 if copying failed part way and the archive is now damaged.
+ */
+int cache_fetch(const cache_t *cache, uint64_t key, int fd, stats_t *stats);
+
+/**
+ * Add the purified archive open on \a fd to the cache under \a key, evicting
+ * old entries to stay within the size limit. Failure only costs a future hit.
+ */
+void cache_store(cache_t *cache, uint64_t key, int fd, stats_t *stats);
+
+#endif /* STRIPZIP_CACHE_H */
@@ -0,0 +1,470 @@
+/**
+ * @file
+ * Shrinking purified archives in place.
+ *
+ * The placeholders to drop from the local headers are found first. One
+ * sweep then moves every byte up to the central directory forward over them,
+ * the local headers' extra field lengths are patched where the headers
+ * ended up, and a new central directory, minus its own placeholders and with
+ * the moved offsets, is written after them. An APK signing block moves with
+ * the records in front of it, as one unit.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+
+#include "err.h"
+#include "io.h"
+#include "archive.h"
+#include "compact.h"
+
+/** Bytes moved at a time by the sweep */
+#define COMPACT_BUFFER (1024 * 1024)
+
+/** Local headers read per I/O batch */
+#define COMPACT_BATCH_ENTRIES 1024
+
+typedef struct
+{
+  compact_range_t *ranges;
+  size_t count;
+  size_t capacity;
+} range_list_t;
+
+/** A local header whose extra field length changes */
+typedef struct
+{
+  uint64_t offset;            /**< Of the header, before compaction */
+  uint16_t extra_len;
+} header_patch_t;
+
+typedef struct
+{
+  header_patch_t *patches;
+  size_t count;
+  size_t capacity;
+} patch_list_t;
+
+
+static int range_add(range_list_t *list, uint64_t offset, uint64_t len)
+{
+  /* Adjacent placeholders come out as one range */
+  if (list->count && list->ranges[list->count - 1].offset + list->ranges[list->count - 1].len == offset)
+  {
+    list->ranges[list->count - 1].len += len;
+    return 0;
+  }
+  if (list->count == list->capacity)
+  {
+    size_t capacity = list->capacity ? list->capacity * 2 : 256;
+    compact_range_t *grown;
+    ERR_RET_IF_NOT(grown = realloc(list->ranges, capacity * sizeof(compact_range_t)), -1);
+    list->ranges = grown;
+    list->capacity = capacity;
+  }
+  list->ranges[list->count++] = (compact_range_t){.offset = offset, .len = len};
+  return 0;
+}
+
+
+static int patch_add(patch_list_t *list, uint64_t offset, uint16_t extra_len)
+{
+  if (list->count == list->capacity)
+  {
+    size_t capacity = list->capacity ? list->capacity * 2 : 256;
+    header_patch_t *grown;
+    ERR_RET_IF_NOT(grown = realloc(list->patches, capacity * sizeof(header_patch_t)), -1);
+    list->patches = grown;
+    list->capacity = capacity;
+  }
+  list->patches[list->count++] = (header_patch_t){.offset = offset, .extra_len = extra_len};
+  return 0;
+}
+
+
+static int compare_range(const void *a, const void *b)
+{
+  uint64_t offset_a = ((const compact_range_t *)a)->offset;
+  uint64_t offset_b = ((const compact_range_t *)b)->offset;
+  return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+
+/** Move \a len bytes at \a src to \a dst, which is before it. */
+static int move_down(int fd, uint64_t dst, uint64_t src, uint64_t len, char *buf, size_t buf_len, stats_t *stats)
+{
+  /* Front to back, so a chunk never overwrites bytes still to be read */
+  for (uint64_t done = 0; done < len; )
+  {
+    size_t chunk = len - done < buf_len ? (size_t)(len - done) : buf_len;
+    ERR_RET_IF_NEQ(io_read_at(fd, buf, chunk, src + done, stats), 0, -1);
+    ERR_RET_IF_NEQ(io_write_at(fd, buf, chunk, dst + done, stats), 0, -1);
+    done += chunk;
+  }
+  return 0;
+}
+
+
+int compact_ranges(int fd, const compact_range_t *ranges, size_t count, uint64_t end, char *buf, size_t buf_len,
+                   uint64_t *new_end, stats_t *stats)
+{
+  if (count == 0)
+  {
+    *new_end = end;
+    return 0;
+  }
+
+  struct stat st;
+  ERR_RET_ON_ERRNO(fstat(fd, &st), -1);
+  uint64_t block = st.st_blksize > 0 ? (uint64_t)st.st_blksize : 4096;
+  bool can_collapse = true;
+
+  /* Everything before the write cursor is final. The bytes from there up to
+   * the read cursor are the gap left by removed ranges; a collapse takes the
+   * gap out and shifts everything after it, read cursor included, down. */
+  uint64_t write = ranges[0].offset;
+  uint64_t collapsed = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    uint64_t read = ranges[i].offset + ranges[i].len;
+    uint64_t next = i + 1 < count ? ranges[i + 1].offset : end;
+    uint64_t gap = read - collapsed - write;
+
+#ifdef FALLOC_FL_COLLAPSE_RANGE
+    if (can_collapse && write % block == 0 && gap % block == 0)
+    {
+      if (fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, (off_t)write, (off_t)gap) == 0)
+      {
+        collapsed += gap;
+        gap = 0;
+      }
+      else if (errno == EOPNOTSUPP || errno == EINVAL || errno == ENOSYS)
+      {
+        /* Not this filesystem; copy from now on */
+        can_collapse = false;
+      }
+      else
+      {
+        printf("Could not collapse a range: %s\n", strerror(errno));
+        return -1;
+      }
+    }
+#else
+    (void)can_collapse;
+#endif
+
+    if (gap)
+    {
+      ERR_RET_IF_NEQ(move_down(fd, write, read - collapsed, next - read, buf, buf_len, stats), 0, -1);
+    }
+    write += next - read;
+  }
+  *new_end = write;
+  return 0;
+}
+
+
+/**
+ * Step through the \a len byte extra field \a extra, adding every
+ * placeholder field to \a ranges, as if the field started at file offset
+ * \a base, or else copying every other field to \a out.
+ *
+ * @return The length of the extra field without placeholders.
+ */
+static size_t drop_placeholders(const char *extra, size_t len, uint64_t base, range_list_t *ranges, char *out)
+{
+  size_t kept = 0;
+  size_t pos = 0;
+  while (len - pos >= sizeof(extra_header_t))
+  {
+    const extra_header_t *hdr = (const extra_header_t *)(extra + pos);
+    size_t field_len = sizeof(extra_header_t) + ZIP_GET(hdr, length);
+    if (field_len > len - pos)
+    {
+      break;
+    }
+    if (ZIP_GET(hdr, id) == STRIPZIP_OPTION_HEADER)
+    {
+      if (ranges && range_add(ranges, base + pos, field_len) != 0)
+      {
+        return len;
+      }
+    }
+    else
+    {
+      if (out)
+      {
+        memcpy(out + kept, hdr, field_len);
+      }
+      kept += field_len;
+    }
+    pos += field_len;
+  }
+  /* Keep anything malformed as it is */
+  if (out)
+  {
+    memcpy(out + kept, extra + pos, len - pos);
+  }
+  return kept + len - pos;
+}
+
+
+/** Where the byte at \a offset went, given the sorted removed \a ranges. */
+static uint64_t moved_offset(const range_list_t *ranges, const uint64_t *removed_before, uint64_t offset)
+{
+  /* The last range starting before the offset */
+  size_t lo = 0;
+  size_t hi = ranges->count;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ranges->ranges[mid].offset < offset)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return lo ? offset - removed_before[lo - 1] - ranges->ranges[lo - 1].len : offset;
+}
+
+
+/**
+ * Find the placeholders in the local headers of \a count entries, and the
+ * extra field lengths the headers will need once they are gone. Headers
+ * are only patched after the sweep, since entries may share a record.
+ */
+static int find_local_placeholders(int fd, const cd_entry_t *entries, const unsigned *actions, size_t count,
+                                   range_list_t *ranges, patch_list_t *patches, strip_ctx_t *ctx)
+{
+  scratch_mark_t mark = scratch_mark(&ctx->scratch);
+  local_file_header_t *lf_headers;
+  char **extras;
+  io_op_t *ops;
+  ERR_RET_IF_NOT(lf_headers = scratch_alloc(&ctx->scratch, count * sizeof(local_file_header_t)), -1);
+  ERR_RET_IF_NOT(extras = scratch_alloc(&ctx->scratch, count * sizeof(char *)), -1);
+  ERR_RET_IF_NOT(ops = scratch_alloc(&ctx->scratch, count * sizeof(io_op_t)), -1);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    ops[i] = (io_op_t){.fd = fd, .write = false, .offset = entries[i].local_offset,
+                       .buf = &lf_headers[i], .len = sizeof(local_file_header_t)};
+  }
+  ERR_RET_IF_NEQ(io_submit_batch(ctx->io, ops, count, &ctx->stats), 0, -1);
+
+  size_t num_ops = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    ERR_RET_IF_NEQ(ZIP_GET(&lf_headers[i], signature), FILE_HEADER_SIGNATURE, -1);
+    uint16_t extra_len = ZIP_GET(&lf_headers[i], extra_field_length);
+    extras[i] = NULL;
+    if (extra_len && !(actions && (actions[i] & POLICY_KEEP_EXTRA)))
+    {
+      ERR_RET_IF_NOT(extras[i] = scratch_alloc(&ctx->scratch, extra_len), -1);
+      ops[num_ops++] = (io_op_t){.fd = fd, .write = false,
+                                 .offset = entries[i].local_offset + sizeof(local_file_header_t) +
+                                           ZIP_GET(&lf_headers[i], name_length),
+                                 .buf = extras[i], .len = extra_len};
+    }
+  }
+  ERR_RET_IF_NEQ(io_submit_batch(ctx->io, ops, num_ops, &ctx->stats), 0, -1);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    if (extras[i] == NULL)
+    {
+      continue;
+    }
+    uint64_t offset = entries[i].local_offset;
+    uint16_t extra_len = ZIP_GET(&lf_headers[i], extra_field_length);
+    uint64_t base = offset + sizeof(local_file_header_t) + ZIP_GET(&lf_headers[i], name_length);
+    size_t kept = drop_placeholders(extras[i], extra_len, base, ranges, NULL);
+    if (kept != extra_len)
+    {
+      ERR_RET_IF_NEQ(patch_add(patches, offset, (uint16_t)kept), 0, -1);
+    }
+  }
+
+  scratch_release(&ctx->scratch, mark);
+  return 0;
+}
+
+
+/** Write the extra field length of every header in \a patches where it now is. */
+static int apply_patches(int fd, const patch_list_t *patches, const range_list_t *ranges,
+                         const uint64_t *removed_before, strip_ctx_t *ctx)
+{
+  scratch_mark_t mark = scratch_mark(&ctx->scratch);
+  io_op_t *ops;
+  uint16_t *values;
+  ERR_RET_IF_NOT(ops = scratch_alloc(&ctx->scratch, COMPACT_BATCH_ENTRIES * sizeof(io_op_t)), -1);
+  ERR_RET_IF_NOT(values = scratch_alloc(&ctx->scratch, COMPACT_BATCH_ENTRIES * sizeof(uint16_t)), -1);
+  for (size_t first = 0; first < patches->count; first += COMPACT_BATCH_ENTRIES)
+  {
+    size_t count = patches->count - first < COMPACT_BATCH_ENTRIES ? patches->count - first : COMPACT_BATCH_ENTRIES;
+    for (size_t i = 0; i < count; i++)
+    {
+      const header_patch_t *patch = &patches->patches[first + i];
+      zip_store16(&values[i], patch->extra_len);
+      ops[i] = (io_op_t){.fd = fd, .write = true,
+                         .offset = moved_offset(ranges, removed_before, patch->offset) +
+                                   offsetof(local_file_header_t, extra_field_length),
+                         .buf = &values[i], .len = sizeof(uint16_t)};
+    }
+    ERR_RET_IF_NEQ(io_submit_batch(ctx->io, ops, count, &ctx->stats), 0, -1);
+  }
+  scratch_release(&ctx->scratch, mark);
+  return 0;
+}
+
+
+int compact_archive(int fd, strip_ctx_t *ctx)
+{
+  stats_t *stats = &ctx->stats;
+  archive_t archive;
+  ERR_RET_IF_NEQ(archive_locate(fd, &archive, stats), 0, -1);
+
+  scratch_reset(&ctx->scratch);
+  char *cd;
+  cd_entry_t *entries;
+  size_t num_entries = archive.num_entries;
+  ERR_RET_IF_NEQ(archive_read_cd(&archive, &ctx->scratch, stats, &cd, &entries), 0, -1);
+  unsigned *actions = NULL;
+  if (ctx->opts->policy)
+  {
+    ERR_RET_IF_NOT(actions = scratch_alloc(&ctx->scratch, (num_entries + 1) * sizeof(unsigned)), -1);
+    for (size_t i = 0; i < num_entries; i++)
+    {
+      actions[i] = policy_match(ctx->opts->policy, entries[i].name.ptr, entries[i].name.len);
+    }
+  }
+
+  /* The comment moves too, so keep it before anything else does */
+  uint64_t tail_offset = archive.eocd_offset + sizeof(end_of_central_directory_header_t);
+  size_t comment_len = (size_t)(archive.size - tail_offset);
+  char *comment;
+  char *buf;
+  char *new_cd;
+  ERR_RET_IF_NOT(comment = scratch_alloc(&ctx->scratch, comment_len + 1), -1);
+  ERR_RET_IF_NOT(buf = scratch_alloc(&ctx->scratch, COMPACT_BUFFER), -1);
+  ERR_RET_IF_NOT(new_cd = scratch_alloc(&ctx->scratch, archive.cd_len + 1), -1);
+  ERR_RET_IF_NEQ(io_read_at(fd, comment, comment_len, tail_offset, stats), 0, -1);
+
+  int ret = -1;
+  range_list_t ranges = {0};
+  patch_list_t patches = {0};
+  uint64_t *removed_before = NULL;
+  for (size_t first = 0; first < num_entries && !ctx->opts->cd_only; first += COMPACT_BATCH_ENTRIES)
+  {
+    size_t count = num_entries - first < COMPACT_BATCH_ENTRIES ? num_entries - first : COMPACT_BATCH_ENTRIES;
+    if (find_local_placeholders(fd, entries + first, actions ? actions + first : NULL, count, &ranges, &patches,
+                                ctx) != 0)
+    {
+      goto out;
+    }
+  }
+
+  /* Sort, and drop the repeats from entries sharing a record */
+  qsort(ranges.ranges, ranges.count, sizeof(compact_range_t), compare_range);
+  size_t unique = 0;
+  for (size_t i = 0; i < ranges.count; i++)
+  {
+    if (unique == 0 || ranges.ranges[i].offset != ranges.ranges[unique - 1].offset)
+    {
+      ranges.ranges[unique++] = ranges.ranges[i];
+    }
+  }
+  ranges.count = unique;
+  if ((removed_before = malloc((ranges.count + 1) * sizeof(uint64_t))) == NULL)
+  {
+    goto out;
+  }
+  uint64_t removed = 0;
+  for (size_t i = 0; i < ranges.count; i++)
+  {
+    removed_before[i] = removed;
+    removed += ranges.ranges[i].len;
+  }
+
+  /* The central directory, minus its placeholders and with the new offsets */
+  size_t new_cd_len = 0;
+  for (size_t i = 0; i < num_entries; i++)
+  {
+    const cd_entry_t *entry = &entries[i];
+    central_directory_header_t *cd_header = (central_directory_header_t *)(new_cd + new_cd_len);
+    memcpy(cd_header, entry->header, sizeof(*cd_header));
+    ZIP_SET(cd_header, rel_offset_local_header,
+            (uint32_t)(moved_offset(&ranges, removed_before, entry->local_offset) - archive.bias));
+    char *pos = (char *)(cd_header + 1);
+    memcpy(pos, entry->name.ptr, entry->name.len);
+    pos += entry->name.len;
+    size_t extra_len = entry->extra.len;
+    if (actions && (actions[i] & POLICY_KEEP_EXTRA))
+    {
+      memcpy(pos, entry->extra.ptr, extra_len);
+    }
+    else
+    {
+      extra_len = drop_placeholders(entry->extra.ptr, entry->extra.len, 0, NULL, pos);
+      ZIP_SET(cd_header, extra_field_length, (uint16_t)extra_len);
+    }
+    pos += extra_len;
+    memcpy(pos, entry->comment.ptr, entry->comment.len);
+    pos += entry->comment.len;
+    new_cd_len = (size_t)(pos - new_cd);
+  }
+
+  uint64_t cd_offset;
+  if (compact_ranges(fd, ranges.ranges, ranges.count, archive.cd_offset, buf, COMPACT_BUFFER, &cd_offset,
+                     stats) != 0 ||
+      apply_patches(fd, &patches, &ranges, removed_before, ctx) != 0)
+  {
+    goto out;
+  }
+  end_of_central_directory_header_t eocd = archive.eocd;
+  ZIP_SET(&eocd, size_of_cd, (uint32_t)new_cd_len);
+  ZIP_SET(&eocd, cd_offset_in_first_disk, (uint32_t)(cd_offset - archive.bias));
+  uint64_t pos = cd_offset;
+  if (io_write_at(fd, new_cd, new_cd_len, pos, stats) != 0 ||
+      io_write_at(fd, &eocd, sizeof(eocd), pos += new_cd_len, stats) != 0 ||
+      io_write_at(fd, comment, comment_len, pos += sizeof(eocd), stats) != 0 ||
+      ftruncate(fd, (off_t)(pos + comment_len)) != 0)
+  {
+    goto out;
+  }
+  stats->compacted_bytes += archive.size - (pos + comment_len);
+  ret = 0;
+
+out:
+  free(removed_before);
+  free(ranges.ranges);
+  free(patches.patches);
+  return ret;
+}
+
+
+uint64_t compact_memory_need(const archive_t *archive)
+{
+  uint64_t per_entry = sizeof(cd_entry_t) + sizeof(unsigned) + sizeof(compact_range_t) + sizeof(header_patch_t) +
+                       sizeof(uint64_t);
+  return 2 * archive->cd_len + archive->num_entries * per_entry + COMPACT_BUFFER +
+         (archive->size - archive->eocd_offset);
+}
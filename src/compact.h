@@ -0,0 +1,61 @@
+/**
+ * @file
+ * Shrinking purified archives in place.
+ *
+ * Purifying neutralizes unwanted extra fields by overwriting them with
+ * STRIPZIP_OPTION_HEADER placeholders, since removing bytes from the middle
+ * of an archive means moving everything after them. Compaction does that
+ * move, in place and without temporary disk space, so that the archive ends
+ * up the same whatever extra fields it was created with.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_COMPACT_H
+#define STRIPZIP_COMPACT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "stripzip.h"
+
+/** A run of bytes to remove from a file */
+typedef struct
+{
+  uint64_t offset;
+  uint64_t len;
+} compact_range_t;
+
+/**
+ * Remove the \a count sorted, disjoint \a ranges from the file open on \a fd,
+ * moving the bytes between them up to \a end towards the front in a single
+ * forward sweep through \a buf. Wherever the gap left behind is a whole
+ * number of filesystem blocks at a block boundary it is collapsed with
+ * FALLOC_FL_COLLAPSE_RANGE instead, which shifts the rest of the file
+ * without copying it. Bytes after \a end are left in an unspecified place.
+ *
+ * @param new_end Set to where the byte at \a end would now go.
+ * @return 0 on success, -1 on failure, leaving the file inconsistent.
+ */
+int compact_ranges(int fd, const compact_range_t *ranges, size_t count, uint64_t end, char *buf, size_t buf_len,
+                   uint64_t *new_end, stats_t *stats);
+
+/**
+ * Remove every placeholder extra field from the purified archive open on
+ * \a fd, in the local headers unless opts->cd_only is set and in the central
+ * directory, and move everything after them up. Entries whose policy keeps
+ * their extra fields are left alone. The file is truncated to its new size.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int compact_archive(int fd, strip_ctx_t *ctx);
+
+/**
+ * Memory compact_archive() takes for \a archive, taking each entry's local
+ * header to hold one placeholder.
+ */
+uint64_t compact_memory_need(const archive_t *archive);
+
+#endif /* STRIPZIP_COMPACT_H */
@@ -0,0 +1,589 @@
+/**
+ * @file
+ * Writing a purified archive straight from a directory tree.
+ *
+ * The tree is walked once to list every entry, which are then sorted by
+ * name. Worker threads read and deflate files in that order, while the
+ * calling thread writes each entry out as soon as it and all before it are
+ * ready. Compression may only run a bounded window ahead of writing, so at
+ * most that many compressed files are held in memory at once. Files that
+ * don't shrink are stored, their data copied in the kernel straight from
+ * the source file.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "err.h"
+#include "io.h"
+#include "create.h"
+
+/** Bytes of a file read at a time */
+#define CREATE_CHUNK (256 * 1024)
+
+/** Bytes of headers and small files gathered before writing them out */
+#define CREATE_OUT_BUFFER (1024 * 1024)
+
+/** Files each worker may compress ahead of the one being written */
+#define CREATE_WINDOW_PER_JOB 4
+
+/** Version needed to extract: 1.0 for stored entries, 2.0 for deflated */
+#define CREATE_VERSION_STORED   10
+#define CREATE_VERSION_DEFLATED 20
+
+typedef struct
+{
+  char *name;                 /**< Relative to the tree; directories end in '/' */
+  size_t name_len;
+  bool dir;
+  bool executable;
+  uint64_t size;
+
+  /* Filled in by the worker that compresses the entry */
+  bool done;
+  int status;
+  uint16_t method;
+  uint32_t crc32;
+  uint64_t compressed_size;
+  char *data;                 /**< Deflated data, or NULL to copy the file as is */
+  int fd;                     /**< The file, while its data remains to be copied */
+} create_entry_t;
+
+typedef struct
+{
+  create_entry_t *entries;
+  size_t count;
+  size_t capacity;
+} entry_list_t;
+
+typedef struct
+{
+  int root_fd;
+  create_entry_t *entries;
+  size_t count;
+  size_t next;                /**< Next entry to compress */
+  size_t written;             /**< Entries written out so far */
+  size_t window;              /**< How far compression may run ahead of writing */
+  bool abort;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;        /**< An entry was compressed or written */
+} create_job_t;
+
+typedef struct
+{
+  int fd;
+  char *buf;
+  size_t len;
+  uint64_t offset;            /**< Where buf goes in the file */
+  stats_t *stats;
+} create_out_t;
+
+
+static int list_add(entry_list_t *list, const char *prefix, size_t prefix_len, const char *name,
+                    const struct stat *st)
+{
+  if (list->count == list->capacity)
+  {
+    size_t capacity = list->capacity ? list->capacity * 2 : 256;
+    create_entry_t *grown;
+    ERR_RET_IF_NOT(grown = realloc(list->entries, capacity * sizeof(create_entry_t)), -1);
+    list->entries = grown;
+    list->capacity = capacity;
+  }
+
+  bool dir = S_ISDIR(st->st_mode);
+  size_t name_len = prefix_len + strlen(name) + dir;
+  create_entry_t *entry = &list->entries[list->count];
+  ERR_RET_IF_NOT(entry->name = malloc(name_len + 1), -1);
+  memcpy(entry->name, prefix, prefix_len);
+  strcpy(entry->name + prefix_len, name);
+  if (dir)
+  {
+    strcat(entry->name, "/");
+  }
+  entry->name_len = name_len;
+  entry->dir = dir;
+  entry->executable = (st->st_mode & 0111) != 0;
+  entry->size = dir ? 0 : (uint64_t)st->st_size;
+  entry->fd = -1;
+  entry->data = NULL;
+  entry->done = false;
+  list->count++;
+  return 0;
+}
+
+
+/**
+ * Add everything under the directory open on \a dir_fd to \a list, naming
+ * it \a prefix followed by its path below the directory. Closes \a dir_fd.
+ */
+static int walk(int dir_fd, const char *prefix, entry_list_t *list)
+{
+  DIR *dir = fdopendir(dir_fd);
+  if (dir == NULL)
+  {
+    close(dir_fd);
+    return -1;
+  }
+
+  int ret = 0;
+  size_t prefix_len = strlen(prefix);
+  struct dirent *dirent;
+  while (ret == 0 && (dirent = readdir(dir)) != NULL)
+  {
+    const char *name = dirent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+      continue;
+    }
+
+    /* Follow links to files, but not to directories, which could loop */
+    struct stat st;
+    bool link = false;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        ((link = S_ISLNK(st.st_mode)) && fstatat(dir_fd, name, &st, 0) != 0))
+    {
+      printf("Skipping %s%s: %s\n", prefix, name, strerror(errno));
+      continue;
+    }
+    if (S_ISDIR(st.st_mode) && link)
+    {
+      printf("Skipping %s%s: link to a directory\n", prefix, name);
+      continue;
+    }
+    if (S_ISREG(st.st_mode) && (uint64_t)st.st_size > UINT32_MAX)
+    {
+      printf("%s%s is too large to store without Zip64!\n", prefix, name);
+      ret = -1;
+    }
+    else if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))
+    {
+      ret = list_add(list, prefix, prefix_len, name, &st);
+    }
+    else
+    {
+      printf("Skipping %s%s: not a file or directory\n", prefix, name);
+    }
+
+    if (ret == 0 && S_ISDIR(st.st_mode))
+    {
+      int sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      const char *sub_prefix = list->entries[list->count - 1].name;
+      ret = sub_fd < 0 ? -1 : walk(sub_fd, sub_prefix, list);
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+
+static int compare_name(const void *a, const void *b)
+{
+  return strcmp(((const create_entry_t *)a)->name, ((const create_entry_t *)b)->name);
+}
+
+
+/**
+ * Read the file of \a entry, computing its CRC and deflating it. If that
+ * doesn't save anything the entry is stored instead, and its file kept open
+ * for copying the data.
+ */
+static int compress_entry(int root_fd, create_entry_t *entry, char *buf)
+{
+  entry->method = METHOD_STORED;
+  entry->crc32 = 0;
+  entry->compressed_size = 0;
+  if (entry->dir)
+  {
+    return 0;
+  }
+
+  int fd = openat(root_fd, entry->name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    printf("Could not open %s: %s\n", entry->name, strerror(errno));
+    return -1;
+  }
+  z_stream zs = {0};
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    close(fd);
+    return -1;
+  }
+  uLong bound = deflateBound(&zs, (uLong)entry->size);
+  if ((entry->data = malloc(bound)) == NULL)
+  {
+    deflateEnd(&zs);
+    close(fd);
+    return -1;
+  }
+  zs.next_out = (Bytef *)entry->data;
+  zs.avail_out = (uInt)bound;
+
+  int ret = -1;
+  uLong crc = crc32(0, NULL, 0);
+  uint64_t total = 0;
+  for (;;)
+  {
+    ssize_t n = read(fd, buf, CREATE_CHUNK);
+    if (n < 0)
+    {
+      printf("Could not read %s: %s\n", entry->name, strerror(errno));
+      break;
+    }
+    total += (uint64_t)n;
+    if (total > entry->size)
+    {
+      break;
+    }
+    crc = crc32(crc, (const Bytef *)buf, (uInt)n);
+    zs.next_in = (Bytef *)buf;
+    zs.avail_in = (uInt)n;
+    int zret = deflate(&zs, n == 0 ? Z_FINISH : Z_NO_FLUSH);
+    if (n == 0)
+    {
+      ret = zret == Z_STREAM_END ? 0 : -1;
+      break;
+    }
+    if (zret != Z_OK || zs.avail_in != 0)
+    {
+      break;
+    }
+  }
+  deflateEnd(&zs);
+  if (ret == 0 && total != entry->size)
+  {
+    ret = -1;
+  }
+  if (ret != 0)
+  {
+    if (total != entry->size)
+    {
+      printf("%s changed while being read\n", entry->name);
+    }
+    free(entry->data);
+    entry->data = NULL;
+    close(fd);
+    return -1;
+  }
+
+  entry->crc32 = (uint32_t)crc;
+  if (zs.total_out < entry->size)
+  {
+    entry->method = METHOD_DEFLATED;
+    entry->compressed_size = zs.total_out;
+    close(fd);
+    return 0;
+  }
+  free(entry->data);
+  entry->data = NULL;
+  entry->compressed_size = entry->size;
+  if (entry->size)
+  {
+    entry->fd = fd;
+  }
+  else
+  {
+    close(fd);
+  }
+  return 0;
+}
+
+
+static void *create_worker(void *arg)
+{
+  create_job_t *job = arg;
+  char *buf = malloc(CREATE_CHUNK);
+
+  pthread_mutex_lock(&job->lock);
+  while (!job->abort && job->next < job->count)
+  {
+    if (job->next >= job->written + job->window)
+    {
+      pthread_cond_wait(&job->cond, &job->lock);
+      continue;
+    }
+    create_entry_t *entry = &job->entries[job->next++];
+    pthread_mutex_unlock(&job->lock);
+
+    int status = buf ? compress_entry(job->root_fd, entry, buf) : -1;
+
+    pthread_mutex_lock(&job->lock);
+    entry->status = status;
+    entry->done = true;
+    pthread_cond_broadcast(&job->cond);
+  }
+  pthread_mutex_unlock(&job->lock);
+  free(buf);
+  return NULL;
+}
+
+
+static int out_flush(create_out_t *out)
+{
+  if (out->len)
+  {
+    ERR_RET_IF_NEQ(io_write_at(out->fd, out->buf, out->len, out->offset, out->stats), 0, -1);
+    out->offset += out->len;
+    out->len = 0;
+  }
+  return 0;
+}
+
+
+static int out_append(create_out_t *out, const void *data, size_t len)
+{
+  if (len > CREATE_OUT_BUFFER - out->len)
+  {
+    ERR_RET_IF_NEQ(out_flush(out), 0, -1);
+  }
+  if (len >= CREATE_OUT_BUFFER)
+  {
+    ERR_RET_IF_NEQ(io_write_at(out->fd, data, len, out->offset, out->stats), 0, -1);
+    out->offset += len;
+    return 0;
+  }
+  memcpy(out->buf + out->len, data, len);
+  out->len += len;
+  return 0;
+}
+
+
+static int out_copy(create_out_t *out, int src, uint64_t len)
+{
+  ERR_RET_IF_NEQ(out_flush(out), 0, -1);
+  ERR_RET_IF_NEQ(io_copy_range(out->fd, out->offset, src, 0, len), 0, -1);
+  out->offset += len;
+  out->stats->writes++;
+  out->stats->bytes_written += len;
+  return 0;
+}
+
+
+/**
+ * Write the local record of \a entry at the current end of \a out and add
+ * its central directory header at \a cd.
+ *
+ * @return The length of the central directory header, or 0 on failure.
+ */
+static size_t write_entry(create_out_t *out, const create_entry_t *entry, char *cd)
+{
+  uint64_t offset = out->offset + out->len;
+  if (offset > UINT32_MAX)
+  {
+    printf("Too much data to store without Zip64!\n");
+    return 0;
+  }
+
+  uint16_t gp_bits = 0;
+  for (size_t i = 0; i < entry->name_len; i++)
+  {
+    if ((unsigned char)entry->name[i] >= 0x80)
+    {
+      gp_bits = GPB_UT8_ENCODING;
+      break;
+    }
+  }
+  uint16_t version = entry->method == METHOD_DEFLATED ? CREATE_VERSION_DEFLATED : CREATE_VERSION_STORED;
+
+  local_file_header_t lf_header = {0};
+  ZIP_SET(&lf_header, signature, FILE_HEADER_SIGNATURE);
+  ZIP_SET(&lf_header, version_needed, version);
+  ZIP_SET(&lf_header, gp_bits, gp_bits);
+  ZIP_SET(&lf_header, compression_method, entry->method);
+  ZIP_SET(&lf_header, crc32, entry->crc32);
+  ZIP_SET(&lf_header, compressed_size, (uint32_t)entry->compressed_size);
+  ZIP_SET(&lf_header, uncompressed_size, (uint32_t)entry->size);
+  ZIP_SET(&lf_header, name_length, (uint16_t)entry->name_len);
+  if (out_append(out, &lf_header, sizeof(lf_header)) != 0 ||
+      out_append(out, entry->name, entry->name_len) != 0 ||
+      (entry->data && out_append(out, entry->data, entry->compressed_size) != 0) ||
+      (entry->fd >= 0 && out_copy(out, entry->fd, entry->size) != 0))
+  {
+    return 0;
+  }
+
+  /* The same attributes stripping with the normalize policy leaves */
+  uint32_t mode = entry->dir ? S_IFDIR | 0755 : S_IFREG | (entry->executable ? 0755 : 0644);
+  central_directory_header_t *cd_header = (central_directory_header_t *)cd;
+  memset(cd_header, 0, sizeof(*cd_header));
+  ZIP_SET(cd_header, signature, CENDIR_HEADER_SIGNATURE);
+  ZIP_SET(cd_header, version_made_by, (uint16_t)(HOST_UNIX << 8 | CREATE_VERSION_DEFLATED));
+  ZIP_SET(cd_header, version_needed, version);
+  ZIP_SET(cd_header, gp_bits, gp_bits);
+  ZIP_SET(cd_header, compression_method, entry->method);
+  ZIP_SET(cd_header, crc32, entry->crc32);
+  ZIP_SET(cd_header, compressed_size, (uint32_t)entry->compressed_size);
+  ZIP_SET(cd_header, uncompressed_size, (uint32_t)entry->size);
+  ZIP_SET(cd_header, file_name_length, (uint16_t)entry->name_len);
+  ZIP_SET(cd_header, external_attr, mode << 16 | (entry->dir ? MSDOS_DIR_ATTR : 0));
+  ZIP_SET(cd_header, rel_offset_local_header, (uint32_t)offset);
+  memcpy(cd + sizeof(*cd_header), entry->name, entry->name_len);
+  return sizeof(*cd_header) + entry->name_len;
+}
+
+
+/** Write every entry as it becomes ready, then the central directory. */
+static int write_archive(create_out_t *out, create_job_t *job, char *cd, const strip_options_t *opts)
+{
+  size_t cd_len = 0;
+  for (size_t i = 0; i < job->count; i++)
+  {
+    create_entry_t *entry = &job->entries[i];
+    pthread_mutex_lock(&job->lock);
+    while (!entry->done)
+    {
+      pthread_cond_wait(&job->cond, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    size_t len = entry->status == 0 ? write_entry(out, entry, cd + cd_len) : 0;
+    if (len && !opts->quiet)
+    {
+      printf("%s (%s)\n", entry->name, entry->method == METHOD_DEFLATED ? "deflated" : "stored");
+    }
+    free(entry->data);
+    entry->data = NULL;
+    if (entry->fd >= 0)
+    {
+      close(entry->fd);
+      entry->fd = -1;
+    }
+    ERR_RET_IF_NOT(len, -1);
+    cd_len += len;
+
+    pthread_mutex_lock(&job->lock);
+    job->written++;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+  }
+
+  uint64_t cd_offset = out->offset + out->len;
+  if (cd_offset > UINT32_MAX)
+  {
+    printf("Too much data to store without Zip64!\n");
+    return -1;
+  }
+  end_of_central_directory_header_t eocd = {0};
+  ZIP_SET(&eocd, signature, EO_CENDIR_HEADER_SIGNATURE);
+  ZIP_SET(&eocd, num_dir_entries_this_disk, (uint16_t)job->count);
+  ZIP_SET(&eocd, total_num_entries_cd, (uint16_t)job->count);
+  ZIP_SET(&eocd, size_of_cd, (uint32_t)cd_len);
+  ZIP_SET(&eocd, cd_offset_in_first_disk, (uint32_t)cd_offset);
+  ERR_RET_IF_NEQ(out_append(out, cd, cd_len), 0, -1);
+  ERR_RET_IF_NEQ(out_append(out, &eocd, sizeof(eocd)), 0, -1);
+  ERR_RET_IF_NEQ(out_flush(out), 0, -1);
+
+  if (opts->sync != SYNC_NONE)
+  {
+    out->stats->syncs++;
+    ERR_RET_ON_ERRNO(opts->sync == SYNC_DATA ? fdatasync(out->fd) : fsync(out->fd), -1);
+  }
+  return 0;
+}
+
+
+int create_archive(const char *out_path, const char *dir_path, unsigned jobs, strip_ctx_t *ctx)
+{
+  create_job_t job = {.window = (size_t)jobs * CREATE_WINDOW_PER_JOB};
+  entry_list_t list = {0};
+  ERR_RET_ON_ERRNO(job.root_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC), -1);
+  int walk_fd = dup(job.root_fd);
+  if (walk_fd < 0 || walk(walk_fd, "", &list) != 0)
+  {
+    printf("Could not list %s\n", dir_path);
+    goto fail_list;
+  }
+  if (list.count > UINT16_MAX)
+  {
+    printf("Too many entries to store without Zip64!\n");
+    goto fail_list;
+  }
+  qsort(list.entries, list.count, sizeof(create_entry_t), compare_name);
+  job.entries = list.entries;
+  job.count = list.count;
+  ctx->stats.archives++;
+  ctx->stats.entries += list.count;
+
+  size_t cd_len = 0;
+  for (size_t i = 0; i < list.count; i++)
+  {
+    cd_len += sizeof(central_directory_header_t) + list.entries[i].name_len;
+  }
+  scratch_reset(&ctx->scratch);
+  create_out_t out = {.stats = &ctx->stats};
+  char *cd;
+  if ((cd = scratch_alloc(&ctx->scratch, cd_len + 1)) == NULL ||
+      (out.buf = scratch_alloc(&ctx->scratch, CREATE_OUT_BUFFER)) == NULL)
+  {
+    goto fail_list;
+  }
+  if ((out.fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+  {
+    printf("Could not create %s: %s\n", out_path, strerror(errno));
+    goto fail_list;
+  }
+
+  pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.cond, NULL);
+  unsigned started = 0;
+  while (threads && started < jobs && pthread_create(&threads[started], NULL, create_worker, &job) == 0)
+  {
+    started++;
+  }
+  int ret = started ? write_archive(&out, &job, cd, ctx->opts) : -1;
+
+  pthread_mutex_lock(&job.lock);
+  job.abort = true;
+  pthread_cond_broadcast(&job.cond);
+  pthread_mutex_unlock(&job.lock);
+  for (unsigned i = 0; i < started; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_cond_destroy(&job.cond);
+  pthread_mutex_destroy(&job.lock);
+
+  /* Anything compressed ahead of a failure is still held */
+  for (size_t i = 0; i < list.count; i++)
+  {
+    free(list.entries[i].data);
+    if (list.entries[i].fd >= 0)
+    {
+      close(list.entries[i].fd);
+    }
+    free(list.entries[i].name);
+  }
+  free(list.entries);
+  close(job.root_fd);
+  if (close(out.fd) != 0 || ret != 0)
+  {
+    unlink(out_path);
+    return -1;
+  }
+  return 0;
+
+fail_list:
+  for (size_t i = 0; i < list.count; i++)
+  {
+    free(list.entries[i].name);
+  }
+  free(list.entries);
+  close(job.root_fd);
+  return -1;
+}
@@ -0,0 +1,26 @@
+/**
+ * @file
+ * Writing a purified archive straight from a directory tree.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_CREATE_H
+#define STRIPZIP_CREATE_H
+
+#include "stripzip.h"
+
+/**
+ * Create the archive \a out_path from everything under \a dir_path, in one
+ * pass. Entries are named relative to \a dir_path and written in byte order
+ * of their names, with zeroed times, normalized attributes and no extra
+ * fields, so the result is already what strip_file() would make of it.
+ * Files are deflated by \a jobs threads, and stored when that doesn't make
+ * them smaller.
+ *
+ * @return 0 on success, -1 on failure, in which case \a out_path is removed.
+ */
+int create_archive(const char *out_path, const char *dir_path, unsigned jobs, strip_ctx_t *ctx);
+
+#endif /* STRIPZIP_CREATE_H */
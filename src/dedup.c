@@ -0,0 +1,282 @@
+/**
+ * @file
+ * Finding entries that store the same data, and sharing it between them.
+ *
+ * Entries are grouped by CRC, sizes and compression method through an open
+ * addressing hash table over the central directory, so only entries that
+ * agree on all of those are ever compared byte for byte. Entries with the
+ * same key may still hold different bytes, so each group keeps a chain of
+ * leaders, the first entry found with each distinct payload, and every
+ * other member is compared with each of them in turn.
+ *
+ * Duplicates are only reported. Pointing several central directory entries
+ * at one local record would share the data, but the shared local header can
+ * only carry one of their names, and Info-ZIP unzip and Python's zipfile
+ * reject archives like that, as does --check.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "hash.h"
+#include "archive.h"
+#include "local.h"
+#include "dedup.h"
+
+/** Bytes of entry data compared at a time */
+#define DEDUP_CHUNK (64 * 1024)
+
+/** Arenas larger than this are given back after each archive when memory is
+ *  budgeted */
+#define DEDUP_SCRATCH_KEEP (1024 * 1024)
+
+/** Sentinel for an empty key table slot */
+#define DEDUP_NO_ENTRY UINT32_MAX
+
+/** What two entries must agree on to possibly hold the same data */
+typedef struct
+{
+  uint32_t crc32;
+  uint32_t compressed_size;
+  uint32_t uncompressed_size;
+  uint32_t method;
+} dedup_key_t;
+
+
+static void entry_key(const cd_entry_t *entry, dedup_key_t *key)
+{
+  *key = (dedup_key_t){
+    .crc32 = ZIP_GET(entry->header, crc32),
+    .compressed_size = ZIP_GET(entry->header, compressed_size),
+    .uncompressed_size = ZIP_GET(entry->header, uncompressed_size),
+    .method = ZIP_GET(entry->header, compression_method),
+  };
+}
+
+
+/**
+ * Set \a groups[i] to the first entry with the same key as entry \a i, or
+ * to \a i itself if there is none. Directories are never grouped.
+ */
+static int find_groups(const cd_entry_t *entries, size_t count, uint32_t *groups, scratch_t *scratch)
+{
+  size_t size = 16;
+  while (size < 2 * count)
+  {
+    size *= 2;
+  }
+  uint32_t *slots;
+  ERR_RET_IF_NOT(slots = scratch_alloc(scratch, size * sizeof(uint32_t)), -1);
+  memset(slots, 0xFF, size * sizeof(uint32_t));
+
+  for (size_t i = 0; i < count; i++)
+  {
+    groups[i] = (uint32_t)i;
+    const zip_view_t *name = &entries[i].name;
+    if (name->len && name->ptr[name->len - 1] == '/')
+    {
+      continue;
+    }
+
+    dedup_key_t key;
+    entry_key(&entries[i], &key);
+    for (size_t slot = hash64(&key, sizeof(key), 0) & (size - 1); ; slot = (slot + 1) & (size - 1))
+    {
+      uint32_t other = slots[slot];
+      if (other == DEDUP_NO_ENTRY)
+      {
+        slots[slot] = (uint32_t)i;
+        break;
+      }
+      dedup_key_t other_key;
+      entry_key(&entries[other], &other_key);
+      if (memcmp(&key, &other_key, sizeof(key)) == 0)
+      {
+        groups[i] = other;
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Compare the data of the local records \a a and \a b, which have the same
+ * compressed size.
+ *
+ * @return 1 if it is the same, 0 if not, -1 on failure.
+ */
+static int same_data(int fd, const local_record_t *a, const local_record_t *b, char *buf_a, char *buf_b,
+                     stats_t *stats)
+{
+  uint64_t len = a->compressed_size;
+  for (uint64_t done = 0; done < len; )
+  {
+    size_t chunk = len - done < DEDUP_CHUNK ? (size_t)(len - done) : DEDUP_CHUNK;
+    ERR_RET_IF_NEQ(io_read_at(fd, buf_a, chunk, a->data_offset + done, stats), 0, -1);
+    ERR_RET_IF_NEQ(io_read_at(fd, buf_b, chunk, b->data_offset + done, stats), 0, -1);
+    if (memcmp(buf_a, buf_b, chunk) != 0)
+    {
+      return 0;
+    }
+    done += chunk;
+  }
+  return 1;
+}
+
+
+/**
+ * Memory dedup_file() takes for \a archive: its central directory, and for
+ * each entry its parse, its group, its place in a chain of leaders, up to
+ * four hash table slots and a local record, taking local extra fields to be as long as the central
+ * directory's. Then two chunks of data to compare.
+ */
+static uint64_t dedup_memory_need(const archive_t *archive)
+{
+  uint64_t per_entry = sizeof(cd_entry_t) + 6 * sizeof(uint32_t) + sizeof(local_record_t) + sizeof(bool);
+  return 2 * archive->cd_len + archive->num_entries * per_entry + 2 * DEDUP_CHUNK;
+}
+
+
+int dedup_file(const char *path, strip_ctx_t *ctx)
+{
+  stats_t *stats = &ctx->stats;
+  int fd;
+  ERR_RET_ON_ERRNO(fd = open(path, O_RDONLY), -1);
+  stats->archives++;
+  scratch_reset(&ctx->scratch);
+
+  int ret = -1;
+  archive_t archive;
+  char *cd;
+  cd_entry_t *entries;
+  uint32_t *groups;
+  uint32_t *next;
+  local_record_t *records;
+  char *buf_a;
+  char *buf_b;
+  uint64_t reserved = 0;
+  if (archive_locate(fd, &archive, stats) != 0)
+  {
+    goto out;
+  }
+  if (ctx->opts->budget)
+  {
+    reserved = budget_acquire(ctx->opts->budget, dedup_memory_need(&archive));
+  }
+  if (archive_read_cd(&archive, &ctx->scratch, stats, &cd, &entries) != 0)
+  {
+    goto out;
+  }
+  size_t count = archive.num_entries;
+  stats->entries += count;
+  if ((groups = scratch_alloc(&ctx->scratch, (count + 1) * sizeof(uint32_t))) == NULL ||
+      (next = scratch_alloc(&ctx->scratch, (count + 1) * sizeof(uint32_t))) == NULL ||
+      (records = scratch_alloc(&ctx->scratch, (count + 1) * sizeof(local_record_t))) == NULL ||
+      (buf_a = scratch_alloc(&ctx->scratch, DEDUP_CHUNK)) == NULL ||
+      (buf_b = scratch_alloc(&ctx->scratch, DEDUP_CHUNK)) == NULL ||
+      find_groups(entries, count, groups, &ctx->scratch) != 0)
+  {
+    goto out;
+  }
+
+  /* Only the candidates' local records are needed */
+  bool *needed;
+  if ((needed = scratch_alloc(&ctx->scratch, count + 1)) == NULL)
+  {
+    goto out;
+  }
+  memset(needed, 0, count);
+  for (size_t i = 0; i < count; i++)
+  {
+    if (groups[i] != i)
+    {
+      needed[i] = needed[groups[i]] = true;
+    }
+  }
+
+  /* Local records run up to the signing block if there is one, else the CD */
+  uint64_t region_end = archive.sig_block_len ? archive.sig_block_offset : archive.cd_offset;
+  for (size_t i = 0; i < count; i++)
+  {
+    if (needed[i] && local_record_read(fd, entries[i].local_offset, region_end,
+                                       &records[i], &ctx->scratch, stats) != 0)
+    {
+      printf("%.*s: bad local record\n", (int)entries[i].name.len, entries[i].name.ptr);
+      goto out;
+    }
+  }
+
+  size_t duplicates = 0;
+  uint64_t saved = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    next[i] = DEDUP_NO_ENTRY;
+    uint32_t leader = groups[i];
+    if (leader == i)
+    {
+      continue;
+    }
+    const local_record_t *rec = &records[i];
+    uint32_t last = leader;
+    bool shared = false;
+    int same = 0;
+    for (; leader != DEDUP_NO_ENTRY; last = leader, leader = next[leader])
+    {
+      shared = rec->offset == records[leader].offset;
+      if (shared || (same = same_data(fd, &records[leader], rec, buf_a, buf_b, stats)) != 0)
+      {
+        break;
+      }
+    }
+    if (same < 0)
+    {
+      goto out;
+    }
+    if (leader == DEDUP_NO_ENTRY)
+    {
+      /* Same CRC and sizes as the others but different bytes; it leads a
+       * payload of its own */
+      next[last] = (uint32_t)i;
+      continue;
+    }
+    if (shared)
+    {
+      continue;
+    }
+
+    duplicates++;
+    saved += rec->end - rec->offset;
+    if (!ctx->opts->quiet)
+    {
+      printf("%.*s: same data as %.*s (%" PRIu64 " bytes)\n", (int)entries[i].name.len, entries[i].name.ptr,
+             (int)entries[leader].name.len, entries[leader].name.ptr, rec->end - rec->offset);
+    }
+  }
+  stats->duplicates += duplicates;
+  stats->duplicate_bytes += saved;
+
+  printf("%s: %zu duplicate entries, %" PRIu64 " bytes could be saved\n", path, duplicates, saved);
+  ret = 0;
+
+out:
+  if (reserved)
+  {
+    budget_release(ctx->opts->budget, reserved);
+    scratch_trim(&ctx->scratch, DEDUP_SCRATCH_KEEP);
+  }
+  close(fd);
+  return ret;
+}
@@ -0,0 +1,23 @@
+/**
+ * @file
+ * Finding entries that store the same data, and sharing it between them.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_DEDUP_H
+#define STRIPZIP_DEDUP_H
+
+#include "stripzip.h"
+
+/**
+ * Report every entry of the archive at \a path whose stored data is byte for
+ * byte the same as an earlier entry's, and how much space sharing it would
+ * save. The archive is only read.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int dedup_file(const char *path, strip_ctx_t *ctx);
+
+#endif /* STRIPZIP_DEDUP_H */
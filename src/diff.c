@@ -0,0 +1,603 @@
+/**
+ * @file
+ * Comparing two archives while ignoring the metadata StripZIP sanitizes.
+ *
+ * Entries are paired up by name through an open addressing hash table over
+ * the second archive's central directory, so matching costs one pass over
+ * each directory. Header fields are compared straight from the directories.
+ * The local headers of every pair are then read in two batches, the fixed
+ * part and then the names and extra fields, and compared the same way. The
+ * data of pairs whose headers all agree is compared last, to catch a CRC
+ * collision or a different deflate stream for the same content. Whatever
+ * lies outside the entries, a prefix, an APK signing block or the archive
+ * comment, is compared byte for byte.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "hash.h"
+#include "archive.h"
+#include "diff.h"
+
+/** Bytes of entry data compared at a time */
+#define DIFF_CHUNK (64 * 1024)
+
+/** Sentinel for an empty name table slot */
+#define DIFF_NO_ENTRY UINT32_MAX
+
+typedef struct
+{
+  const char *path;
+  int fd;
+  archive_t archive;
+  char *cd;
+  cd_entry_t *entries;
+} diff_side_t;
+
+typedef struct
+{
+  uint32_t *slots;      /**< Entry indices, DIFF_NO_ENTRY when empty */
+  size_t mask;
+} name_table_t;
+
+/** Entries of the same name in both archives */
+typedef struct
+{
+  uint32_t a;           /**< Index into the first archive's entries */
+  uint32_t b;
+  bool compare_data;    /**< The central headers agree, so only the data can tell */
+} diff_pair_t;
+
+
+static int open_side(const char *path, diff_side_t *side, strip_ctx_t *ctx)
+{
+  side->path = path;
+  ERR_RET_ON_ERRNO(side->fd = open(path, O_RDONLY), -1);
+  ctx->stats.archives++;
+  if (archive_locate(side->fd, &side->archive, &ctx->stats) != 0)
+  {
+    printf("Could not read %s\n", path);
+    close(side->fd);
+    return -1;
+  }
+  ctx->stats.entries += side->archive.num_entries;
+  return 0;
+}
+
+
+static int read_side(diff_side_t *side, strip_ctx_t *ctx)
+{
+  if (archive_read_cd(&side->archive, &ctx->scratch, &ctx->stats, &side->cd, &side->entries) != 0)
+  {
+    printf("Could not read %s\n", side->path);
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Memory diff_files() takes for \a a and \a b: both central directories
+ * parsed, a name table over b's, and for each of a's entries a pair, two
+ * local headers and their reads. Local names and extra fields are taken to
+ * be as long as the central directories'.
+ */
+static uint64_t diff_memory_need(const archive_t *a, const archive_t *b)
+{
+  uint64_t per_pair = sizeof(diff_pair_t) + 2 * (sizeof(local_file_header_t) + sizeof(io_op_t) + sizeof(size_t));
+  return 2 * (a->cd_len + b->cd_len) + (a->num_entries + b->num_entries) * sizeof(cd_entry_t) +
+         b->num_entries * (4 * sizeof(uint32_t) + sizeof(bool)) + a->num_entries * per_pair + 4 * DIFF_CHUNK;
+}
+
+
+static int build_name_table(const diff_side_t *side, name_table_t *table, scratch_t *scratch)
+{
+  size_t size = 16;
+  while (size < 2 * side->archive.num_entries)
+  {
+    size *= 2;
+  }
+  ERR_RET_IF_NOT(table->slots = scratch_alloc(scratch, size * sizeof(uint32_t)), -1);
+  memset(table->slots, 0xFF, size * sizeof(uint32_t));
+  table->mask = size - 1;
+
+  for (size_t i = 0; i < side->archive.num_entries; i++)
+  {
+    const zip_view_t *name = &side->entries[i].name;
+    for (size_t slot = hash64(name->ptr, name->len, 0) & table->mask; ; slot = (slot + 1) & table->mask)
+    {
+      uint32_t other = table->slots[slot];
+      if (other == DIFF_NO_ENTRY)
+      {
+        table->slots[slot] = (uint32_t)i;
+        break;
+      }
+      /* Duplicate names: the first one wins, as with most unzippers */
+      const zip_view_t *other_name = &side->entries[other].name;
+      if (other_name->len == name->len && memcmp(other_name->ptr, name->ptr, name->len) == 0)
+      {
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+
+static uint32_t find_name(const diff_side_t *side, const name_table_t *table, const zip_view_t *name)
+{
+  for (size_t slot = hash64(name->ptr, name->len, 0) & table->mask; ; slot = (slot + 1) & table->mask)
+  {
+    uint32_t i = table->slots[slot];
+    if (i == DIFF_NO_ENTRY)
+    {
+      return DIFF_NO_ENTRY;
+    }
+    const zip_view_t *other = &side->entries[i].name;
+    if (other->len == name->len && memcmp(other->ptr, name->ptr, name->len) == 0)
+    {
+      return i;
+    }
+  }
+}
+
+
+/** Extra fields that purify_extra_data() neutralizes, and so don't count */
+static bool is_sanitized_extra(uint16_t id)
+{
+  return id == 0x5455 || id == 0x7875 || id == STRIPZIP_OPTION_HEADER;
+}
+
+
+/**
+ * Step to the next extra field at or after \a *pos worth comparing.
+ *
+ * @return False at the end of the extra field.
+ */
+static bool next_significant_extra(const zip_view_t *extra, size_t *pos, const char **field, size_t *field_len)
+{
+  while (extra->len - *pos >= sizeof(extra_header_t))
+  {
+    const extra_header_t *hdr = (const extra_header_t *)(extra->ptr + *pos);
+    size_t len = sizeof(extra_header_t) + ZIP_GET(hdr, length);
+    if (len > extra->len - *pos)
+    {
+      /* Malformed; compare whatever is left as is */
+      break;
+    }
+    *pos += len;
+    if (!is_sanitized_extra(ZIP_GET(hdr, id)))
+    {
+      *field = (const char *)hdr;
+      *field_len = len;
+      return true;
+    }
+  }
+  *field = extra->ptr + *pos;
+  *field_len = extra->len - *pos;
+  *pos = extra->len;
+  return *field_len != 0;
+}
+
+
+static bool extras_equal(const zip_view_t *a, const zip_view_t *b)
+{
+  size_t pos_a = 0;
+  size_t pos_b = 0;
+  for (;;)
+  {
+    const char *field_a;
+    const char *field_b;
+    size_t len_a;
+    size_t len_b;
+    bool more_a = next_significant_extra(a, &pos_a, &field_a, &len_a);
+    bool more_b = next_significant_extra(b, &pos_b, &field_b, &len_b);
+    if (!more_a || !more_b)
+    {
+      return more_a == more_b;
+    }
+    if (len_a != len_b || memcmp(field_a, field_b, len_a) != 0)
+    {
+      return false;
+    }
+  }
+}
+
+
+/**
+ * Compare the central directory headers of an entry present in both archives.
+ *
+ * @return True if anything differs.
+ */
+static bool diff_headers(const cd_entry_t *a, const cd_entry_t *b)
+{
+  const central_directory_header_t *ha = a->header;
+  const central_directory_header_t *hb = b->header;
+  bool differs = false;
+
+#define DIFF_FIELD(field)                                                                     \
+  do {                                                                                        \
+    if (ZIP_GET(ha, field) != ZIP_GET(hb, field))                                             \
+    {                                                                                         \
+      printf("%.*s: %s 0x%x != 0x%x\n", (int)a->name.len, a->name.ptr, #field,               \
+             ZIP_GET(ha, field), ZIP_GET(hb, field));                                         \
+      differs = true;                                                                         \
+    }                                                                                         \
+  } while (0)
+
+  DIFF_FIELD(version_made_by);
+  DIFF_FIELD(version_needed);
+  DIFF_FIELD(gp_bits);
+  DIFF_FIELD(compression_method);
+  DIFF_FIELD(crc32);
+  DIFF_FIELD(compressed_size);
+  DIFF_FIELD(uncompressed_size);
+  DIFF_FIELD(internal_attr);
+  DIFF_FIELD(external_attr);
+
+#undef DIFF_FIELD
+
+  if (!extras_equal(&a->extra, &b->extra))
+  {
+    printf("%.*s: extra fields differ\n", (int)a->name.len, a->name.ptr);
+    differs = true;
+  }
+  if (a->comment.len != b->comment.len || memcmp(a->comment.ptr, b->comment.ptr, a->comment.len) != 0)
+  {
+    printf("%.*s: comments differ\n", (int)a->name.len, a->name.ptr);
+    differs = true;
+  }
+  return differs;
+}
+
+
+/** File offset of an entry's data, given its local header. */
+static uint64_t data_offset(const cd_entry_t *entry, const local_file_header_t *lf_header)
+{
+  return entry->local_offset + sizeof(local_file_header_t) +
+         ZIP_GET(lf_header, name_length) + ZIP_GET(lf_header, extra_field_length);
+}
+
+
+/**
+ * Compare the local headers of an entry present in both archives, given
+ * their names and extra fields in \a var_a and \a var_b.
+ *
+ * @return True if anything differs.
+ */
+static bool diff_local_headers(const cd_entry_t *entry, const local_file_header_t *ha, char *var_a,
+                               const local_file_header_t *hb, char *var_b)
+{
+  bool differs = false;
+
+#define DIFF_LOCAL_FIELD(field)                                                               \
+  do {                                                                                        \
+    if (ZIP_GET(ha, field) != ZIP_GET(hb, field))                                             \
+    {                                                                                         \
+      printf("%.*s: local %s 0x%x != 0x%x\n", (int)entry->name.len, entry->name.ptr, #field,  \
+             ZIP_GET(ha, field), ZIP_GET(hb, field));                                         \
+      differs = true;                                                                         \
+    }                                                                                         \
+  } while (0)
+
+  DIFF_LOCAL_FIELD(version_needed);
+  DIFF_LOCAL_FIELD(gp_bits);
+  DIFF_LOCAL_FIELD(compression_method);
+  DIFF_LOCAL_FIELD(crc32);
+  DIFF_LOCAL_FIELD(compressed_size);
+  DIFF_LOCAL_FIELD(uncompressed_size);
+
+#undef DIFF_LOCAL_FIELD
+
+  size_t name_a = ZIP_GET(ha, name_length);
+  size_t name_b = ZIP_GET(hb, name_length);
+  if (name_a != name_b || memcmp(var_a, var_b, name_a) != 0)
+  {
+    printf("%.*s: local names differ\n", (int)entry->name.len, entry->name.ptr);
+    differs = true;
+  }
+  zip_view_t extra_a = {var_a + name_a, ZIP_GET(ha, extra_field_length)};
+  zip_view_t extra_b = {var_b + name_b, ZIP_GET(hb, extra_field_length)};
+  if (!extras_equal(&extra_a, &extra_b))
+  {
+    printf("%.*s: local extra fields differ\n", (int)entry->name.len, entry->name.ptr);
+    differs = true;
+  }
+  return differs;
+}
+
+
+/**
+ * Compare \a len bytes at \a offset_a in \a a with those at \a offset_b in
+ * \a b, using the DIFF_CHUNK byte buffers \a buf_a and \a buf_b.
+ *
+ * @param at Set to the offset of the first difference.
+ * @return 1 if they differ, 0 if not, -1 on failure.
+ */
+static int diff_bytes(const diff_side_t *a, uint64_t offset_a, const diff_side_t *b, uint64_t offset_b,
+                      uint64_t len, char *buf_a, char *buf_b, uint64_t *at, stats_t *stats)
+{
+  for (uint64_t done = 0; done < len; )
+  {
+    size_t chunk = len - done < DIFF_CHUNK ? (size_t)(len - done) : DIFF_CHUNK;
+    ERR_RET_IF_NEQ(io_read_at(a->fd, buf_a, chunk, offset_a + done, stats), 0, -1);
+    ERR_RET_IF_NEQ(io_read_at(b->fd, buf_b, chunk, offset_b + done, stats), 0, -1);
+    if (memcmp(buf_a, buf_b, chunk) != 0)
+    {
+      size_t i = 0;
+      while (buf_a[i] == buf_b[i])
+      {
+        i++;
+      }
+      *at = done + i;
+      return 1;
+    }
+    done += chunk;
+  }
+  return 0;
+}
+
+
+/**
+ * Compare the local headers of the \a count entry pairs \a pairs, then the
+ * data of those whose headers all agree.
+ *
+ * @return The number of pairs that differ, or -1 on failure.
+ */
+static long diff_locals(const diff_side_t *a, const diff_side_t *b, const diff_pair_t *pairs, size_t count,
+                        strip_ctx_t *ctx)
+{
+  local_file_header_t *headers;
+  io_op_t *ops;
+  size_t *var_pos;
+  char *buf_a;
+  char *buf_b;
+  ERR_RET_IF_NOT(headers = scratch_alloc(&ctx->scratch, 2 * count * sizeof(local_file_header_t)), -1);
+  ERR_RET_IF_NOT(ops = scratch_alloc(&ctx->scratch, 2 * count * sizeof(io_op_t)), -1);
+  ERR_RET_IF_NOT(var_pos = scratch_alloc(&ctx->scratch, 2 * count * sizeof(size_t)), -1);
+  ERR_RET_IF_NOT(buf_a = scratch_alloc(&ctx->scratch, DIFF_CHUNK), -1);
+  ERR_RET_IF_NOT(buf_b = scratch_alloc(&ctx->scratch, DIFF_CHUNK), -1);
+
+  /* Every local header of both archives in one batch */
+  for (size_t i = 0; i < count; i++)
+  {
+    ops[2 * i] = (io_op_t){.fd = a->fd, .write = false, .offset = a->entries[pairs[i].a].local_offset,
+                           .buf = &headers[2 * i], .len = sizeof(local_file_header_t)};
+    ops[2 * i + 1] = (io_op_t){.fd = b->fd, .write = false, .offset = b->entries[pairs[i].b].local_offset,
+                               .buf = &headers[2 * i + 1], .len = sizeof(local_file_header_t)};
+  }
+  ERR_RET_IF_NEQ(io_submit_batch(ctx->io, ops, 2 * count, &ctx->stats), 0, -1);
+
+  /* Then the names and extra fields of the good ones in another */
+  size_t var_len = 0;
+  size_t num_ops = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    bool good = ZIP_GET(&headers[2 * i], signature) == FILE_HEADER_SIGNATURE &&
+                ZIP_GET(&headers[2 * i + 1], signature) == FILE_HEADER_SIGNATURE;
+    for (size_t k = 2 * i; k < 2 * i + 2; k++)
+    {
+      var_pos[k] = good ? var_len : SIZE_MAX;
+      if (good)
+      {
+        size_t len = (size_t)ZIP_GET(&headers[k], name_length) + ZIP_GET(&headers[k], extra_field_length);
+        const diff_side_t *side = k % 2 ? b : a;
+        uint32_t index = k % 2 ? pairs[i].b : pairs[i].a;
+        ops[num_ops++] = (io_op_t){.fd = side->fd, .write = false, .len = len,
+                                   .offset = side->entries[index].local_offset + sizeof(local_file_header_t)};
+        var_len += len;
+      }
+    }
+  }
+  char *vars;
+  ERR_RET_IF_NOT(vars = scratch_alloc(&ctx->scratch, var_len + 1), -1);
+  for (size_t k = 0, op = 0; k < 2 * count; k++)
+  {
+    if (var_pos[k] != SIZE_MAX)
+    {
+      ops[op++].buf = vars + var_pos[k];
+    }
+  }
+  ERR_RET_IF_NEQ(io_submit_batch(ctx->io, ops, num_ops, &ctx->stats), 0, -1);
+
+  long differing = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    const cd_entry_t *entry_a = &a->entries[pairs[i].a];
+    const cd_entry_t *entry_b = &b->entries[pairs[i].b];
+    if (var_pos[2 * i] == SIZE_MAX)
+    {
+      printf("%.*s: bad local header\n", (int)entry_a->name.len, entry_a->name.ptr);
+      differing++;
+      continue;
+    }
+    if (diff_local_headers(entry_a, &headers[2 * i], vars + var_pos[2 * i],
+                           &headers[2 * i + 1], vars + var_pos[2 * i + 1]))
+    {
+      differing++;
+      continue;
+    }
+    if (!pairs[i].compare_data)
+    {
+      continue;
+    }
+
+    uint64_t at;
+    int ret = diff_bytes(a, data_offset(entry_a, &headers[2 * i]), b, data_offset(entry_b, &headers[2 * i + 1]),
+                         ZIP_GET(entry_a->header, compressed_size), buf_a, buf_b, &at, &ctx->stats);
+    if (ret < 0)
+    {
+      return -1;
+    }
+    if (ret)
+    {
+      printf("%.*s: data differs at offset %" PRIu64 " despite a matching CRC\n",
+             (int)entry_a->name.len, entry_a->name.ptr, at);
+      differing++;
+    }
+  }
+  return differing;
+}
+
+
+/**
+ * Compare a region outside the entries, \a what, which is \a len_a bytes at
+ * \a offset_a in \a a and \a len_b bytes at \a offset_b in \a b.
+ *
+ * @return 1 if they differ, 0 if not, -1 on failure.
+ */
+static int diff_region(const diff_side_t *a, uint64_t offset_a, uint64_t len_a,
+                       const diff_side_t *b, uint64_t offset_b, uint64_t len_b, const char *what, strip_ctx_t *ctx)
+{
+  if (len_a != len_b)
+  {
+    printf("%s: %" PRIu64 " bytes != %" PRIu64 " bytes\n", what, len_a, len_b);
+    return 1;
+  }
+  scratch_mark_t mark = scratch_mark(&ctx->scratch);
+  char *buf_a;
+  char *buf_b;
+  uint64_t at;
+  int ret = -1;
+  if ((buf_a = scratch_alloc(&ctx->scratch, DIFF_CHUNK)) != NULL &&
+      (buf_b = scratch_alloc(&ctx->scratch, DIFF_CHUNK)) != NULL &&
+      (ret = diff_bytes(a, offset_a, b, offset_b, len_a, buf_a, buf_b, &at, &ctx->stats)) > 0)
+  {
+    printf("%s: differs at offset %" PRIu64 "\n", what, at);
+  }
+  scratch_release(&ctx->scratch, mark);
+  return ret;
+}
+
+
+/**
+ * Compare everything outside the entries: the prefix, the APK signing block
+ * and the archive comment.
+ *
+ * @return The number of regions that differ, or -1 on failure.
+ */
+static long diff_outside(const diff_side_t *a, const diff_side_t *b, strip_ctx_t *ctx)
+{
+  const archive_t *aa = &a->archive;
+  const archive_t *ab = &b->archive;
+  uint64_t comment_a = aa->eocd_offset + sizeof(end_of_central_directory_header_t);
+  uint64_t comment_b = ab->eocd_offset + sizeof(end_of_central_directory_header_t);
+  int ret[3];
+  ret[0] = diff_region(a, 0, aa->bias, b, 0, ab->bias, "Prefix", ctx);
+  ret[1] = diff_region(a, aa->sig_block_offset, aa->sig_block_len, b, ab->sig_block_offset, ab->sig_block_len,
+                       "APK signing block", ctx);
+  ret[2] = diff_region(a, comment_a, aa->size - comment_a, b, comment_b, ab->size - comment_b,
+                       "Archive comment", ctx);
+  long differing = 0;
+  for (size_t i = 0; i < 3; i++)
+  {
+    if (ret[i] < 0)
+    {
+      return -1;
+    }
+    differing += ret[i];
+  }
+  return differing;
+}
+
+
+int diff_files(const char *path_a, const char *path_b, strip_ctx_t *ctx)
+{
+  diff_side_t a;
+  diff_side_t b;
+  scratch_reset(&ctx->scratch);
+  if (open_side(path_a, &a, ctx) != 0)
+  {
+    return -1;
+  }
+  if (open_side(path_b, &b, ctx) != 0)
+  {
+    close(a.fd);
+    return -1;
+  }
+
+  int ret = -1;
+  uint64_t reserved = 0;
+  name_table_t table;
+  bool *matched;
+  diff_pair_t *pairs;
+  size_t num_pairs = 0;
+  size_t differences = 0;
+  bool reordered = false;
+  uint32_t last_j = DIFF_NO_ENTRY;
+  if (ctx->opts->budget)
+  {
+    reserved = budget_acquire(ctx->opts->budget, diff_memory_need(&a.archive, &b.archive));
+  }
+  if (read_side(&a, ctx) != 0 || read_side(&b, ctx) != 0 ||
+      build_name_table(&b, &table, &ctx->scratch) != 0 ||
+      (matched = scratch_alloc(&ctx->scratch, b.archive.num_entries + 1)) == NULL ||
+      (pairs = scratch_alloc(&ctx->scratch, (a.archive.num_entries + 1) * sizeof(diff_pair_t))) == NULL)
+  {
+    goto out;
+  }
+  memset(matched, 0, b.archive.num_entries);
+
+  for (size_t i = 0; i < a.archive.num_entries; i++)
+  {
+    const cd_entry_t *entry = &a.entries[i];
+    uint32_t j = find_name(&b, &table, &entry->name);
+    if (j == DIFF_NO_ENTRY || matched[j])
+    {
+      printf("Only in %s: %.*s\n", path_a, (int)entry->name.len, entry->name.ptr);
+      differences++;
+      continue;
+    }
+    matched[j] = true;
+    reordered |= last_j != DIFF_NO_ENTRY && j < last_j;
+    last_j = j;
+
+    bool differs = diff_headers(entry, &b.entries[j]);
+    differences += differs;
+    /* With the same CRC and sizes, only the bytes can tell */
+    pairs[num_pairs++] = (diff_pair_t){.a = (uint32_t)i, .b = j,
+                                       .compare_data = !differs && ZIP_GET(entry->header, compressed_size)};
+  }
+  for (size_t j = 0; j < b.archive.num_entries; j++)
+  {
+    if (!matched[j])
+    {
+      printf("Only in %s: %.*s\n", path_b, (int)b.entries[j].name.len, b.entries[j].name.ptr);
+      differences++;
+    }
+  }
+  if (reordered)
+  {
+    printf("Entries are in a different order\n");
+    differences++;
+  }
+
+  long differing = diff_locals(&a, &b, pairs, num_pairs, ctx);
+  long outside = differing < 0 ? -1 : diff_outside(&a, &b, ctx);
+  if (outside >= 0)
+  {
+    differences += (size_t)differing + (size_t)outside;
+    ret = differences ? 1 : 0;
+  }
+
+out:
+  if (reserved)
+  {
+    budget_release(ctx->opts->budget, reserved);
+  }
+  close(a.fd);
+  close(b.fd);
+  return ret;
+}
@@ -0,0 +1,26 @@
+/**
+ * @file
+ * Comparing two archives while ignoring the metadata StripZIP sanitizes.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_DIFF_H
+#define STRIPZIP_DIFF_H
+
+#include "stripzip.h"
+
+/**
+ * Report every entry that is only in one of the archives at \a path_a and
+ * \a path_b, and every central or local header field that differs between
+ * entries of the same name. Times and the extra fields StripZIP neutralizes
+ * are ignored. Entry data is only compared when CRC and sizes agree. The
+ * prefix, APK signing block and archive comment must match exactly.
+ *
+ * @return 0 if the archives are equivalent, 1 if they differ, -1 if either
+ *         can't be read.
+ */
+int diff_files(const char *path_a, const char *path_b, strip_ctx_t *ctx);
+
+#endif /* STRIPZIP_DIFF_H */
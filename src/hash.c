@@ -0,0 +1,100 @@
+/**
+ * @file
+ * Fast non-cryptographic hashing.
+ *
+ * This is XXH64 as described at https://github.com/Cyan4973/xxHash, written
+ * out here so that StripZIP keeps no external dependencies.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zip_format.h"
+#include "hash.h"
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+
+static inline uint64_t rotl64(uint64_t x, unsigned r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+  acc += input * PRIME64_2;
+  return rotl64(acc, 31) * PRIME64_1;
+}
+
+
+static inline uint64_t merge_round64(uint64_t acc, uint64_t val)
+{
+  acc ^= round64(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+
+uint64_t hash64(const void *data, size_t len, uint64_t seed)
+{
+  /* XXH64 is defined over little-endian words, as is ZIP */
+  const uint8_t *p = data;
+  const uint8_t *end = p + len;
+  uint64_t h;
+
+  if (len >= 32)
+  {
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+    for (; end - p >= 32; p += 32)
+    {
+      v1 = round64(v1, zip_load64(p));
+      v2 = round64(v2, zip_load64(p + 8));
+      v3 = round64(v3, zip_load64(p + 16));
+      v4 = round64(v4, zip_load64(p + 24));
+    }
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = merge_round64(h, v1);
+    h = merge_round64(h, v2);
+    h = merge_round64(h, v3);
+    h = merge_round64(h, v4);
+  }
+  else
+  {
+    h = seed + PRIME64_5;
+  }
+
+  h += len;
+  for (; end - p >= 8; p += 8)
+  {
+    h ^= round64(0, zip_load64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (end - p >= 4)
+  {
+    h ^= zip_load32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; p++)
+  {
+    h ^= *p * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
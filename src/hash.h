@@ -0,0 +1,21 @@
+/**
+ * @file
+ * Fast non-cryptographic hashing.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_HASH_H
+#define STRIPZIP_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * XXH64 of \a len bytes at \a data. Chain calls by passing the previous
+ * hash as \a seed to hash data that isn't contiguous.
+ */
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
+#endif /* STRIPZIP_HASH_H */
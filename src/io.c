@@ -0,0 +1,622 @@
+/**
+ * @file
+ * Positional I/O engines.
+ *
+ * The io_uring engine talks to the kernel directly through the raw system
+ * calls rather than liburing so that StripZIP keeps no external dependencies.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "err.h"
+#include "io.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/** A run of adjacent operations, issued as one vectored transfer */
+typedef struct
+{
+  int fd;
+  bool write;
+  uint64_t offset;
+  size_t len;
+  struct iovec *iov;
+  int iovcnt;
+} io_run_t;
+
+struct io_engine
+{
+  io_engine_kind_t kind;
+  io_run_t *runs;       /**< Room for a batch's worth of runs */
+  struct iovec *iovs;
+  size_t capacity;
+#ifdef HAVE_IO_URING
+  int ring_fd;
+  unsigned depth;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+#endif
+};
+
+
+static void count_op(stats_t *stats, bool write, uint64_t offset, size_t len)
+{
+  if (offset != stats->io_position)
+  {
+    stats->seeks++;
+  }
+  stats->io_position = offset + len;
+  if (write)
+  {
+    stats->writes++;
+    stats->bytes_written += len;
+  }
+  else
+  {
+    stats->reads++;
+    stats->bytes_read += len;
+  }
+}
+
+
+/** Step past \a n transferred bytes of the vector starting at \a iov[*idx]. */
+static void advance_iov(struct iovec *iov, int iovcnt, int *idx, size_t n)
+{
+  while (*idx < iovcnt && n >= iov[*idx].iov_len)
+  {
+    n -= iov[*idx].iov_len;
+    (*idx)++;
+  }
+  if (*idx < iovcnt)
+  {
+    iov[*idx].iov_base = (char *)iov[*idx].iov_base + n;
+    iov[*idx].iov_len -= n;
+  }
+}
+
+
+/** Finish a partially transferred run synchronously. */
+static int finish_run(const io_run_t *run, size_t done)
+{
+  int idx = 0;
+  advance_iov(run->iov, run->iovcnt, &idx, done);
+  while (done < run->len)
+  {
+    ssize_t ret = run->write ?
+        pwritev(run->fd, run->iov + idx, run->iovcnt - idx, (off_t)(run->offset + done)) :
+        preadv(run->fd, run->iov + idx, run->iovcnt - idx, (off_t)(run->offset + done));
+    if (ret < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    ERR_RET_ON_ERRNO((int)ret, -1);
+    if (ret == 0)
+    {
+      /* Ran into the end of the file */
+      return -1;
+    }
+    done += (size_t)ret;
+    advance_iov(run->iov, run->iovcnt, &idx, (size_t)ret);
+  }
+  return 0;
+}
+
+
+int io_read_at(int fd, void *buf, size_t len, uint64_t offset, stats_t *stats)
+{
+  uint64_t start = stats_now();
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  io_run_t run = {.fd = fd, .write = false, .offset = offset, .len = len, .iov = &iov, .iovcnt = 1};
+  count_op(stats, false, offset, len);
+  int ret = finish_run(&run, 0);
+  stats_phase_end(stats, PHASE_READ, start);
+  return ret;
+}
+
+
+int io_write_at(int fd, const void *buf, size_t len, uint64_t offset, stats_t *stats)
+{
+  uint64_t start = stats_now();
+  /* finish_run() never writes through the buffers of a write */
+  struct iovec iov = {.iov_base = (void *)(uintptr_t)buf, .iov_len = len};
+  io_run_t run = {.fd = fd, .write = true, .offset = offset, .len = len, .iov = &iov, .iovcnt = 1};
+  count_op(stats, true, offset, len);
+  int ret = finish_run(&run, 0);
+  stats_phase_end(stats, PHASE_WRITE, start);
+  return ret;
+}
+
+
+int io_copy_range(int dst, uint64_t dst_offset, int src, uint64_t src_offset, uint64_t len)
+{
+  /* Copy in the kernel; copy_file_range can't cross filesystems on older
+   * kernels, but sendfile can */
+  loff_t in = (loff_t)src_offset;
+  loff_t out = (loff_t)dst_offset;
+  bool use_sendfile = false;
+  uint64_t done = 0;
+  while (done < len)
+  {
+    ssize_t ret;
+    if (!use_sendfile)
+    {
+      ret = copy_file_range(src, &in, dst, &out, len - done, 0);
+      if (ret < 0 && done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+      {
+        use_sendfile = true;
+        continue;
+      }
+    }
+    else
+    {
+      off_t offset = (off_t)in;
+      ERR_RET_ON_ERRNO((int)lseek(dst, (off_t)(dst_offset + done), SEEK_SET), -1);
+      ret = sendfile(dst, src, &offset, len - done);
+      in = offset;
+    }
+    ERR_RET_ON_ERRNO((int)ret, -1);
+    ERR_RET_IF_NOT(ret, -1);
+    done += (uint64_t)ret;
+  }
+  return 0;
+}
+
+
+int io_copy_file(int dst, int src, uint64_t len)
+{
+#ifdef FICLONE
+  if (ioctl(dst, FICLONE, src) == 0)
+  {
+    ERR_RET_ON_ERRNO(ftruncate(dst, (off_t)len), -1);
+    return 0;
+  }
+#endif
+
+  ERR_RET_IF_NEQ(io_copy_range(dst, 0, src, 0, len), 0, -1);
+  ERR_RET_ON_ERRNO(ftruncate(dst, (off_t)len), -1);
+  return 0;
+}
+
+
+int io_sync_parent(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  char *dir = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+  ERR_RET_IF_NOT(dir, -1);
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  free(dir);
+  ERR_RET_ON_ERRNO(fd, -1);
+  int ret = fsync(fd);
+  close(fd);
+  ERR_RET_ON_ERRNO(ret, -1);
+  return 0;
+}
+
+
+int io_create_beside(const char *path, int fd, char **tmp_path)
+{
+  static const char suffix[] = ".stripzip-XXXXXX";
+  struct stat st;
+  ERR_RET_ON_ERRNO(fstat(fd, &st), -1);
+  ERR_RET_IF_NOT(*tmp_path = malloc(strlen(path) + sizeof(suffix)), -1);
+  strcpy(*tmp_path, path);
+  strcat(*tmp_path, suffix);
+
+  int tmp = mkstemp(*tmp_path);
+  if (tmp < 0)
+  {
+    printf("Could not create a temporary file next to %s: %s\n", path, strerror(errno));
+    free(*tmp_path);
+    *tmp_path = NULL;
+    return -1;
+  }
+  /* Keep the original's permissions; ownership only if we're allowed */
+  if (fchmod(tmp, st.st_mode & 07777) != 0 || (fchown(tmp, st.st_uid, st.st_gid) != 0 && errno != EPERM))
+  {
+    close(tmp);
+    unlink(*tmp_path);
+    free(*tmp_path);
+    *tmp_path = NULL;
+    return -1;
+  }
+  return tmp;
+}
+
+
+int io_replace(const char *path, int tmp, char *tmp_path, int ret)
+{
+  if (ret == 0 && (fsync(tmp) != 0 || rename(tmp_path, path) != 0 || io_sync_parent(path) != 0))
+  {
+    printf("Could not replace %s: %s\n", path, strerror(errno));
+    ret = -1;
+  }
+  if (ret != 0)
+  {
+    unlink(tmp_path);
+  }
+  close(tmp);
+  free(tmp_path);
+  return ret;
+}
+
+
+int io_sync_filesystem(const char *path)
+{
+  int fd;
+  ERR_RET_ON_ERRNO(fd = open(path, O_RDONLY | O_CLOEXEC), -1);
+  int ret = syncfs(fd);
+  close(fd);
+  ERR_RET_ON_ERRNO(ret, -1);
+  return 0;
+}
+
+
+#ifdef HAVE_IO_URING
+
+static bool uring_setup(io_engine_t *io, unsigned depth)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  long fd = syscall(__NR_io_uring_setup, depth, &params);
+  if (fd < 0)
+  {
+    return false;
+  }
+  io->ring_fd = (int)fd;
+  io->depth = params.sq_entries;
+
+  io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (io->cq_ring_size > io->sq_ring_size)
+    {
+      io->sq_ring_size = io->cq_ring_size;
+    }
+    io->cq_ring_size = io->sq_ring_size;
+  }
+
+  io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     io->ring_fd, IORING_OFF_SQ_RING);
+  if (io->sq_ring == MAP_FAILED)
+  {
+    close(io->ring_fd);
+    return false;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    io->cq_ring = io->sq_ring;
+  }
+  else
+  {
+    io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       io->ring_fd, IORING_OFF_CQ_RING);
+    if (io->cq_ring == MAP_FAILED)
+    {
+      munmap(io->sq_ring, io->sq_ring_size);
+      close(io->ring_fd);
+      return false;
+    }
+  }
+  io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  io->ring_fd, IORING_OFF_SQES);
+  if (io->sqes == MAP_FAILED)
+  {
+    if (io->cq_ring != io->sq_ring)
+    {
+      munmap(io->cq_ring, io->cq_ring_size);
+    }
+    munmap(io->sq_ring, io->sq_ring_size);
+    close(io->ring_fd);
+    return false;
+  }
+
+  char *sq = io->sq_ring;
+  char *cq = io->cq_ring;
+  io->sq_head  = (unsigned *)(sq + params.sq_off.head);
+  io->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+  io->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+  io->sq_array = (unsigned *)(sq + params.sq_off.array);
+  io->cq_head  = (unsigned *)(cq + params.cq_off.head);
+  io->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+  io->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+  io->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return true;
+}
+
+
+static void uring_teardown(io_engine_t *io)
+{
+  munmap(io->sqes, io->sqes_size);
+  if (io->cq_ring != io->sq_ring)
+  {
+    munmap(io->cq_ring, io->cq_ring_size);
+  }
+  munmap(io->sq_ring, io->sq_ring_size);
+  close(io->ring_fd);
+}
+
+
+/**
+ * Run up to io->depth runs: queue one SQE each, submit them with a single
+ * io_uring_enter and reap every completion.
+ */
+static int uring_run(io_engine_t *io, io_run_t *runs, size_t count)
+{
+  unsigned tail = *io->sq_tail;
+  for (size_t i = 0; i < count; i++)
+  {
+    unsigned idx = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = runs[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = runs[i].fd;
+    sqe->off = runs[i].offset;
+    sqe->addr = (uintptr_t)runs[i].iov;
+    sqe->len = (uint32_t)runs[i].iovcnt;
+    sqe->user_data = i;
+    io->sq_array[idx] = idx;
+    tail++;
+  }
+  __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+
+  int ret = 0;
+  size_t submitted = 0;
+  size_t completed = 0;
+  while (completed < count)
+  {
+    unsigned to_submit = (unsigned)(count - submitted);
+    long entered = syscall(__NR_io_uring_enter, io->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (entered < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+      {
+        continue;
+      }
+      ERR_RET_ON_ERRNO((int)entered, -1);
+    }
+    submitted += (size_t)entered;
+
+    unsigned head = *io->cq_head;
+    unsigned cq_tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; head++)
+    {
+      struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+      const io_run_t *run = &runs[cqe->user_data];
+      if (cqe->res < 0)
+      {
+        /* Retry the odd failure (e.g. -EAGAIN) the slow way */
+        errno = -cqe->res;
+        if (finish_run(run, 0) != 0)
+        {
+          ret = -1;
+        }
+      }
+      else if ((size_t)cqe->res < run->len && finish_run(run, (size_t)cqe->res) != 0)
+      {
+        ret = -1;
+      }
+      completed++;
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  return ret;
+}
+
+#endif /* HAVE_IO_URING */
+
+
+io_engine_t *io_engine_open(io_engine_kind_t kind, unsigned depth)
+{
+  io_engine_t *io = calloc(1, sizeof(io_engine_t));
+  if (io == NULL)
+  {
+    return NULL;
+  }
+
+  io->kind = IO_ENGINE_PREAD;
+#ifdef HAVE_IO_URING
+  if (kind != IO_ENGINE_PREAD && uring_setup(io, depth ? depth : IO_DEFAULT_DEPTH))
+  {
+    io->kind = IO_ENGINE_URING;
+  }
+#else
+  (void)kind;
+  (void)depth;
+#endif
+
+  return io;
+}
+
+
+void io_engine_close(io_engine_t *io)
+{
+  if (io == NULL)
+  {
+    return;
+  }
+#ifdef HAVE_IO_URING
+  if (io->kind == IO_ENGINE_URING)
+  {
+    uring_teardown(io);
+  }
+#endif
+  free(io->runs);
+  free(io->iovs);
+  free(io);
+}
+
+
+io_engine_t *io_engine_clone(const io_engine_t *io)
+{
+#ifdef HAVE_IO_URING
+  return io_engine_open(io->kind, io->kind == IO_ENGINE_URING ? io->depth : 0);
+#else
+  return io_engine_open(io->kind, 0);
+#endif
+}
+
+
+const char *io_engine_name(const io_engine_t *io)
+{
+  return io->kind == IO_ENGINE_URING ? "io_uring" : "pread";
+}
+
+
+static int compare_ops(const void *a, const void *b)
+{
+  const io_op_t *op_a = a;
+  const io_op_t *op_b = b;
+  if (op_a->fd != op_b->fd)
+  {
+    return op_a->fd < op_b->fd ? -1 : 1;
+  }
+  if (op_a->write != op_b->write)
+  {
+    return op_a->write ? 1 : -1;
+  }
+  return op_a->offset < op_b->offset ? -1 : op_a->offset > op_b->offset;
+}
+
+
+/**
+ * Group \a ops into runs of operations that are adjacent in the same file,
+ * so that e.g. a header and the fields following it are patched together.
+ *
+ * @return The number of runs, or 0 if out of memory.
+ */
+static size_t build_runs(io_engine_t *io, io_op_t *ops, size_t count)
+{
+  if (count > io->capacity)
+  {
+    io_run_t *runs = realloc(io->runs, count * sizeof(io_run_t));
+    if (runs)
+    {
+      io->runs = runs;
+    }
+    struct iovec *iovs = realloc(io->iovs, count * sizeof(struct iovec));
+    if (iovs)
+    {
+      io->iovs = iovs;
+    }
+    if (runs == NULL || iovs == NULL)
+    {
+      return 0;
+    }
+    io->capacity = count;
+  }
+
+  /* Batches are normally built in file order already */
+  for (size_t i = 1; i < count; i++)
+  {
+    if (compare_ops(&ops[i - 1], &ops[i]) > 0)
+    {
+      qsort(ops, count, sizeof(io_op_t), compare_ops);
+      break;
+    }
+  }
+
+  size_t num_runs = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    io_run_t *prev = num_runs ? &io->runs[num_runs - 1] : NULL;
+    io->iovs[i] = (struct iovec){.iov_base = ops[i].buf, .iov_len = ops[i].len};
+    if (prev && prev->fd == ops[i].fd && prev->write == ops[i].write &&
+        prev->offset + prev->len == ops[i].offset && prev->iovcnt < IOV_MAX)
+    {
+      prev->len += ops[i].len;
+      prev->iovcnt++;
+    }
+    else
+    {
+      io->runs[num_runs++] = (io_run_t){.fd = ops[i].fd, .write = ops[i].write, .offset = ops[i].offset,
+                                        .len = ops[i].len, .iov = &io->iovs[i], .iovcnt = 1};
+    }
+  }
+  return num_runs;
+}
+
+
+int io_submit_batch(io_engine_t *io, io_op_t *ops, size_t count, stats_t *stats)
+{
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  int ret = 0;
+  bool all_writes = true;
+  uint64_t start = stats_now();
+  size_t num_runs;
+  ERR_RET_IF_NOT(num_runs = build_runs(io, ops, count), -1);
+  for (size_t i = 0; i < num_runs; i++)
+  {
+    count_op(stats, io->runs[i].write, io->runs[i].offset, io->runs[i].len);
+    all_writes &= io->runs[i].write;
+  }
+  stats->coalesced_ops += count - num_runs;
+
+#ifdef HAVE_IO_URING
+  if (io->kind == IO_ENGINE_URING)
+  {
+    for (size_t done = 0; done < num_runs; done += io->depth)
+    {
+      size_t chunk = num_runs - done < io->depth ? num_runs - done : io->depth;
+      if (uring_run(io, io->runs + done, chunk) != 0)
+      {
+        ret = -1;
+      }
+    }
+    stats_phase_end(stats, all_writes ? PHASE_WRITE : PHASE_READ, start);
+    return ret;
+  }
+#endif
+
+  for (size_t i = 0; i < num_runs; i++)
+  {
+    if (finish_run(&io->runs[i], 0) != 0)
+    {
+      ret = -1;
+    }
+  }
+  stats_phase_end(stats, all_writes ? PHASE_WRITE : PHASE_READ, start);
+  return ret;
+}
@@ -0,0 +1,131 @@
+/**
+ * @file
+ * Positional I/O engines.
+ *
+ * All archive access goes through pread/pwrite style operations on a file
+ * descriptor so that independent operations can be batched. The pread engine
+ * issues a batch one system call at a time; the io_uring engine submits the
+ * whole batch at once so that many small header reads and writes are in
+ * flight on the device together.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_IO_H
+#define STRIPZIP_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "stats.h"
+
+typedef enum
+{
+  IO_ENGINE_AUTO = 0,  /**< io_uring when the kernel allows it, else pread */
+  IO_ENGINE_PREAD,
+  IO_ENGINE_URING,
+} io_engine_kind_t;
+
+/** Default number of operations in flight for batched engines */
+#define IO_DEFAULT_DEPTH 64
+
+/** Most operations in flight, the largest io_uring queue the kernel sets up */
+#define IO_MAX_DEPTH 32768
+
+typedef struct
+{
+  int fd;
+  bool write;
+  uint64_t offset;
+  void *buf;
+  size_t len;
+} io_op_t;
+
+typedef struct io_engine io_engine_t;
+
+/**
+ * Create an I/O engine for use by a single thread. Requesting io_uring on a
+ * kernel without it (or with it disabled) falls back to pread.
+ *
+ * @return The engine, or NULL if out of memory.
+ */
+io_engine_t *io_engine_open(io_engine_kind_t kind, unsigned depth);
+
+void io_engine_close(io_engine_t *io);
+
+/** Create another engine of the same kind and depth as \a io, for another thread. */
+io_engine_t *io_engine_clone(const io_engine_t *io);
+
+/** Name of the engine actually in use, for diagnostics. */
+const char *io_engine_name(const io_engine_t *io);
+
+/**
+ * Perform every operation in \a ops. Operations in a batch must not depend on
+ * each other; they may complete in any order, and \a ops may be reordered.
+ * Operations on adjacent ranges of a file are coalesced into one vectored
+ * read or write.
+ *
+ * @return 0 if every operation transferred its full length, -1 otherwise.
+ */
+int io_submit_batch(io_engine_t *io, io_op_t *ops, size_t count, stats_t *stats);
+
+/** Read exactly \a len bytes at \a offset. @return 0 on success, -1 on failure. */
+int io_read_at(int fd, void *buf, size_t len, uint64_t offset, stats_t *stats);
+
+/** Write exactly \a len bytes at \a offset. @return 0 on success, -1 on failure. */
+int io_write_at(int fd, const void *buf, size_t len, uint64_t offset, stats_t *stats);
+
+/**
+ * Make \a dst a copy of the first \a len bytes of \a src, sharing extents
+ * with it where the filesystem supports reflinks and copying in the kernel
+ * where it doesn't.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int io_copy_file(int dst, int src, uint64_t len);
+
+/**
+ * Copy \a len bytes at \a src_offset in \a src to \a dst_offset in \a dst
+ * without bringing them into user space.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int io_copy_range(int dst, uint64_t dst_offset, int src, uint64_t src_offset, uint64_t len);
+
+/**
+ * Sync the directory containing \a path, making a file created or renamed
+ * there durable.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int io_sync_parent(const char *path);
+
+/**
+ * Create an empty file next to \a path, with the permissions and, where
+ * allowed, the ownership of the file open on \a fd.
+ *
+ * @param tmp_path Set to the new file's path, to be freed by io_replace().
+ * @return The new file, open for reading and writing, or -1 on failure.
+ */
+int io_create_beside(const char *path, int fd, char **tmp_path);
+
+/**
+ * Durably rename the file from io_create_beside() over \a path if \a ret is
+ * 0, or remove it otherwise. Closes \a tmp and frees \a tmp_path.
+ *
+ * @return \a ret, or -1 if the rename failed.
+ */
+int io_replace(const char *path, int tmp, char *tmp_path, int ret);
+
+/**
+ * Flush everything written to the filesystem holding \a path with a single
+ * syncfs, which is cheaper than syncing many files one at a time.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int io_sync_filesystem(const char *path);
+
+#endif /* STRIPZIP_IO_H */
@@ -0,0 +1,434 @@
+/**
+ * @file
+ * Undo journal for crash-safe in-place purification.
+ *
+ * The journal starts with a header holding the archive's original size,
+ * device and inode, followed by one record per overwritten range: its
+ * offset and length, the CRC of the bytes written over it, a CRC and the
+ * original bytes. Records are only appended, and each batch is synced before
+ * its writes are issued. A torn record at the end of the journal therefore
+ * never had its write issued, so rollback stops at the first record that
+ * fails its CRC.
+ *
+ * A journal left behind is only replayed onto the archive it was made for,
+ * and only while every range it recorded still holds either the original
+ * bytes or the ones written over them. An archive that has been replaced or
+ * rebuilt since fails that test, and its journal is discarded rather than
+ * written into it.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "err.h"
+#include "zip_format.h"
+#include "journal.h"
+
+#define JOURNAL_SUFFIX ".stripzip-journal"
+#define JOURNAL_MAGIC  "SZJRNL02"
+
+/** The bytes written over a record's range aren't known, as when it is cut off */
+#define JOURNAL_NEW_UNKNOWN (0x1 << 0)
+
+typedef struct __attribute__ ((__packed__))
+{
+  char magic[8];
+  uint64_t size;              /**< Size of the archive before any change */
+  uint64_t dev;               /**< Device and inode of the archive */
+  uint64_t ino;
+  uint32_t crc;               /**< Of the preceding fields */
+} journal_header_t;
+
+typedef struct __attribute__ ((__packed__))
+{
+  uint64_t offset;
+  uint32_t len;
+  uint32_t flags;
+  uint32_t new_crc;           /**< Of the bytes written over the range */
+  uint32_t crc;               /**< Of the preceding fields and the saved bytes */
+} journal_record_t;
+
+struct journal
+{
+  int fd;
+  int archive_fd;
+  char *path;                 /**< The journal's own path */
+  uint64_t end;               /**< Where the next record goes */
+};
+
+
+static uint32_t record_crc(const journal_record_t *record, const void *data, uint32_t len)
+{
+  uLong crc = crc32(0, (const Bytef *)record, offsetof(journal_record_t, crc));
+  return (uint32_t)crc32(crc, data, len);
+}
+
+
+/** Where a record's range is, for finding ranges written more than once */
+typedef struct
+{
+  uint64_t offset;
+  uint64_t end;
+  size_t index;               /**< Of the record, oldest first */
+} journal_range_t;
+
+
+static int compare_range(const void *a, const void *b)
+{
+  uint64_t offset_a = ((const journal_range_t *)a)->offset;
+  uint64_t offset_b = ((const journal_range_t *)b)->offset;
+  return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+
+/**
+ * Check that the \a count intact records at \a records in \a buf, oldest
+ * first, were made for the archive open on \a archive_fd as it is now. Each
+ * range must hold either its original bytes or those written over it, and
+ * unless a range was cut off the archive must still be \a size bytes long.
+ * Ranges written again by a later record, or whose new bytes are unknown,
+ * can't be told apart and are left out.
+ *
+ * @return 1 if the journal belongs to the archive, 0 if not, -1 on failure.
+ */
+static int records_match(const char *buf, const size_t *records, size_t count, uint64_t size, int archive_fd,
+                         stats_t *stats)
+{
+  struct stat st;
+  ERR_RET_ON_ERRNO(fstat(archive_fd, &st), -1);
+  journal_range_t *ranges = malloc((count + 1) * sizeof(journal_range_t));
+  bool *skip = calloc(count + 1, sizeof(bool));
+  char *current = NULL;
+  int ret = -1;
+  if (ranges == NULL || skip == NULL)
+  {
+    goto out;
+  }
+
+  bool cut = false;
+  uint32_t max_len = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    const journal_record_t *record = (const journal_record_t *)(buf + records[i]);
+    uint32_t len = ZIP_GET(record, len);
+    ranges[i] = (journal_range_t){.offset = ZIP_GET(record, offset), .end = ZIP_GET(record, offset) + len, .index = i};
+    skip[i] = (ZIP_GET(record, flags) & JOURNAL_NEW_UNKNOWN) != 0;
+    cut |= skip[i];
+    max_len = len > max_len ? len : max_len;
+  }
+  if (!cut && (uint64_t)st.st_size != size)
+  {
+    ret = 0;
+    goto out;
+  }
+
+  /* Of two overlapping ranges, the older was written over by the newer */
+  qsort(ranges, count, sizeof(journal_range_t), compare_range);
+  const journal_range_t *furthest = NULL;
+  for (size_t i = 0; i < count; i++)
+  {
+    if (furthest && ranges[i].offset < furthest->end)
+    {
+      skip[ranges[i].index < furthest->index ? ranges[i].index : furthest->index] = true;
+    }
+    if (furthest == NULL || ranges[i].end > furthest->end)
+    {
+      furthest = &ranges[i];
+    }
+  }
+
+  if ((current = malloc((size_t)max_len + 1)) == NULL)
+  {
+    goto out;
+  }
+  ret = 1;
+  for (size_t i = 0; i < count && ret == 1; i++)
+  {
+    const journal_record_t *record = (const journal_record_t *)(buf + records[i]);
+    uint64_t offset = ZIP_GET(record, offset);
+    uint32_t len = ZIP_GET(record, len);
+    if (skip[i])
+    {
+      continue;
+    }
+    if (offset + len > (uint64_t)st.st_size)
+    {
+      ret = 0;
+      break;
+    }
+    if (io_read_at(archive_fd, current, len, offset, stats) != 0)
+    {
+      ret = -1;
+      break;
+    }
+    uint32_t crc = (uint32_t)crc32(0, (const Bytef *)current, len);
+    if (crc != ZIP_GET(record, new_crc) && crc != (uint32_t)crc32(0, (const Bytef *)(record + 1), len))
+    {
+      ret = 0;
+    }
+  }
+
+out:
+  free(current);
+  free(skip);
+  free(ranges);
+  return ret;
+}
+
+
+/**
+ * Restore everything recorded in the journal open on \a journal_fd. With
+ * \a path, the journal was left behind by an earlier run, and is discarded
+ * with a warning instead if it doesn't belong to the archive at \a path.
+ */
+static int rollback(int journal_fd, int archive_fd, const char *path, stats_t *stats)
+{
+  struct stat st;
+  ERR_RET_ON_ERRNO(fstat(journal_fd, &st), -1);
+  size_t len = (size_t)st.st_size;
+  if (len < sizeof(journal_header_t))
+  {
+    /* Never finished starting, so nothing was written */
+    return 0;
+  }
+
+  char *buf;
+  ERR_RET_IF_NOT(buf = malloc(len), -1);
+  if (io_read_at(journal_fd, buf, len, 0, stats) != 0)
+  {
+    free(buf);
+    return -1;
+  }
+  journal_header_t *header = (journal_header_t *)buf;
+  if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+      ZIP_GET(header, crc) != (uint32_t)crc32(0, (const Bytef *)header, offsetof(journal_header_t, crc)))
+  {
+    /* Same name, another format version */
+    if (path && memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic) - 2) == 0 &&
+        memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0)
+    {
+      printf("Warning: discarding the journal of %s, written by another version\n", path);
+    }
+    free(buf);
+    return 0;
+  }
+  struct stat archive_st;
+  if (fstat(archive_fd, &archive_st) != 0)
+  {
+    free(buf);
+    ERR_RET_ON_ERRNO(-1, -1);
+  }
+  if (path && (ZIP_GET(header, dev) != (uint64_t)archive_st.st_dev ||
+               ZIP_GET(header, ino) != (uint64_t)archive_st.st_ino))
+  {
+    printf("Warning: %s has been replaced since it was journaled; discarding the journal\n", path);
+    free(buf);
+    return 0;
+  }
+
+  /* Find the intact records, then undo them newest first so that the oldest
+   * copy of any range written more than once is what's left */
+  size_t count = 0;
+  size_t pos = sizeof(journal_header_t);
+  size_t *records;
+  if ((records = malloc((len / sizeof(journal_record_t) + 1) * sizeof(size_t))) == NULL)
+  {
+    free(buf);
+    return -1;
+  }
+  while (len - pos >= sizeof(journal_record_t))
+  {
+    journal_record_t *record = (journal_record_t *)(buf + pos);
+    uint32_t data_len = ZIP_GET(record, len);
+    if (len - pos - sizeof(journal_record_t) < data_len ||
+        ZIP_GET(record, crc) != record_crc(record, record + 1, data_len))
+    {
+      break;
+    }
+    records[count++] = pos;
+    pos += sizeof(journal_record_t) + data_len;
+  }
+
+  int ret = 0;
+  int match = path ? records_match(buf, records, count, ZIP_GET(header, size), archive_fd, stats) : 1;
+  if (match <= 0)
+  {
+    if (match == 0)
+    {
+      printf("Warning: %s has changed since it was journaled; discarding the journal\n", path);
+    }
+    free(records);
+    free(buf);
+    return match;
+  }
+  while (count-- > 0)
+  {
+    journal_record_t *record = (journal_record_t *)(buf + records[count]);
+    if (io_write_at(archive_fd, record + 1, ZIP_GET(record, len), ZIP_GET(record, offset), stats) != 0)
+    {
+      ret = -1;
+    }
+  }
+  if (ret == 0 && ftruncate(archive_fd, (off_t)ZIP_GET(header, size)) != 0)
+  {
+    ret = -1;
+  }
+  if (ret == 0 && fsync(archive_fd) != 0)
+  {
+    ret = -1;
+  }
+
+  free(records);
+  free(buf);
+  return ret;
+}
+
+
+journal_t *journal_begin(const char *path, int fd, stats_t *stats)
+{
+  journal_t *journal = calloc(1, sizeof(journal_t));
+  if (journal == NULL || (journal->path = malloc(strlen(path) + sizeof(JOURNAL_SUFFIX))) == NULL)
+  {
+    free(journal);
+    return NULL;
+  }
+  strcpy(journal->path, path);
+  strcat(journal->path, JOURNAL_SUFFIX);
+  journal->archive_fd = fd;
+
+  int old = open(journal->path, O_RDONLY | O_CLOEXEC);
+  if (old >= 0)
+  {
+    printf("Rolling back an interrupted run on %s\n", path);
+    int ret = rollback(old, fd, path, stats);
+    close(old);
+    if (ret != 0)
+    {
+      printf("Could not roll back %s; keeping %s\n", path, journal->path);
+      goto fail;
+    }
+  }
+
+  struct stat st;
+  journal_header_t header;
+  memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+  if (fstat(fd, &st) != 0 ||
+      (journal->fd = open(journal->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+  {
+    printf("Could not create %s: %s\n", journal->path, strerror(errno));
+    goto fail;
+  }
+  ZIP_SET(&header, size, (uint64_t)st.st_size);
+  ZIP_SET(&header, dev, (uint64_t)st.st_dev);
+  ZIP_SET(&header, ino, (uint64_t)st.st_ino);
+  ZIP_SET(&header, crc, (uint32_t)crc32(0, (const Bytef *)&header, offsetof(journal_header_t, crc)));
+  journal->end = sizeof(header);
+
+  /* The journal has to survive a crash for any write that follows */
+  if (io_write_at(journal->fd, &header, sizeof(header), 0, stats) != 0 || fdatasync(journal->fd) != 0 ||
+      io_sync_parent(journal->path) != 0)
+  {
+    close(journal->fd);
+    unlink(journal->path);
+    goto fail;
+  }
+  return journal;
+
+fail:
+  free(journal->path);
+  free(journal);
+  return NULL;
+}
+
+
+int journal_record(journal_t *journal, const io_op_t *ops, size_t count, stats_t *stats)
+{
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    total += ops[i].write ? sizeof(journal_record_t) + ops[i].len : 0;
+  }
+  if (total == 0)
+  {
+    return 0;
+  }
+
+  char *buf;
+  ERR_RET_IF_NOT(buf = malloc(total), -1);
+  size_t pos = 0;
+  int ret = 0;
+  for (size_t i = 0; i < count && ret == 0; i++)
+  {
+    if (!ops[i].write)
+    {
+      continue;
+    }
+    /* These ranges were just read to be patched, so this comes from the page cache */
+    journal_record_t *record = (journal_record_t *)(buf + pos);
+    ZIP_SET(record, offset, ops[i].offset);
+    ZIP_SET(record, len, (uint32_t)ops[i].len);
+    ZIP_SET(record, flags, ops[i].buf ? 0 : JOURNAL_NEW_UNKNOWN);
+    ZIP_SET(record, new_crc, ops[i].buf ? (uint32_t)crc32(0, ops[i].buf, (uInt)ops[i].len) : 0);
+    ret = io_read_at(journal->archive_fd, record + 1, ops[i].len, ops[i].offset, stats);
+    ZIP_SET(record, crc, record_crc(record, record + 1, (uint32_t)ops[i].len));
+    pos += sizeof(journal_record_t) + ops[i].len;
+  }
+
+  if (ret == 0)
+  {
+    ret = io_write_at(journal->fd, buf, total, journal->end, stats);
+  }
+  if (ret == 0)
+  {
+    ret = fdatasync(journal->fd);
+    journal->end += total;
+  }
+  free(buf);
+  ERR_RET_IF_NEQ(ret, 0, -1);
+  return 0;
+}
+
+
+static void journal_free(journal_t *journal)
+{
+  close(journal->fd);
+  free(journal->path);
+  free(journal);
+}
+
+
+int journal_commit(journal_t *journal)
+{
+  if (fsync(journal->archive_fd) != 0)
+  {
+    printf("Could not sync the archive; keeping %s\n", journal->path);
+    journal_free(journal);
+    return -1;
+  }
+  unlink(journal->path);
+  journal_free(journal);
+  return 0;
+}
+
+
+int journal_rollback(journal_t *journal, stats_t *stats)
+{
+  int ret = rollback(journal->fd, journal->archive_fd, NULL, stats);
+  if (ret == 0)
+  {
+    unlink(journal->path);
+  }
+  journal_free(journal);
+  return ret;
+}
@@ -0,0 +1,53 @@
+/**
+ * @file
+ * Undo journal for crash-safe in-place purification.
+ *
+ * Before a batch of writes is issued to an archive, the bytes about to be
+ * overwritten are appended to `<archive>.stripzip-journal` and made durable.
+ * If StripZIP is killed part way, the next journaled run finds the journal
+ * and restores those bytes before starting over, so the archive is never
+ * left half purified. Only the headers being patched are journaled, never
+ * the entry data.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_JOURNAL_H
+#define STRIPZIP_JOURNAL_H
+
+#include <stddef.h>
+
+#include "stats.h"
+#include "io.h"
+
+typedef struct journal journal_t;
+
+/**
+ * Start journaling changes to the archive at \a path, open on \a fd. A
+ * journal left behind by an interrupted run is rolled back first.
+ *
+ * @return The journal, or NULL if it can't be created or rolled back.
+ */
+journal_t *journal_begin(const char *path, int fd, stats_t *stats);
+
+/**
+ * Save the current contents of every range the write operations in \a ops
+ * are about to overwrite. Must complete before the operations are issued.
+ *
+ * @return 0 once the saved bytes are durable, -1 on failure.
+ */
+int journal_record(journal_t *journal, const io_op_t *ops, size_t count, stats_t *stats);
+
+/**
+ * Make the archive durable and discard the journal.
+ *
+ * @return 0 on success, -1 if the archive couldn't be synced; the journal is
+ *         then kept so the next run can roll back.
+ */
+int journal_commit(journal_t *journal);
+
+/** Undo every recorded change and discard the journal. */
+int journal_rollback(journal_t *journal, stats_t *stats);
+
+#endif /* STRIPZIP_JOURNAL_H */
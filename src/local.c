@@ -0,0 +1,200 @@
+/**
+ * @file
+ * Sequential access to local file records.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+
+#include "err.h"
+#include "io.h"
+#include "archive.h"
+#include "local.h"
+
+/** Bytes read at a time when scanning for a data descriptor */
+#define DESCRIPTOR_SCAN_WINDOW (64 * 1024)
+
+/** Longest descriptor plus the signature of whatever follows it */
+#define DESCRIPTOR_MAX_LEN (sizeof(uint32_t) + sizeof(data_descriptor64_t))
+#define DESCRIPTOR_LOOKAHEAD (DESCRIPTOR_MAX_LEN + sizeof(uint32_t))
+
+
+uint32_t local_parse_descriptor(const char *buf, size_t avail, uint64_t data_len, bool zip64,
+                                local_record_t *rec)
+{
+  uint32_t sig_len = 0;
+  if (avail >= sizeof(uint32_t) && zip_load32(buf) == DATA_DESCRIPTOR_SIGNATURE)
+  {
+    sig_len = sizeof(uint32_t);
+  }
+
+  /* A CRC can collide with the signature, so try the signed form first and
+   * then the same bytes as an unsigned descriptor */
+  for (;;)
+  {
+    const char *desc = buf + sig_len;
+    size_t desc_avail = avail - sig_len;
+    if (zip64 && desc_avail >= sizeof(data_descriptor64_t))
+    {
+      const data_descriptor64_t *dd = (const data_descriptor64_t *)desc;
+      if (ZIP_GET(dd, compressed_size) == data_len)
+      {
+        rec->crc32 = ZIP_GET(dd, crc32);
+        rec->compressed_size = ZIP_GET(dd, compressed_size);
+        rec->uncompressed_size = ZIP_GET(dd, uncompressed_size);
+        return sig_len + (uint32_t)sizeof(data_descriptor64_t);
+      }
+    }
+    else if (!zip64 && desc_avail >= sizeof(data_descriptor_t))
+    {
+      const data_descriptor_t *dd = (const data_descriptor_t *)desc;
+      if (ZIP_GET(dd, compressed_size) == data_len)
+      {
+        rec->crc32 = ZIP_GET(dd, crc32);
+        rec->compressed_size = ZIP_GET(dd, compressed_size);
+        rec->uncompressed_size = ZIP_GET(dd, uncompressed_size);
+        return sig_len + (uint32_t)sizeof(data_descriptor_t);
+      }
+    }
+
+    if (sig_len == 0)
+    {
+      return 0;
+    }
+    sig_len = 0;
+  }
+}
+
+
+/** True if what follows a record at \a buf (\a avail bytes, ending at \a at) looks right. */
+static bool plausible_record_end(const char *buf, size_t avail, uint64_t at, uint64_t limit)
+{
+  if (at == limit)
+  {
+    return true;
+  }
+  if (at > limit || avail < sizeof(uint32_t))
+  {
+    return false;
+  }
+  uint32_t signature = zip_load32(buf);
+  return signature == FILE_HEADER_SIGNATURE || signature == CENDIR_HEADER_SIGNATURE;
+}
+
+
+/**
+ * Find the data descriptor of \a rec by scanning forward from its data.
+ */
+static int scan_for_descriptor(int fd, uint64_t limit, local_record_t *rec, scratch_t *scratch, stats_t *stats)
+{
+  scratch_mark_t mark = scratch_mark(scratch);
+  char *window;
+  ERR_RET_IF_NOT(window = scratch_alloc(scratch, DESCRIPTOR_SCAN_WINDOW + DESCRIPTOR_LOOKAHEAD), -1);
+
+  uint64_t pos = rec->data_offset;
+  while (pos < limit)
+  {
+    size_t len = DESCRIPTOR_SCAN_WINDOW + DESCRIPTOR_LOOKAHEAD;
+    if (limit - pos < len)
+    {
+      len = (size_t)(limit - pos);
+    }
+    ERR_RET_IF_NEQ(io_read_at(fd, window, len, pos, stats), 0, -1);
+
+    size_t scan_len = len > DESCRIPTOR_SCAN_WINDOW ? DESCRIPTOR_SCAN_WINDOW : len;
+    for (size_t i = 0; i < scan_len; i++)
+    {
+      uint64_t data_len = pos + i - rec->data_offset;
+      if (!rec->zip64 && data_len > UINT32_MAX)
+      {
+        break;
+      }
+      uint32_t desc_len = local_parse_descriptor(window + i, len - i, data_len, rec->zip64, rec);
+      if (desc_len && plausible_record_end(window + i + desc_len, len - i - desc_len,
+                                           pos + i + desc_len, limit))
+      {
+        rec->descriptor_len = desc_len;
+        rec->end = pos + i + desc_len;
+        scratch_release(scratch, mark);
+        return 0;
+      }
+    }
+    pos += scan_len;
+  }
+
+  scratch_release(scratch, mark);
+  printf("No data descriptor found for the entry at 0x%08" PRIx64 ".\n", rec->offset);
+  return -1;
+}
+
+
+int local_record_read(int fd, uint64_t offset, uint64_t limit, local_record_t *rec,
+                      scratch_t *scratch, stats_t *stats)
+{
+  memset(rec, 0, sizeof(*rec));
+  rec->offset = offset;
+  if (limit - offset < sizeof(local_file_header_t))
+  {
+    printf("Local header at 0x%08" PRIx64 " is truncated.\n", offset);
+    return -1;
+  }
+
+  local_file_header_t *header = &rec->header;
+  ERR_RET_IF_NEQ(io_read_at(fd, header, sizeof(*header), offset, stats), 0, -1);
+  if (ZIP_GET(header, signature) != FILE_HEADER_SIGNATURE)
+  {
+    printf("No local header at 0x%08" PRIx64 ".\n", offset);
+    return -1;
+  }
+  uint16_t name_len = ZIP_GET(header, name_length);
+  uint16_t extra_len = ZIP_GET(header, extra_field_length);
+  rec->data_offset = offset + sizeof(*header) + name_len + extra_len;
+  rec->crc32 = ZIP_GET(header, crc32);
+  rec->compressed_size = ZIP_GET(header, compressed_size);
+  rec->uncompressed_size = ZIP_GET(header, uncompressed_size);
+  if (rec->data_offset > limit)
+  {
+    printf("Local header at 0x%08" PRIx64 " runs past the end of the entries.\n", offset);
+    return -1;
+  }
+
+  if (extra_len)
+  {
+    scratch_mark_t mark = scratch_mark(scratch);
+    char *extra;
+    uint16_t zip64_len = 0;
+    ERR_RET_IF_NOT(extra = scratch_alloc(scratch, extra_len), -1);
+    ERR_RET_IF_NEQ(io_read_at(fd, extra, extra_len, offset + sizeof(*header) + name_len, stats), 0, -1);
+    char *zip64 = extra_find(extra, extra_len, ZIP64_EXTRA_HEADER, &zip64_len);
+    if (zip64)
+    {
+      /* The local Zip64 extra holds both sizes, uncompressed first */
+      rec->zip64 = true;
+      if (zip64_len >= 2 * sizeof(uint64_t) && rec->uncompressed_size == UINT32_MAX)
+      {
+        rec->uncompressed_size = zip_load64(zip64);
+        rec->compressed_size = zip_load64(zip64 + sizeof(uint64_t));
+      }
+    }
+    scratch_release(scratch, mark);
+  }
+
+  if (ZIP_GET(header, gp_bits) & GPB_NOT_SEEKABLE)
+  {
+    return scan_for_descriptor(fd, limit, rec, scratch, stats);
+  }
+
+  if (limit - rec->data_offset < rec->compressed_size)
+  {
+    printf("Data of the entry at 0x%08" PRIx64 " runs past the end of the entries.\n", offset);
+    return -1;
+  }
+  rec->end = rec->data_offset + rec->compressed_size;
+  return 0;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file
+ * Sequential access to local file records.
+ *
+ * A local record is a local file header, the file name, the extra field, the
+ * file data and, for entries written by streaming tools (GPB_NOT_SEEKABLE),
+ * a trailing data descriptor holding the CRC and sizes that the header could
+ * not. Records can be walked front to back without the central directory.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_LOCAL_H
+#define STRIPZIP_LOCAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "scratch.h"
+#include "zip_format.h"
+
+typedef struct
+{
+  uint64_t offset;              /**< Of the local file header */
+  local_file_header_t header;
+  uint64_t data_offset;         /**< First byte of the file data */
+  uint32_t crc32;               /**< From the header or the data descriptor */
+  uint64_t compressed_size;     /**< From the header, Zip64 extra or data descriptor */
+  uint64_t uncompressed_size;
+  bool zip64;                   /**< Sizes are 64 bit (Zip64 extra field present) */
+  uint32_t descriptor_len;      /**< Bytes of data descriptor, 0 if there is none */
+  uint64_t end;                 /**< One past the end of the record */
+} local_record_t;
+
+/**
+ * Parse a data descriptor candidate at \a buf, which has \a avail bytes
+ * available, for an entry with \a data_len bytes of data. Both the signed and
+ * unsigned forms are recognised.
+ *
+ * @return The length of the descriptor if it matches, otherwise 0.
+ */
+uint32_t local_parse_descriptor(const char *buf, size_t avail, uint64_t data_len, bool zip64,
+                                local_record_t *rec);
+
+/**
+ * Read the local record at \a offset. For entries with a data descriptor the
+ * end of the data is found by scanning forward for a descriptor whose size
+ * matches its position and which is followed by another ZIP structure or by
+ * \a limit, the end of the local records region.
+ *
+ * @return 0 on success, -1 if no valid record is found.
+ */
+int local_record_read(int fd, uint64_t offset, uint64_t limit, local_record_t *rec,
+                      scratch_t *scratch, stats_t *stats);
+
+#endif /* STRIPZIP_LOCAL_H */
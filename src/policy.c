@@ -0,0 +1,429 @@
+/**
+ * @file
+ * Per-path sanitization policy.
+ *
+ * Every pattern is split into its literal prefix (up to the first wildcard)
+ * and a tail. The prefixes are stored in a trie, and each rule hangs off the
+ * node its prefix ends at. Matching walks the trie along the entry name once,
+ * testing the rules of each node passed. Tails that are empty or `**`, which
+ * covers literal and directory rules, are answered without looking at the
+ * name again, and a lone `*` only needs the rest of the name checked for a
+ * '/'; only other globs fall back to a backtracking match.
+ *
+ * Patterns starting with a wildcard, such as `*.png`, have no prefix to tell
+ * them apart. They are keyed on their literal suffix instead,
+ * after the last wildcard, in a second trie of reversed suffixes that is
+ * walked from the end of the name. So the name is only matched against the
+ * rules for its own extension, however many others there are.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "err.h"
+#include "hash.h"
+#include "policy.h"
+
+/** No child, sibling or rule; node 0 is the root and never a child */
+#define POLICY_NONE 0
+
+typedef enum
+{
+  TAIL_EXACT = 0,     /**< The name must end with the prefix */
+  TAIL_ANY,           /**< `**`: anything may follow the prefix */
+  TAIL_COMPONENT,     /**< `*`: anything but '/' may follow the prefix */
+  TAIL_GLOB,
+} tail_kind_t;
+
+typedef struct
+{
+  unsigned actions;
+  tail_kind_t kind;
+  char *tail;           /**< The pattern less its prefix, or for suffix rules its suffix */
+  size_t tail_len;
+  uint32_t next;        /**< Next rule (index + 1) at the same node, in file order */
+} policy_rule_t;
+
+typedef struct
+{
+  uint32_t first_child;
+  uint32_t next_sibling;
+  uint32_t rules;       /**< First rule (index + 1) ending at this node */
+  uint32_t last_rule;
+  char c;
+} policy_node_t;
+
+typedef struct
+{
+  policy_node_t *nodes;
+  size_t num_nodes;
+  size_t nodes_cap;
+} policy_trie_t;
+
+struct policy
+{
+  policy_trie_t prefixes;
+  policy_trie_t suffixes;   /**< Of rules without a prefix, reversed */
+  policy_rule_t *rules;
+  size_t num_rules;
+  size_t rules_cap;
+  uint64_t digest;
+};
+
+static const struct
+{
+  const char *name;
+  unsigned actions;
+} ACTIONS[] = {
+  {"strip",      0},
+  {"keep-mode",  0},
+  {"keep-extra", POLICY_KEEP_EXTRA},
+  {"normalize",  POLICY_NORMALIZE},
+};
+
+
+static bool grow(void **array, size_t *cap, size_t count, size_t size)
+{
+  if (count < *cap)
+  {
+    return true;
+  }
+  size_t new_cap = *cap ? *cap * 2 : 64;
+  void *grown = realloc(*array, new_cap * size);
+  if (grown == NULL)
+  {
+    return false;
+  }
+  *array = grown;
+  *cap = new_cap;
+  return true;
+}
+
+
+static uint32_t find_child(const policy_trie_t *trie, uint32_t node, char c)
+{
+  for (uint32_t child = trie->nodes[node].first_child; child != POLICY_NONE;
+       child = trie->nodes[child].next_sibling)
+  {
+    if (trie->nodes[child].c == c)
+    {
+      return child;
+    }
+  }
+  return POLICY_NONE;
+}
+
+
+/**
+ * Walk, and extend, \a trie along the \a len characters at \a key, going
+ * backwards from there with \a step -1.
+ *
+ * @param node Set to the node the key ends at.
+ * @return False if out of memory.
+ */
+static bool trie_insert(policy_trie_t *trie, const char *key, size_t len, int step, uint32_t *node)
+{
+  if (trie->num_nodes == 0)
+  {
+    ERR_RET_IF_NOT(grow((void **)&trie->nodes, &trie->nodes_cap, 0, sizeof(policy_node_t)), false);
+    trie->nodes[0] = (policy_node_t){0};
+    trie->num_nodes = 1;
+  }
+  *node = 0;
+  for (size_t i = 0; i < len; i++, key += step)
+  {
+    uint32_t child = find_child(trie, *node, *key);
+    if (child == POLICY_NONE)
+    {
+      ERR_RET_IF_NOT(grow((void **)&trie->nodes, &trie->nodes_cap, trie->num_nodes, sizeof(policy_node_t)),
+                     false);
+      child = (uint32_t)trie->num_nodes++;
+      trie->nodes[child] = (policy_node_t){.c = *key, .next_sibling = trie->nodes[*node].first_child};
+      trie->nodes[*node].first_child = child;
+    }
+    *node = child;
+  }
+  return true;
+}
+
+
+static bool add_rule(policy_t *policy, const char *pattern, unsigned actions)
+{
+  /* A directory matches everything below it */
+  char *expanded = NULL;
+  size_t len = strlen(pattern);
+  if (pattern[len - 1] == '/')
+  {
+    ERR_RET_IF_NOT(expanded = malloc(len + sizeof("**")), false);
+    memcpy(expanded, pattern, len);
+    memcpy(expanded + len, "**", sizeof("**"));
+    pattern = expanded;
+    len += 2;
+  }
+  size_t prefix_len = strcspn(pattern, "*?");
+
+  /* Rules with a prefix are found by it; the others by their suffix */
+  bool by_suffix = prefix_len == 0 && len > 0;
+  size_t suffix_len = 0;
+  while (by_suffix && suffix_len < len && !strchr("*?", pattern[len - suffix_len - 1]))
+  {
+    suffix_len++;
+  }
+  policy_trie_t *trie = by_suffix ? &policy->suffixes : &policy->prefixes;
+  uint32_t node;
+  bool ok = by_suffix ? trie_insert(trie, pattern + len - 1, suffix_len, -1, &node) :
+                        trie_insert(trie, pattern, prefix_len, 1, &node);
+
+  policy_rule_t *rule = NULL;
+  if (ok && (ok = grow((void **)&policy->rules, &policy->rules_cap, policy->num_rules, sizeof(policy_rule_t))))
+  {
+    const char *tail = by_suffix ? pattern : pattern + prefix_len;
+    size_t tail_len = by_suffix ? len - suffix_len : len - prefix_len;
+    rule = &policy->rules[policy->num_rules];
+    *rule = (policy_rule_t){.actions = actions, .tail_len = tail_len};
+    if (tail_len == 0)
+    {
+      rule->kind = TAIL_EXACT;
+    }
+    else if (tail_len == 2 && memcmp(tail, "**", 2) == 0)
+    {
+      rule->kind = TAIL_ANY;
+    }
+    else if (tail_len == 1 && *tail == '*')
+    {
+      rule->kind = TAIL_COMPONENT;
+    }
+    else
+    {
+      rule->kind = TAIL_GLOB;
+      ok = (rule->tail = strndup(tail, tail_len)) != NULL;
+    }
+  }
+  free(expanded);
+  ERR_RET_IF_NOT(ok, false);
+
+  /* Keep each node's rules in file order so the first match is the earliest */
+  uint32_t id = (uint32_t)++policy->num_rules;
+  policy_node_t *at = &trie->nodes[node];
+  if (at->last_rule != POLICY_NONE)
+  {
+    policy->rules[at->last_rule - 1].next = id;
+  }
+  else
+  {
+    at->rules = id;
+  }
+  at->last_rule = id;
+  return true;
+}
+
+
+static bool parse_actions(char *list, unsigned *actions)
+{
+  *actions = 0;
+  for (char *save = NULL, *word = strtok_r(list, ", \t", &save); word; word = strtok_r(NULL, ", \t", &save))
+  {
+    size_t i;
+    for (i = 0; i < sizeof(ACTIONS) / sizeof(ACTIONS[0]); i++)
+    {
+      if (strcmp(word, ACTIONS[i].name) == 0)
+      {
+        *actions |= ACTIONS[i].actions;
+        break;
+      }
+    }
+    if (i == sizeof(ACTIONS) / sizeof(ACTIONS[0]))
+    {
+      printf("Unknown policy action: %s\n", word);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+policy_t *policy_load(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    printf("Could not open policy file %s\n", path);
+    return NULL;
+  }
+
+  policy_t *policy = calloc(1, sizeof(policy_t));
+  bool ok = policy != NULL;
+
+  char *line = NULL;
+  size_t line_cap = 0;
+  unsigned line_no = 0;
+  while (ok && getline(&line, &line_cap, file) != -1)
+  {
+    line_no++;
+    char *pattern = line + strspn(line, " \t");
+    pattern[strcspn(pattern, "\r\n")] = '\0';
+    if (*pattern == '\0' || *pattern == '#')
+    {
+      continue;
+    }
+
+    char *actions_list = pattern + strcspn(pattern, " \t");
+    if (*actions_list != '\0')
+    {
+      *actions_list++ = '\0';
+    }
+    unsigned actions;
+    if (!parse_actions(actions_list, &actions))
+    {
+      printf("%s:%u: bad rule\n", path, line_no);
+      ok = false;
+      break;
+    }
+    ok = add_rule(policy, pattern, actions);
+    policy->digest = hash64(pattern, strlen(pattern), policy->digest ^ actions);
+  }
+
+  free(line);
+  fclose(file);
+  if (!ok)
+  {
+    policy_free(policy);
+    return NULL;
+  }
+  return policy;
+}
+
+
+uint64_t policy_digest(const policy_t *policy)
+{
+  return policy->digest;
+}
+
+
+void policy_free(policy_t *policy)
+{
+  if (policy == NULL)
+  {
+    return;
+  }
+  for (size_t i = 0; i < policy->num_rules; i++)
+  {
+    free(policy->rules[i].tail);
+  }
+  free(policy->rules);
+  free(policy->prefixes.nodes);
+  free(policy->suffixes.nodes);
+  free(policy);
+}
+
+
+/** Match \a name against a glob where `*` and `?` stop at '/' and `**` doesn't. */
+static bool glob_match(const char *pattern, size_t pattern_len, const char *name, size_t len)
+{
+  while (pattern_len)
+  {
+    if (*pattern == '*')
+    {
+      bool any = pattern_len > 1 && pattern[1] == '*';
+      size_t skip = any ? 2 : 1;
+      for (size_t i = 0; i <= len; i++)
+      {
+        if (glob_match(pattern + skip, pattern_len - skip, name + i, len - i))
+        {
+          return true;
+        }
+        if (i < len && !any && name[i] == '/')
+        {
+          return false;
+        }
+      }
+      return false;
+    }
+    if (len == 0 || (*pattern == '?' ? *name == '/' : *pattern != *name))
+    {
+      return false;
+    }
+    pattern++;
+    pattern_len--;
+    name++;
+    len--;
+  }
+  return len == 0;
+}
+
+
+static bool rule_matches(const policy_rule_t *rule, const char *rest, size_t len)
+{
+  switch (rule->kind)
+  {
+    case TAIL_EXACT:
+      return len == 0;
+
+    case TAIL_ANY:
+      return true;
+
+    case TAIL_COMPONENT:
+      return memchr(rest, '/', len) == NULL;
+
+    case TAIL_GLOB:
+      return glob_match(rule->tail, rule->tail_len, rest, len);
+  }
+  return false;
+}
+
+
+/**
+ * Test the rules at \a node, in file order, against the \a len characters at
+ * \a rest, as long as they come before \a best.
+ *
+ * @return The first rule that matches, or \a best.
+ */
+static uint32_t match_node(const policy_t *policy, const policy_node_t *node, const char *rest, size_t len,
+                           uint32_t best)
+{
+  for (uint32_t id = node->rules; id != POLICY_NONE && (best == POLICY_NONE || id < best);
+       id = policy->rules[id - 1].next)
+  {
+    if (rule_matches(&policy->rules[id - 1], rest, len))
+    {
+      return id;
+    }
+  }
+  return best;
+}
+
+
+unsigned policy_match(const policy_t *policy, const char *name, size_t len)
+{
+  uint32_t best = POLICY_NONE;
+  const policy_trie_t *trie = &policy->prefixes;
+  uint32_t node = 0;
+  for (size_t i = 0; trie->num_nodes; i++)
+  {
+    /* Rules are in file order, so stop at the first match or once past the best so far */
+    best = match_node(policy, &trie->nodes[node], name + i, len - i, best);
+    if (i == len || (node = find_child(trie, node, name[i])) == POLICY_NONE)
+    {
+      break;
+    }
+  }
+
+  /* Then the rules without a prefix, along the name from its end */
+  trie = &policy->suffixes;
+  node = 0;
+  for (size_t i = 0; trie->num_nodes; i++)
+  {
+    best = match_node(policy, &trie->nodes[node], name, len - i, best);
+    if (i == len || (node = find_child(trie, node, name[len - i - 1])) == POLICY_NONE)
+    {
+      break;
+    }
+  }
+  return best == POLICY_NONE ? 0 : policy->rules[best - 1].actions;
+}
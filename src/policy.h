@@ -0,0 +1,52 @@
+/**
+ * @file
+ * Per-path sanitization policy.
+ *
+ * A policy file maps entry name globs to actions, one rule per line:
+ *
+ *     # pattern        actions
+ *     META-INF/        keep-extra
+ *     bin/             keep-mode
+ *     **               normalize
+ *
+ * In patterns `*` and `?` match within a path component, `**` matches
+ * anything including `/`, and a trailing `/` matches everything below a
+ * directory. The first matching rule decides; entries matching no rule get
+ * the default treatment.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_POLICY_H
+#define STRIPZIP_POLICY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Actions a rule may apply; the default treatment is 0 */
+#define POLICY_KEEP_EXTRA  (0x1 << 0)   /**< Leave extra fields untouched */
+#define POLICY_NORMALIZE   (0x1 << 1)   /**< Normalize permissions in external_attr */
+
+typedef struct policy policy_t;
+
+/**
+ * Compile the policy file at \a path.
+ *
+ * @return The policy, or NULL (having said why) if it couldn't be loaded.
+ */
+policy_t *policy_load(const char *path);
+
+void policy_free(policy_t *policy);
+
+/** Hash of the rules, for telling policies apart. */
+uint64_t policy_digest(const policy_t *policy);
+
+/**
+ * Actions for the entry called \a name. Literal and directory rules are
+ * matched in a single pass over the name, whatever the number of rules, and
+ * rules starting with a wildcard in a single pass back from its end.
+ */
+unsigned policy_match(const policy_t *policy, const char *name, size_t len);
+
+#endif /* STRIPZIP_POLICY_H */
@@ -0,0 +1,577 @@
+/**
+ * @file
+ * Salvage archives whose central directory or EOCD is damaged or missing.
+ *
+ * The whole file is mapped and searched for local header signatures with a
+ * vectorised scan, so finding candidates runs at memory bandwidth; only real
+ * candidates are decompressed to check their CRC.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "err.h"
+#include "io.h"
+#include "journal.h"
+#include "archive.h"
+#include "local.h"
+#include "recover.h"
+
+/** The version we claim to be made by: Unix host, spec version 2.0 */
+#define RECOVER_VERSION_MADE_BY (HOST_UNIX << 8 | 20)
+
+/** Bytes of the tail cut off by recovering saved per journal record */
+#define RECOVER_JOURNAL_CHUNK (64 * 1024 * 1024)
+
+/** Arenas larger than this are given back after each archive when memory is
+ *  budgeted */
+#define RECOVER_SCRATCH_KEEP (1024 * 1024)
+
+/** A local record and the attributes its central directory entry gets */
+typedef struct
+{
+  local_record_t rec;
+  uint16_t version_made_by;
+  uint32_t external_attr;
+} recovered_t;
+
+typedef struct
+{
+  recovered_t *records;
+  size_t count;
+  size_t capacity;
+} record_list_t;
+
+
+/**
+ * Find the next local header signature in [\a p, \a end).
+ *
+ * @return Pointer to the signature, or NULL if there is none.
+ */
+static const uint8_t *find_local_signature(const uint8_t *p, const uint8_t *end)
+{
+  if (end - p < 4)
+  {
+    return NULL;
+  }
+  const uint8_t *last = end - 4;
+
+#ifdef __SSE2__
+  /* Match 'P' and 'K' at adjacent positions sixteen candidates at a time */
+  const __m128i first = _mm_set1_epi8('P');
+  const __m128i second = _mm_set1_epi8('K');
+  while (last - p >= 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, second)));
+    while (mask)
+    {
+      unsigned bit = (unsigned)__builtin_ctz(mask);
+      if (zip_load32(p + bit) == FILE_HEADER_SIGNATURE)
+      {
+        return p + bit;
+      }
+      mask &= mask - 1;
+    }
+    p += 16;
+  }
+#endif
+
+  while (p <= last && (p = memchr(p, 'P', (size_t)(last - p) + 1)) != NULL)
+  {
+    if (zip_load32(p) == FILE_HEADER_SIGNATURE)
+    {
+      return p;
+    }
+    p++;
+  }
+  return NULL;
+}
+
+
+/**
+ * Inflate raw deflate data starting at \a data to find where it ends and what
+ * its CRC is.
+ *
+ * @return 0 if the stream is complete and valid, -1 otherwise.
+ */
+static int inflate_extent(const uint8_t *data, uint64_t avail, uint64_t *consumed, uint32_t *crc,
+                          uint64_t *produced, scratch_t *scratch)
+{
+  const size_t out_len = 64 * 1024;
+  scratch_mark_t mark = scratch_mark(scratch);
+  unsigned char *out;
+  ERR_RET_IF_NOT(out = scratch_alloc(scratch, out_len), -1);
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+  {
+    return -1;
+  }
+
+  int ret;
+  uLong running_crc = crc32(0, Z_NULL, 0);
+  *produced = 0;
+  /* zlib counts in uInt, so feed very large inputs in pieces */
+  const uint8_t *in = data;
+  const uint8_t *in_end = data + avail;
+  for (;;)
+  {
+    if (zs.avail_in == 0 && in < in_end)
+    {
+      uint64_t left = (uint64_t)(in_end - in);
+      zs.next_in = (Bytef *)(uintptr_t)in;
+      zs.avail_in = left > UINT32_MAX ? UINT32_MAX : (uInt)left;
+      in += zs.avail_in;
+    }
+    zs.next_out = out;
+    zs.avail_out = (uInt)out_len;
+    ret = inflate(&zs, Z_NO_FLUSH);
+    size_t got = out_len - zs.avail_out;
+    running_crc = crc32(running_crc, out, (uInt)got);
+    *produced += got;
+    if (ret != Z_OK || (zs.avail_in == 0 && in == in_end && zs.avail_out != 0))
+    {
+      /* Finished, broken, or ran out of file before the end of the stream */
+      break;
+    }
+  }
+
+  *consumed = (uint64_t)(in - data) - zs.avail_in;
+  *crc = (uint32_t)running_crc;
+  inflateEnd(&zs);
+  scratch_release(scratch, mark);
+  return ret == Z_STREAM_END ? 0 : -1;
+}
+
+
+/** CRC of \a len bytes, fed to zlib in uInt sized pieces. */
+static uint32_t crc_of(const uint8_t *data, uint64_t len)
+{
+  uLong crc = crc32(0, Z_NULL, 0);
+  while (len)
+  {
+    uInt chunk = len > UINT32_MAX ? UINT32_MAX : (uInt)len;
+    crc = crc32(crc, data, chunk);
+    data += chunk;
+    len -= chunk;
+  }
+  return (uint32_t)crc;
+}
+
+
+/** True if the bytes at \a p (ending the file at \a end) start another structure or the file ends. */
+static bool plausible_next(const uint8_t *p, const uint8_t *end)
+{
+  if (end - p < 4)
+  {
+    return true;
+  }
+  uint32_t signature = zip_load32(p);
+  return signature == FILE_HEADER_SIGNATURE || signature == CENDIR_HEADER_SIGNATURE ||
+         signature == EO_CENDIR_HEADER_SIGNATURE;
+}
+
+
+/**
+ * Check the local header candidate at \a p and work out the extent of its
+ * record.
+ *
+ * @return True if it is a genuine record.
+ */
+static bool validate_candidate(const uint8_t *base, const uint8_t *p, const uint8_t *end,
+                               local_record_t *rec, scratch_t *scratch)
+{
+  memset(rec, 0, sizeof(*rec));
+  if ((size_t)(end - p) < sizeof(local_file_header_t))
+  {
+    return false;
+  }
+  memcpy(&rec->header, p, sizeof(local_file_header_t));
+  const local_file_header_t *header = &rec->header;
+  uint16_t gp_bits = ZIP_GET(header, gp_bits);
+  uint16_t method = ZIP_GET(header, compression_method);
+  uint16_t name_len = ZIP_GET(header, name_length);
+  uint16_t extra_len = ZIP_GET(header, extra_field_length);
+
+  if ((ZIP_GET(header, version_needed) & 0xFF) > 63 || name_len == 0 ||
+      (gp_bits & (GP_BIT_ENC_MARKERS | GP_BIT_UNKNOWN_FLAG_MASK)) != 0)
+  {
+    return false;
+  }
+
+  rec->offset = (uint64_t)(p - base);
+  rec->data_offset = rec->offset + sizeof(local_file_header_t) + name_len + extra_len;
+  if (rec->data_offset > (uint64_t)(end - base))
+  {
+    return false;
+  }
+  uint16_t zip64_len;
+  char *extra = (char *)(uintptr_t)(p + sizeof(local_file_header_t) + name_len);
+  if (extra_len && extra_find(extra, extra_len, ZIP64_EXTRA_HEADER, &zip64_len))
+  {
+    /* The rebuilt central directory has no room for Zip64 sizes */
+    return false;
+  }
+
+  const uint8_t *data = base + rec->data_offset;
+  uint64_t avail = (uint64_t)(end - data);
+  rec->crc32 = ZIP_GET(header, crc32);
+  rec->compressed_size = ZIP_GET(header, compressed_size);
+  rec->uncompressed_size = ZIP_GET(header, uncompressed_size);
+
+  if (method == METHOD_DEFLATED)
+  {
+    uint64_t consumed, produced;
+    uint32_t crc;
+    if (inflate_extent(data, avail, &consumed, &crc, &produced, scratch) != 0)
+    {
+      return false;
+    }
+    if (gp_bits & GPB_NOT_SEEKABLE)
+    {
+      size_t window = avail - consumed < 32 ? (size_t)(avail - consumed) : 32;
+      rec->descriptor_len = local_parse_descriptor((const char *)data + consumed, window, consumed, false, rec);
+      if (rec->descriptor_len == 0)
+      {
+        return false;
+      }
+    }
+    if (consumed != rec->compressed_size || crc != rec->crc32 || produced != rec->uncompressed_size)
+    {
+      return false;
+    }
+  }
+  else if (gp_bits & GPB_NOT_SEEKABLE)
+  {
+    /* Stored (or unknown) data of unknown length; find a descriptor that
+     * describes the bytes in front of it and check their CRC */
+    for (uint64_t len = 0; len + sizeof(data_descriptor_t) <= avail && len <= UINT32_MAX; len++)
+    {
+      size_t window = avail - len < 32 ? (size_t)(avail - len) : 32;
+      uint32_t desc_len = local_parse_descriptor((const char *)data + len, window, len, false, rec);
+      if (desc_len && plausible_next(data + len + desc_len, end) &&
+          (method != METHOD_STORED || crc_of(data, len) == rec->crc32))
+      {
+        rec->descriptor_len = desc_len;
+        break;
+      }
+    }
+    if (rec->descriptor_len == 0)
+    {
+      return false;
+    }
+  }
+  else
+  {
+    if (rec->compressed_size > avail)
+    {
+      return false;
+    }
+    if (method == METHOD_STORED ? crc_of(data, rec->compressed_size) != rec->crc32 :
+                                  !plausible_next(data + rec->compressed_size, end))
+    {
+      return false;
+    }
+  }
+
+  if (method == METHOD_STORED && rec->compressed_size != rec->uncompressed_size)
+  {
+    return false;
+  }
+  rec->end = rec->data_offset + rec->compressed_size + rec->descriptor_len;
+  return true;
+}
+
+
+/**
+ * Add \a rec, whose name is \a name, as a Unix file with mode 0644, or a
+ * directory with mode 0755, until salvage_attributes() knows better.
+ */
+static int record_list_add(record_list_t *list, const local_record_t *rec, const uint8_t *name)
+{
+  if (list->count == list->capacity)
+  {
+    size_t capacity = list->capacity ? list->capacity * 2 : 256;
+    recovered_t *records = realloc(list->records, capacity * sizeof(recovered_t));
+    ERR_RET_IF_NOT(records, -1);
+    list->records = records;
+    list->capacity = capacity;
+  }
+  uint16_t name_len = ZIP_GET(&rec->header, name_length);
+  bool dir = name_len && name[name_len - 1] == '/';
+  list->records[list->count++] = (recovered_t){
+    .rec = *rec,
+    .version_made_by = RECOVER_VERSION_MADE_BY,
+    .external_attr = dir ? (uint32_t)(S_IFDIR | 0755) << 16 | MSDOS_DIR_ATTR : (uint32_t)(S_IFREG | 0644) << 16,
+  };
+  return 0;
+}
+
+
+/**
+ * Take the attributes of the recovered entries from whatever is left of the
+ * old central directory in [\a p, \a end): every intact record there that
+ * points at a recovered local header of the same name.
+ */
+static void salvage_attributes(const uint8_t *base, const uint8_t *p, const uint8_t *end, record_list_t *list)
+{
+  static const char signature[] = {'P', 'K', 1, 2};
+  while ((p = memmem(p, (size_t)(end - p), signature, sizeof(signature))) != NULL)
+  {
+    const central_directory_header_t *cd_header = (const central_directory_header_t *)p;
+    p += sizeof(signature);
+    if ((size_t)(end - (const uint8_t *)cd_header) < sizeof(*cd_header))
+    {
+      break;
+    }
+    uint16_t name_len = ZIP_GET(cd_header, file_name_length);
+    const uint8_t *name = (const uint8_t *)(cd_header + 1);
+    if ((size_t)(end - name) < name_len)
+    {
+      continue;
+    }
+
+    /* The records were found front to back, so they are sorted by offset */
+    uint64_t offset = ZIP_GET(cd_header, rel_offset_local_header);
+    size_t lo = 0;
+    size_t hi = list->count;
+    while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (list->records[mid].rec.offset < offset)
+      {
+        lo = mid + 1;
+      }
+      else
+      {
+        hi = mid;
+      }
+    }
+    recovered_t *recovered = &list->records[lo];
+    if (lo == list->count || recovered->rec.offset != offset ||
+        ZIP_GET(&recovered->rec.header, name_length) != name_len ||
+        memcmp(base + offset + sizeof(local_file_header_t), name, name_len) != 0)
+    {
+      continue;
+    }
+    recovered->version_made_by = ZIP_GET(cd_header, version_made_by);
+    recovered->external_attr = ZIP_GET(cd_header, external_attr);
+  }
+}
+
+
+/**
+ * Write a central directory and EOCD describing \a list at \a offset and cut
+ * the file, \a size bytes long, off after them.
+ */
+static int write_directory(int fd, const uint8_t *base, const record_list_t *list, uint64_t offset,
+                           uint64_t size, strip_ctx_t *ctx)
+{
+  if (list->count > UINT16_MAX || offset > UINT32_MAX)
+  {
+    printf("Too many entries to rebuild without Zip64!\n");
+    return -1;
+  }
+
+  size_t cd_len = 0;
+  for (size_t i = 0; i < list->count; i++)
+  {
+    cd_len += sizeof(central_directory_header_t) + ZIP_GET(&list->records[i].rec.header, name_length);
+  }
+
+  scratch_mark_t mark = scratch_mark(&ctx->scratch);
+  char *out;
+  ERR_RET_IF_NOT(out = scratch_alloc(&ctx->scratch, cd_len + sizeof(end_of_central_directory_header_t)), -1);
+  memset(out, 0, cd_len + sizeof(end_of_central_directory_header_t));
+
+  char *pos = out;
+  for (size_t i = 0; i < list->count; i++)
+  {
+    const local_record_t *rec = &list->records[i].rec;
+    const local_file_header_t *lf_header = &rec->header;
+    central_directory_header_t *cd_header = (central_directory_header_t *)pos;
+    uint16_t name_len = ZIP_GET(lf_header, name_length);
+
+    ZIP_SET(cd_header, signature, CENDIR_HEADER_SIGNATURE);
+    ZIP_SET(cd_header, version_made_by, list->records[i].version_made_by);
+    ZIP_SET(cd_header, version_needed, ZIP_GET(lf_header, version_needed));
+    ZIP_SET(cd_header, gp_bits, ZIP_GET(lf_header, gp_bits));
+    ZIP_SET(cd_header, compression_method, ZIP_GET(lf_header, compression_method));
+    ZIP_SET(cd_header, crc32, rec->crc32);
+    ZIP_SET(cd_header, compressed_size, (uint32_t)rec->compressed_size);
+    ZIP_SET(cd_header, uncompressed_size, (uint32_t)rec->uncompressed_size);
+    ZIP_SET(cd_header, file_name_length, name_len);
+    ZIP_SET(cd_header, external_attr, list->records[i].external_attr);
+    ZIP_SET(cd_header, rel_offset_local_header, (uint32_t)rec->offset);
+    memcpy(pos + sizeof(central_directory_header_t), base + rec->offset + sizeof(local_file_header_t), name_len);
+    pos += sizeof(central_directory_header_t) + name_len;
+  }
+
+  end_of_central_directory_header_t *eocd = (end_of_central_directory_header_t *)pos;
+  ZIP_SET(eocd, signature, EO_CENDIR_HEADER_SIGNATURE);
+  ZIP_SET(eocd, num_dir_entries_this_disk, (uint16_t)list->count);
+  ZIP_SET(eocd, total_num_entries_cd, (uint16_t)list->count);
+  ZIP_SET(eocd, size_of_cd, (uint32_t)cd_len);
+  ZIP_SET(eocd, cd_offset_in_first_disk, (uint32_t)offset);
+
+  size_t out_len = cd_len + sizeof(end_of_central_directory_header_t);
+  if (ctx->journal)
+  {
+    /* Everything from here on is overwritten or cut off */
+    for (uint64_t pos = offset; pos < size; pos += RECOVER_JOURNAL_CHUNK)
+    {
+      io_op_t op = {.fd = fd, .write = true, .offset = pos,
+                    .len = size - pos < RECOVER_JOURNAL_CHUNK ? (size_t)(size - pos) : RECOVER_JOURNAL_CHUNK};
+      ERR_RET_IF_NEQ(journal_record(ctx->journal, &op, 1, &ctx->stats), 0, -1);
+    }
+  }
+  ERR_RET_IF_NEQ(io_write_at(fd, out, out_len, offset, &ctx->stats), 0, -1);
+  ERR_RET_ON_ERRNO(ftruncate(fd, (off_t)(offset + out_len)), -1);
+  scratch_release(&ctx->scratch, mark);
+  return 0;
+}
+
+
+/**
+ * Memory taken by the records in \a list, and by the central directory and
+ * EOCD write_directory() builds from them.
+ */
+static uint64_t recover_memory_need(const record_list_t *list)
+{
+  uint64_t need = list->capacity * sizeof(recovered_t) + sizeof(end_of_central_directory_header_t);
+  for (size_t i = 0; i < list->count; i++)
+  {
+    need += sizeof(central_directory_header_t) + ZIP_GET(&list->records[i].rec.header, name_length);
+  }
+  return need;
+}
+
+
+int recover_archive(int fd, strip_ctx_t *ctx)
+{
+  struct stat st;
+  ERR_RET_ON_ERRNO(fstat(fd, &st), -1);
+  if (st.st_size == 0)
+  {
+    printf("Nothing to recover from an empty file!\n");
+    return -1;
+  }
+  size_t size = (size_t)st.st_size;
+
+  const uint8_t *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+  {
+    ERR_RET_ON_ERRNO(-1, -1);
+  }
+  madvise((void *)(uintptr_t)base, size, MADV_SEQUENTIAL);
+  const uint8_t *end = base + size;
+
+  scratch_reset(&ctx->scratch);
+  record_list_t list = {0};
+  size_t skipped = 0;
+  uint64_t data_end = 0;
+  int ret = 0;
+  const uint8_t *p = base;
+  while ((p = find_local_signature(p, end)) != NULL)
+  {
+    local_record_t rec;
+    if (!validate_candidate(base, p, end, &rec, &ctx->scratch))
+    {
+      skipped++;
+      p++;
+      continue;
+    }
+    if (!ctx->opts->quiet)
+    {
+      printf("Recovered entry at 0x%08" PRIx64 " %.*s\n", rec.offset, (int)ZIP_GET(&rec.header, name_length),
+             (const char *)p + sizeof(local_file_header_t));
+    }
+    if ((ret = record_list_add(&list, &rec, p + sizeof(local_file_header_t))) != 0)
+    {
+      break;
+    }
+    data_end = rec.end;
+    p = base + rec.end;
+  }
+  ctx->stats.bytes_read += size;
+
+  if (ret == 0 && list.count == 0)
+  {
+    printf("No intact local records found; leaving the file alone.\n");
+    ret = -1;
+  }
+  else if (ret == 0)
+  {
+    printf("Recovered %zu entries (%zu false candidates skipped), dropping %" PRIu64 " trailing bytes\n",
+           list.count, skipped, (uint64_t)size - data_end);
+    salvage_attributes(base, base + data_end, end, &list);
+    /* The records are already in memory; this waits for room for the directory too */
+    uint64_t reserved = ctx->opts->budget ? budget_acquire(ctx->opts->budget, recover_memory_need(&list)) : 0;
+    ret = write_directory(fd, base, &list, data_end, size, ctx);
+    if (reserved)
+    {
+      budget_release(ctx->opts->budget, reserved);
+      scratch_trim(&ctx->scratch, RECOVER_SCRATCH_KEEP);
+    }
+  }
+  munmap((void *)(uintptr_t)base, size);
+  free(list.records);
+  ERR_RET_IF_NEQ(ret, 0, -1);
+
+  /* Now it is a well formed archive again; purify it the normal way */
+  return strip_archive(fd, ctx);
+}
+
+
+int recover_file(const char *path, strip_ctx_t *ctx)
+{
+  int fd;
+  ERR_RET_ON_ERRNO(fd = open(path, O_RDWR), -1);
+
+  char *tmp_path = NULL;
+  int work_fd = fd;
+  if (ctx->opts->write_mode == WRITE_ATOMIC && (work_fd = atomic_begin(path, fd, &tmp_path)) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  if (ctx->opts->write_mode == WRITE_JOURNAL && (ctx->journal = journal_begin(path, fd, &ctx->stats)) == NULL)
+  {
+    close(fd);
+    return -1;
+  }
+
+  int ret = recover_archive(work_fd, ctx);
+
+  if (tmp_path)
+  {
+    ret = io_replace(path, work_fd, tmp_path, ret);
+  }
+  if (ctx->journal)
+  {
+    ret = ret == 0 ? journal_commit(ctx->journal) : (journal_rollback(ctx->journal, &ctx->stats), -1);
+    ctx->journal = NULL;
+  }
+  close(fd);
+  return ret;
+}
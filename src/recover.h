@@ -0,0 +1,31 @@
+/**
+ * @file
+ * Salvage archives whose central directory or EOCD is damaged or missing.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_RECOVER_H
+#define STRIPZIP_RECOVER_H
+
+#include "stripzip.h"
+
+/**
+ * Rebuild the archive open on \a fd from its local records. The file is
+ * scanned front to back for local headers; every candidate whose header is
+ * sane and whose data matches its CRC is kept. A fresh central directory and
+ * EOCD are written after the last good record, anything after that is cut
+ * off, and the result is purified with strip_archive(). Entries keep the
+ * host and attributes of any intact record left of the old central
+ * directory; the rest become Unix files with mode 0644, or directories with
+ * mode 0755.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int recover_archive(int fd, strip_ctx_t *ctx);
+
+/** Open \a path and rebuild it with recover_archive(), as opts->write_mode says. */
+int recover_file(const char *path, strip_ctx_t *ctx);
+
+#endif /* STRIPZIP_RECOVER_H */
@@ -0,0 +1,413 @@
+/**
+ * @file
+ * Rewriting purified archives with their entries laid out afresh.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "err.h"
+#include "archive.h"
+#include "local.h"
+#include "rewrite.h"
+
+/** Bytes of deflated data inflated at a time */
+#define REWRITE_CHUNK (64 * 1024)
+
+/** Arenas larger than this are given back after each archive when memory is
+ *  budgeted */
+#define REWRITE_SCRATCH_KEEP (1024 * 1024)
+
+/** Smallest alignment field: the header and the uint16 alignment */
+#define ALIGN_FIELD_MIN (sizeof(extra_header_t) + sizeof(uint16_t))
+
+/** General purpose bits that only mean something for deflated entries, and
+ *  the data descriptor, which stored entries are written without */
+#define STORE_CLEARED_BITS (GPB_METHOD_6_DETAIL | GPB_NOT_SEEKABLE)
+
+/** A local record and the header, name and extra field it is rewritten with */
+typedef struct
+{
+  local_record_t rec;
+  uint64_t new_offset;
+  char *out;          /**< New local header, name and extra field */
+  size_t out_len;
+  uint64_t data_len;  /**< Bytes written after out, descriptor included */
+  bool store;         /**< Inflate the data and store it */
+  bool padded;        /**< An alignment field was added */
+} rewrite_record_t;
+
+
+bool rewrite_wanted(const strip_options_t *opts)
+{
+  return opts->align > 1 || opts->store_below || opts->store_below_percent;
+}
+
+
+static int compare_local_offset(const void *a, const void *b)
+{
+  uint64_t offset_a = (*(const cd_entry_t * const *)a)->local_offset;
+  uint64_t offset_b = (*(const cd_entry_t * const *)b)->local_offset;
+  return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+
+/** Whether deflating \a rec saves too little to be worth inflating it for. */
+static bool should_store(const strip_options_t *opts, const local_record_t *rec)
+{
+  if (ZIP_GET(&rec->header, compression_method) != METHOD_DEFLATED || rec->zip64)
+  {
+    return false;
+  }
+  uint64_t size = rec->uncompressed_size;
+  uint64_t saved = size > rec->compressed_size ? size - rec->compressed_size : 0;
+  if (opts->store_below_percent)
+  {
+    return size == 0 || saved * 100 < (uint64_t)opts->store_below_percent * size;
+  }
+  return opts->store_below && saved < opts->store_below;
+}
+
+
+/**
+ * Copy the \a len byte extra field \a extra to \a out without its alignment
+ * fields.
+ *
+ * @return The length copied, or -1 if the extra field is malformed.
+ */
+static long drop_alignment(const char *extra, size_t len, char *out)
+{
+  size_t kept = 0;
+  size_t offset = 0;
+  while (offset < len)
+  {
+    if (len - offset < sizeof(extra_header_t))
+    {
+      return -1;
+    }
+    const extra_header_t *hdr = (const extra_header_t *)(extra + offset);
+    size_t field_len = sizeof(extra_header_t) + ZIP_GET(hdr, length);
+    if (field_len > len - offset)
+    {
+      return -1;
+    }
+    if (ZIP_GET(hdr, id) != ALIGNMENT_EXTRA_HEADER)
+    {
+      memmove(out + kept, extra + offset, field_len);
+      kept += field_len;
+    }
+    offset += field_len;
+  }
+  return (long)kept;
+}
+
+
+/**
+ * Work out how the local record of \a entry is rewritten when it moves to
+ * \a pos, and whether that changes it.
+ *
+ * @return 1 if the record changes, 0 if not, -1 on failure.
+ */
+static int plan_record(int fd, const cd_entry_t *entry, uint64_t pos, uint64_t region_end,
+                       rewrite_record_t *rr, strip_ctx_t *ctx)
+{
+  unsigned align = ctx->opts->align;
+  local_record_t *rec = &rr->rec;
+  rr->padded = false;
+  if (local_record_read(fd, entry->local_offset, region_end, rec, &ctx->scratch, &ctx->stats) != 0)
+  {
+    printf("%.*s: bad local record\n", (int)entry->name.len, entry->name.ptr);
+    return -1;
+  }
+  size_t name_len = ZIP_GET(&rec->header, name_length);
+  size_t extra_len = ZIP_GET(&rec->header, extra_field_length);
+  size_t head_len = sizeof(local_file_header_t) + name_len;
+
+  /* Room for the old extra field to be read in after the new one */
+  char *out;
+  ERR_RET_IF_NOT(out = scratch_alloc(&ctx->scratch, head_len + 2 * extra_len + align + ALIGN_FIELD_MIN), -1);
+  char *old_extra = out + head_len + extra_len + align + ALIGN_FIELD_MIN;
+  ERR_RET_IF_NEQ(io_read_at(fd, out + sizeof(local_file_header_t), name_len + extra_len,
+                            rec->offset + sizeof(local_file_header_t), &ctx->stats), 0, -1);
+  memcpy(old_extra, out + head_len, extra_len);
+
+  long kept = drop_alignment(old_extra, extra_len, out + head_len);
+  if (kept < 0)
+  {
+    printf("%.*s: malformed local extra field\n", (int)entry->name.len, entry->name.ptr);
+    return -1;
+  }
+  size_t new_extra_len = (size_t)kept;
+
+  local_file_header_t *lf_header = (local_file_header_t *)out;
+  memcpy(lf_header, &rec->header, sizeof(local_file_header_t));
+  rr->store = should_store(ctx->opts, rec);
+  rr->data_len = rec->end - rec->data_offset;
+  if (rr->store)
+  {
+    /* Sizes and CRC go in the header, so the data descriptor goes */
+    ZIP_SET(lf_header, gp_bits, ZIP_GET(lf_header, gp_bits) & ~STORE_CLEARED_BITS);
+    ZIP_SET(lf_header, compression_method, METHOD_STORED);
+    ZIP_SET(lf_header, crc32, rec->crc32);
+    ZIP_SET(lf_header, compressed_size, (uint32_t)rec->uncompressed_size);
+    ZIP_SET(lf_header, uncompressed_size, (uint32_t)rec->uncompressed_size);
+    rr->data_len = rec->uncompressed_size;
+  }
+
+  if (ZIP_GET(lf_header, compression_method) == METHOD_STORED && align > 1)
+  {
+    uint64_t data_pos = pos + head_len + new_extra_len;
+    size_t pad = (align - data_pos % align) % align;
+    while (pad && pad < ALIGN_FIELD_MIN)
+    {
+      pad += align;
+    }
+    if (new_extra_len + pad > UINT16_MAX)
+    {
+      printf("%.*s: no room in the extra field to align it\n", (int)entry->name.len, entry->name.ptr);
+      return -1;
+    }
+    if (pad)
+    {
+      extra_header_t *hdr = (extra_header_t *)(out + head_len + new_extra_len);
+      ZIP_SET(hdr, id, ALIGNMENT_EXTRA_HEADER);
+      ZIP_SET(hdr, length, (uint16_t)(pad - sizeof(extra_header_t)));
+      zip_store16(hdr + 1, (uint16_t)align);
+      memset((char *)(hdr + 1) + sizeof(uint16_t), 0, pad - ALIGN_FIELD_MIN);
+      new_extra_len += pad;
+    }
+    rr->padded = pad != 0;
+  }
+
+  ZIP_SET(lf_header, extra_field_length, (uint16_t)new_extra_len);
+  rr->new_offset = pos;
+  rr->out = out;
+  rr->out_len = head_len + new_extra_len;
+  return rr->store || pos != rec->offset || new_extra_len != extra_len ||
+         memcmp(out + head_len, old_extra, extra_len) != 0;
+}
+
+
+/**
+ * Inflate the data of \a rec from \a fd into \a out at \a pos, checking it
+ * against the record's size and CRC.
+ *
+ * @return 0 on success, -1 on failure or if the data is corrupt.
+ */
+static int inflate_to(int out, uint64_t pos, int fd, const local_record_t *rec, strip_ctx_t *ctx)
+{
+  scratch_mark_t mark = scratch_mark(&ctx->scratch);
+  unsigned char *in_buf;
+  unsigned char *out_buf;
+  ERR_RET_IF_NOT(in_buf = scratch_alloc(&ctx->scratch, REWRITE_CHUNK), -1);
+  ERR_RET_IF_NOT(out_buf = scratch_alloc(&ctx->scratch, REWRITE_CHUNK), -1);
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  ERR_RET_IF_NEQ(inflateInit2(&zs, -MAX_WBITS), Z_OK, -1);
+  int ret = Z_OK;
+  uLong crc = crc32(0, Z_NULL, 0);
+  uint64_t consumed = 0;
+  uint64_t produced = 0;
+  while (ret == Z_OK)
+  {
+    if (zs.avail_in == 0 && consumed < rec->compressed_size)
+    {
+      size_t chunk = rec->compressed_size - consumed < REWRITE_CHUNK ?
+                     (size_t)(rec->compressed_size - consumed) : REWRITE_CHUNK;
+      if (io_read_at(fd, in_buf, chunk, rec->data_offset + consumed, &ctx->stats) != 0)
+      {
+        break;
+      }
+      zs.next_in = in_buf;
+      zs.avail_in = (uInt)chunk;
+      consumed += chunk;
+    }
+    zs.next_out = out_buf;
+    zs.avail_out = REWRITE_CHUNK;
+    ret = inflate(&zs, Z_NO_FLUSH);
+    size_t got = REWRITE_CHUNK - zs.avail_out;
+    if ((ret != Z_OK && ret != Z_STREAM_END) || produced + got > rec->uncompressed_size ||
+        io_write_at(out, out_buf, got, pos + produced, &ctx->stats) != 0)
+    {
+      break;
+    }
+    crc = crc32(crc, out_buf, (uInt)got);
+    produced += got;
+    if (ret == Z_OK && got == 0 && zs.avail_in == 0 && consumed == rec->compressed_size)
+    {
+      /* Ran out of data before the end of the stream */
+      break;
+    }
+  }
+  inflateEnd(&zs);
+  scratch_release(&ctx->scratch, mark);
+
+  if (ret != Z_STREAM_END || produced != rec->uncompressed_size || crc != rec->crc32)
+  {
+    printf("Deflated data at 0x%" PRIx64 " is corrupt\n", rec->data_offset);
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Memory rewrite_file() takes for \a archive: its central directory, and a
+ * new local header for each entry, taking local names and extra fields to
+ * be as long as the central directory's and every entry to be padded.
+ */
+static uint64_t rewrite_memory_need(const archive_t *archive, const strip_options_t *opts)
+{
+  uint64_t per_entry = sizeof(cd_entry_t) + sizeof(cd_entry_t *) + sizeof(rewrite_record_t) +
+                       sizeof(local_file_header_t) + opts->align + ALIGN_FIELD_MIN;
+  /* Inflating takes two chunks, and about as much again for zlib's window */
+  return 3 * archive->cd_len + archive->num_entries * per_entry + 4 * REWRITE_CHUNK;
+}
+
+
+int rewrite_file(const char *path, strip_ctx_t *ctx)
+{
+  stats_t *stats = &ctx->stats;
+  int fd;
+  ERR_RET_ON_ERRNO(fd = open(path, O_RDONLY), -1);
+  scratch_reset(&ctx->scratch);
+
+  int ret = -1;
+  archive_t archive;
+  char *cd;
+  cd_entry_t *entries;
+  cd_entry_t **by_offset;
+  rewrite_record_t *records;
+  uint64_t reserved = 0;
+  if (archive_locate(fd, &archive, stats) != 0)
+  {
+    goto out;
+  }
+  if (ctx->opts->budget)
+  {
+    reserved = budget_acquire(ctx->opts->budget, rewrite_memory_need(&archive, ctx->opts));
+  }
+  if (archive_read_cd(&archive, &ctx->scratch, stats, &cd, &entries) != 0)
+  {
+    goto out;
+  }
+  if (archive.sig_block_len)
+  {
+    /* Rewriting comes before signing, and --signed=skip has already said so */
+    if (ctx->opts->signed_policy != SIGNED_SKIP)
+    {
+      printf("Not rewriting %s; moving its entries would invalidate the APK signature\n", path);
+      goto out;
+    }
+    ret = 0;
+    goto out;
+  }
+
+  size_t count = archive.num_entries;
+  if ((by_offset = scratch_alloc(&ctx->scratch, (count + 1) * sizeof(cd_entry_t *))) == NULL ||
+      (records = scratch_alloc(&ctx->scratch, (count + 1) * sizeof(rewrite_record_t))) == NULL)
+  {
+    goto out;
+  }
+  for (size_t i = 0; i < count; i++)
+  {
+    by_offset[i] = &entries[i];
+  }
+  qsort(by_offset, count, sizeof(cd_entry_t *), compare_local_offset);
+
+  /* Lay the records out back to back after whatever precedes the first one.
+   * Entries sharing a record keep sharing it. */
+  uint64_t first = count ? by_offset[0]->local_offset : archive.cd_offset;
+  uint64_t pos = first;
+  bool changed = false;
+  for (size_t k = 0; k < count; k++)
+  {
+    size_t i = (size_t)(by_offset[k] - entries);
+    if (k && by_offset[k]->local_offset == by_offset[k - 1]->local_offset)
+    {
+      records[i] = records[by_offset[k - 1] - entries];
+      records[i].out = NULL;
+      continue;
+    }
+    int moved = plan_record(fd, &entries[i], pos, archive.cd_offset, &records[i], ctx);
+    if (moved < 0)
+    {
+      goto out;
+    }
+    changed |= moved;
+    pos += records[i].out_len + records[i].data_len;
+  }
+  if (!changed)
+  {
+    ret = 0;
+    goto out;
+  }
+  /* The central directory goes last, so if it fits every record does */
+  if (pos - archive.bias > UINT32_MAX)
+  {
+    printf("Too much data to store without Zip64!\n");
+    goto out;
+  }
+
+  char *tmp_path;
+  int tmp;
+  if ((tmp = io_create_beside(path, fd, &tmp_path)) < 0)
+  {
+    goto out;
+  }
+  ret = io_copy_range(tmp, 0, fd, 0, first);
+  for (size_t k = 0; k < count && ret == 0; k++)
+  {
+    size_t i = (size_t)(by_offset[k] - entries);
+    const rewrite_record_t *rr = &records[i];
+    central_directory_header_t *cd_header = entries[i].header;
+    ZIP_SET(cd_header, rel_offset_local_header, (uint32_t)(rr->new_offset - archive.bias));
+    if (rr->store)
+    {
+      ZIP_SET(cd_header, gp_bits, ZIP_GET(cd_header, gp_bits) & ~STORE_CLEARED_BITS);
+      ZIP_SET(cd_header, compression_method, METHOD_STORED);
+      ZIP_SET(cd_header, compressed_size, ZIP_GET(cd_header, uncompressed_size));
+    }
+    if (rr->out == NULL)
+    {
+      continue;
+    }
+
+    uint64_t data_pos = rr->new_offset + rr->out_len;
+    if (io_write_at(tmp, rr->out, rr->out_len, rr->new_offset, stats) != 0 ||
+        (rr->store ? inflate_to(tmp, data_pos, fd, &rr->rec, ctx) :
+                     /* The data itself never leaves the kernel */
+                     io_copy_range(tmp, data_pos, fd, rr->rec.data_offset, rr->data_len)) != 0)
+    {
+      ret = -1;
+    }
+    stats->aligned_entries += rr->padded;
+    stats->stored_entries += rr->store;
+  }
+  if (ret == 0)
+  {
+    ret = archive_write_tail(&archive, cd, tmp, pos, stats);
+  }
+  ret = io_replace(path, tmp, tmp_path, ret);
+
+out:
+  if (reserved)
+  {
+    budget_release(ctx->opts->budget, reserved);
+    scratch_trim(&ctx->scratch, REWRITE_SCRATCH_KEEP);
+  }
+  close(fd);
+  return ret;
+}
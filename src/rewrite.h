@@ -0,0 +1,44 @@
+/**
+ * @file
+ * Rewriting purified archives with their entries laid out afresh.
+ *
+ * Some changes can't be made in place because they move entries. Deflated
+ * entries that deflate barely shrinks are inflated and stored, so readers
+ * can use them without decompressing them. Stored entries are aligned, as
+ * zipalign does, so that programs can mmap their data straight out of the
+ * archive: each one's local extra field is padded with an
+ * ALIGNMENT_EXTRA_HEADER field until its data starts on a boundary. Both
+ * happen in one pass into a new copy of the archive. The result depends
+ * only on the purified archive and the options, and rewriting it again
+ * changes nothing.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_REWRITE_H
+#define STRIPZIP_REWRITE_H
+
+#include <stdbool.h>
+
+#include "stripzip.h"
+
+/** Largest alignment the uint16 in an alignment extra field can record */
+#define ALIGN_MAX 32768
+
+/** Whether \a opts ask for anything rewrite_file() does. */
+bool rewrite_wanted(const strip_options_t *opts);
+
+/**
+ * Store the deflated entries of the archive at \a path that deflating
+ * saves too little on, by opts->store_below or opts->store_below_percent.
+ * Then align the data of every stored entry to opts->align bytes. Alignment
+ * fields left by earlier runs or by zipalign are replaced. If anything
+ * changes, the archive is rewritten next to itself and renamed into place.
+ * Data that isn't inflated is copied in the kernel.
+ *
+ * @return 0 on success, -1 on failure, leaving \a path as it was.
+ */
+int rewrite_file(const char *path, strip_ctx_t *ctx);
+
+#endif /* STRIPZIP_REWRITE_H */
@@ -0,0 +1,131 @@
+/**
+ * @file
+ * Reusable scratch arena.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdlib.h>
+
+#include "scratch.h"
+
+/** Smallest block ever allocated; enough for typical entry names and extras */
+#define SCRATCH_MIN_BLOCK 4096
+#define SCRATCH_ALIGN     16
+
+struct scratch_block
+{
+  scratch_block_t *next;
+  size_t size;
+  size_t used;
+  _Alignas(SCRATCH_ALIGN) unsigned char data[];
+};
+
+
+static scratch_block_t *new_block(size_t size, scratch_block_t *next)
+{
+  scratch_block_t *block = malloc(sizeof(scratch_block_t) + size);
+  if (block)
+  {
+    block->next = next;
+    block->size = size;
+    block->used = 0;
+  }
+  return block;
+}
+
+
+void *scratch_alloc(scratch_t *scratch, size_t len)
+{
+  len = (len + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+
+  scratch_block_t *block = scratch->head;
+  if (block == NULL || block->size - block->used < len)
+  {
+    /* Grow geometrically so a long run of small allocations stays cheap */
+    size_t size = scratch->total > SCRATCH_MIN_BLOCK ? scratch->total : SCRATCH_MIN_BLOCK;
+    while (size < len)
+    {
+      size *= 2;
+    }
+    if ((block = new_block(size, scratch->head)) == NULL)
+    {
+      return NULL;
+    }
+    scratch->head = block;
+    scratch->total += size;
+  }
+
+  void *ret = block->data + block->used;
+  block->used += len;
+  return ret;
+}
+
+
+scratch_mark_t scratch_mark(const scratch_t *scratch)
+{
+  scratch_mark_t mark = {scratch->head, scratch->head ? scratch->head->used : 0};
+  return mark;
+}
+
+
+void scratch_release(scratch_t *scratch, scratch_mark_t mark)
+{
+  /* Blocks added after the mark are kept until the next reset merges them */
+  for (scratch_block_t *block = scratch->head; block != mark.block; block = block->next)
+  {
+    block->used = 0;
+  }
+  if (mark.block)
+  {
+    mark.block->used = mark.used;
+  }
+}
+
+
+void scratch_reset(scratch_t *scratch)
+{
+  scratch_block_t *block = scratch->head;
+  if (block == NULL)
+  {
+    return;
+  }
+
+  if (block->next)
+  {
+    /* Merge into a single block big enough for everything we needed */
+    size_t total = scratch->total;
+    scratch_free(scratch);
+    if ((scratch->head = new_block(total, NULL)) != NULL)
+    {
+      scratch->total = total;
+    }
+    return;
+  }
+
+  block->used = 0;
+}
+
+
+void scratch_free(scratch_t *scratch)
+{
+  scratch_block_t *block = scratch->head;
+  while (block)
+  {
+    scratch_block_t *next = block->next;
+    free(block);
+    block = next;
+  }
+  scratch->head = NULL;
+  scratch->total = 0;
+}
+
+
+void scratch_trim(scratch_t *scratch, size_t keep)
+{
+  if (scratch->total > keep)
+  {
+    scratch_free(scratch);
+  }
+}
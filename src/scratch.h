@@ -0,0 +1,62 @@
+/**
+ * @file
+ * Reusable scratch arena.
+ *
+ * A bump allocator owned by a single worker. Allocations are released all at
+ * once with scratch_reset(), which keeps the memory around for the next entry
+ * or archive so the steady state performs no heap traffic at all.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_SCRATCH_H
+#define STRIPZIP_SCRATCH_H
+
+#include <stddef.h>
+
+typedef struct scratch_block scratch_block_t;
+
+typedef struct
+{
+  scratch_block_t *head;  /**< Block currently being allocated from */
+  size_t total;           /**< Capacity of all blocks, used to size the next one */
+} scratch_t;
+
+/** A point in the arena to roll back to with scratch_release(). */
+typedef struct
+{
+  scratch_block_t *block;
+  size_t used;
+} scratch_mark_t;
+
+/**
+ * Allocate \a len bytes from the arena. The memory stays valid until the
+ * next scratch_reset() or scratch_free().
+ *
+ * @return The allocation, or NULL if the system is out of memory.
+ */
+void *scratch_alloc(scratch_t *scratch, size_t len);
+
+/** Remember the current allocation position. */
+scratch_mark_t scratch_mark(const scratch_t *scratch);
+
+/**
+ * Release everything allocated since \a mark was taken, keeping older
+ * allocations valid. Used for short lived buffers nested in longer ones.
+ */
+void scratch_release(scratch_t *scratch, scratch_mark_t mark);
+
+/**
+ * Release every allocation at once. If the arena had to grow since the last
+ * reset, the blocks are merged into one so that growth happens only once.
+ */
+void scratch_reset(scratch_t *scratch);
+
+/** Return all memory held by the arena to the system. */
+void scratch_free(scratch_t *scratch);
+
+/** Return the arena's memory to the system if it holds more than \a keep bytes. */
+void scratch_trim(scratch_t *scratch, size_t keep);
+
+#endif /* STRIPZIP_SCRATCH_H */
@@ -0,0 +1,220 @@
+/**
+ * @file
+ * Low overhead counters and monotonic phase timers for StripZIP.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "stats.h"
+
+static const char *PHASE_NAMES[PHASE_COUNT] = {
+  [PHASE_EOCD]    = "eocd",
+  [PHASE_CD_WALK] = "cd_walk",
+  [PHASE_LOCAL]   = "local",
+  [PHASE_READ]    = "read",
+  [PHASE_WRITE]   = "write",
+};
+
+
+uint64_t stats_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+static void count_extra(stats_t *stats, uint16_t id, uint64_t count)
+{
+  /* Archives only ever use a handful of IDs; a linear scan is plenty */
+  for (size_t i = 0; i < STATS_MAX_EXTRA_IDS; i++)
+  {
+    stats_extra_count_t *slot = &stats->extra_fields[i];
+    if (slot->count == 0)
+    {
+      slot->id = id;
+    }
+    if (slot->id == id)
+    {
+      slot->count += count;
+      return;
+    }
+  }
+  stats->other_extra_fields += count;
+}
+
+
+void stats_count_extra(stats_t *stats, uint16_t id)
+{
+  count_extra(stats, id, 1);
+}
+
+
+void stats_merge(stats_t *dst, const stats_t *src)
+{
+  for (size_t phase = 0; phase < PHASE_COUNT; phase++)
+  {
+    dst->phase_ns[phase] += src->phase_ns[phase];
+  }
+  dst->archives += src->archives;
+  dst->entries += src->entries;
+  dst->reads += src->reads;
+  dst->bytes_read += src->bytes_read;
+  dst->writes += src->writes;
+  dst->bytes_written += src->bytes_written;
+  dst->seeks += src->seeks;
+  dst->coalesced_ops += src->coalesced_ops;
+  dst->syncs += src->syncs;
+  dst->unknown_extra_fields += src->unknown_extra_fields;
+  dst->header_mismatches += src->header_mismatches;
+  dst->unfixed_mismatches += src->unfixed_mismatches;
+  dst->cache_hits += src->cache_hits;
+  dst->cache_misses += src->cache_misses;
+  dst->cache_stores += src->cache_stores;
+  dst->duplicates += src->duplicates;
+  dst->duplicate_bytes += src->duplicate_bytes;
+  dst->compacted_bytes += src->compacted_bytes;
+  dst->aligned_entries += src->aligned_entries;
+  dst->stored_entries += src->stored_entries;
+  dst->already_pure += src->already_pure;
+  dst->other_extra_fields += src->other_extra_fields;
+  for (size_t i = 0; i < STATS_MAX_EXTRA_IDS && src->extra_fields[i].count; i++)
+  {
+    count_extra(dst, src->extra_fields[i].id, src->extra_fields[i].count);
+  }
+}
+
+
+static void print_text(const stats_t *stats, FILE *out)
+{
+  fprintf(out, "Statistics:\n");
+  for (size_t phase = 0; phase < PHASE_COUNT; phase++)
+  {
+    fprintf(out, "\t%-14s %10.3f ms\n", PHASE_NAMES[phase], (double)stats->phase_ns[phase] / 1e6);
+  }
+  fprintf(out, "\tarchives       %10" PRIu64 "\n", stats->archives);
+  fprintf(out, "\tentries        %10" PRIu64 "\n", stats->entries);
+  fprintf(out, "\treads          %10" PRIu64 " (%" PRIu64 " bytes)\n", stats->reads, stats->bytes_read);
+  fprintf(out, "\twrites         %10" PRIu64 " (%" PRIu64 " bytes)\n", stats->writes, stats->bytes_written);
+  fprintf(out, "\tseeks          %10" PRIu64 "\n", stats->seeks);
+  fprintf(out, "\tcoalesced      %10" PRIu64 "\n", stats->coalesced_ops);
+  fprintf(out, "\tsyncs          %10" PRIu64 "\n", stats->syncs);
+  for (size_t i = 0; i < STATS_MAX_EXTRA_IDS && stats->extra_fields[i].count; i++)
+  {
+    fprintf(out, "\textra 0x%04x    %10" PRIu64 "\n", stats->extra_fields[i].id, stats->extra_fields[i].count);
+  }
+  if (stats->other_extra_fields)
+  {
+    fprintf(out, "\textra other    %10" PRIu64 "\n", stats->other_extra_fields);
+  }
+  fprintf(out, "\tunknown extra  %10" PRIu64 "\n", stats->unknown_extra_fields);
+  fprintf(out, "\tmismatches     %10" PRIu64 "\n", stats->header_mismatches);
+  if (stats->unfixed_mismatches)
+  {
+    fprintf(out, "\tunfixed        %10" PRIu64 "\n", stats->unfixed_mismatches);
+  }
+  if (stats->cache_hits || stats->cache_misses)
+  {
+    fprintf(out, "\tcache hits     %10" PRIu64 " (%" PRIu64 " misses, %" PRIu64 " stored)\n",
+            stats->cache_hits, stats->cache_misses, stats->cache_stores);
+  }
+  if (stats->duplicates)
+  {
+    fprintf(out, "\tduplicates     %10" PRIu64 " (%" PRIu64 " bytes)\n", stats->duplicates, stats->duplicate_bytes);
+  }
+  if (stats->compacted_bytes)
+  {
+    fprintf(out, "\tcompacted      %10" PRIu64 " bytes\n", stats->compacted_bytes);
+  }
+  if (stats->aligned_entries)
+  {
+    fprintf(out, "\taligned        %10" PRIu64 " entries\n", stats->aligned_entries);
+  }
+  if (stats->stored_entries)
+  {
+    fprintf(out, "\tre-stored      %10" PRIu64 " entries\n", stats->stored_entries);
+  }
+  if (stats->already_pure)
+  {
+    fprintf(out, "\talready pure   %10" PRIu64 " archives\n", stats->already_pure);
+  }
+}
+
+
+static void print_prometheus(const stats_t *stats, FILE *out)
+{
+  fprintf(out, "# HELP stripzip_phase_seconds Wall time spent in each processing phase.\n");
+  fprintf(out, "# TYPE stripzip_phase_seconds counter\n");
+  for (size_t phase = 0; phase < PHASE_COUNT; phase++)
+  {
+    fprintf(out, "stripzip_phase_seconds{phase=\"%s\"} %.9f\n", PHASE_NAMES[phase], (double)stats->phase_ns[phase] / 1e9);
+  }
+
+#define PROM_COUNTER(name, help, value)                                   \
+  do {                                                                    \
+    fprintf(out, "# HELP stripzip_" name " " help "\n");                  \
+    fprintf(out, "# TYPE stripzip_" name " counter\n");                   \
+    fprintf(out, "stripzip_" name " %" PRIu64 "\n", (value));             \
+  } while (0)
+
+  PROM_COUNTER("archives_total", "Archives processed.", stats->archives);
+  PROM_COUNTER("entries_total", "Central directory entries processed.", stats->entries);
+  PROM_COUNTER("reads_total", "Read calls issued.", stats->reads);
+  PROM_COUNTER("read_bytes_total", "Bytes read.", stats->bytes_read);
+  PROM_COUNTER("writes_total", "Write calls issued.", stats->writes);
+  PROM_COUNTER("written_bytes_total", "Bytes written.", stats->bytes_written);
+  PROM_COUNTER("seeks_total", "Seeks issued.", stats->seeks);
+  PROM_COUNTER("coalesced_ops_total", "Operations merged into an adjacent operation's I/O.", stats->coalesced_ops);
+  PROM_COUNTER("syncs_total", "fsync, fdatasync and syncfs calls issued.", stats->syncs);
+  PROM_COUNTER("unknown_extra_fields_total", "Extra fields with an unsupported header ID.", stats->unknown_extra_fields);
+  PROM_COUNTER("header_mismatches_total", "Local header fields disagreeing with the central directory.",
+               stats->header_mismatches);
+  PROM_COUNTER("unfixed_mismatches_total", "Mismatches --check=fix could not fix.", stats->unfixed_mismatches);
+  PROM_COUNTER("cache_hits_total", "Archives served from the cache.", stats->cache_hits);
+  PROM_COUNTER("cache_misses_total", "Archives not found in the cache.", stats->cache_misses);
+  PROM_COUNTER("cache_stores_total", "Archives added to the cache.", stats->cache_stores);
+  PROM_COUNTER("duplicates_total", "Entries whose data repeats an earlier entry's.", stats->duplicates);
+  PROM_COUNTER("duplicate_bytes_total", "Bytes of local records holding duplicate data.", stats->duplicate_bytes);
+  PROM_COUNTER("compacted_bytes_total", "Bytes of placeholder extra fields removed.", stats->compacted_bytes);
+  PROM_COUNTER("aligned_entries_total", "Stored entries padded so their data is aligned.", stats->aligned_entries);
+  PROM_COUNTER("stored_entries_total", "Deflated entries rewritten as stored.", stats->stored_entries);
+  PROM_COUNTER("already_pure_total", "Archives left alone as purified before.", stats->already_pure);
+
+#undef PROM_COUNTER
+
+  fprintf(out, "# HELP stripzip_extra_fields_total Extra fields seen, by header ID.\n");
+  fprintf(out, "# TYPE stripzip_extra_fields_total counter\n");
+  for (size_t i = 0; i < STATS_MAX_EXTRA_IDS && stats->extra_fields[i].count; i++)
+  {
+    fprintf(out, "stripzip_extra_fields_total{id=\"0x%04x\"} %" PRIu64 "\n",
+            stats->extra_fields[i].id, stats->extra_fields[i].count);
+  }
+  if (stats->other_extra_fields)
+  {
+    fprintf(out, "stripzip_extra_fields_total{id=\"other\"} %" PRIu64 "\n", stats->other_extra_fields);
+  }
+}
+
+
+void stats_print(const stats_t *stats, stats_format_t format, FILE *out)
+{
+  switch (format)
+  {
+    case STATS_FORMAT_TEXT:
+      print_text(stats, out);
+      break;
+
+    case STATS_FORMAT_PROMETHEUS:
+      print_prometheus(stats, out);
+      break;
+
+    case STATS_FORMAT_NONE:
+      break;
+  }
+}
@@ -0,0 +1,88 @@
+/**
+ * @file
+ * Low overhead counters and monotonic phase timers for StripZIP.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_STATS_H
+#define STRIPZIP_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/** Number of distinct extra header IDs tracked before lumping into "other" */
+#define STATS_MAX_EXTRA_IDS 32
+
+typedef enum
+{
+  STATS_FORMAT_NONE = 0,
+  STATS_FORMAT_TEXT,
+  STATS_FORMAT_PROMETHEUS,
+} stats_format_t;
+
+typedef enum
+{
+  PHASE_EOCD = 0,     /**< Locating and reading the end of central directory */
+  PHASE_CD_WALK,      /**< Reading and purifying central directory entries */
+  PHASE_LOCAL,        /**< Seeking to and purifying local file headers */
+  PHASE_READ,         /**< Waiting for reads (overlaps the above) */
+  PHASE_WRITE,        /**< Writing purified data back (overlaps the above) */
+  PHASE_COUNT
+} stats_phase_t;
+
+typedef struct
+{
+  uint16_t id;
+  uint64_t count;
+} stats_extra_count_t;
+
+typedef struct
+{
+  uint64_t phase_ns[PHASE_COUNT];
+  uint64_t archives;
+  uint64_t entries;
+  uint64_t reads;
+  uint64_t bytes_read;
+  uint64_t writes;
+  uint64_t bytes_written;
+  uint64_t seeks;         /**< Positioned I/O not contiguous with the previous one */
+  uint64_t io_position;   /**< End of the previous I/O, for counting seeks */
+  uint64_t coalesced_ops; /**< Operations merged into an adjacent one's I/O */
+  uint64_t syncs;
+  uint64_t unknown_extra_fields;
+  uint64_t header_mismatches;   /**< Local header fields disagreeing with the CD */
+  uint64_t unfixed_mismatches;  /**< Those --check=fix couldn't make agree */
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t cache_stores;
+  uint64_t duplicates;          /**< Entries whose data repeats an earlier entry's */
+  uint64_t duplicate_bytes;     /**< Bytes of local records those take up */
+  uint64_t compacted_bytes;     /**< Bytes of placeholders removed by compaction */
+  uint64_t aligned_entries;     /**< Stored entries padded so their data is aligned */
+  uint64_t stored_entries;      /**< Deflated entries rewritten as stored */
+  uint64_t already_pure;        /**< Archives left alone as purified before */
+  uint64_t other_extra_fields;  /**< Fields whose ID didn't fit in extra_fields */
+  stats_extra_count_t extra_fields[STATS_MAX_EXTRA_IDS];
+} stats_t;
+
+/** Current CLOCK_MONOTONIC time in nanoseconds. */
+uint64_t stats_now(void);
+
+/** Charge the time elapsed since \a start (from stats_now()) to \a phase. */
+static inline void stats_phase_end(stats_t *stats, stats_phase_t phase, uint64_t start)
+{
+  stats->phase_ns[phase] += stats_now() - start;
+}
+
+/** Count one occurrence of the extra header \a id. */
+void stats_count_extra(stats_t *stats, uint16_t id);
+
+/** Add the counters in \a src to \a dst, e.g. to combine worker threads. */
+void stats_merge(stats_t *dst, const stats_t *src);
+
+/** Print \a stats to \a out in the requested format. */
+void stats_print(const stats_t *stats, stats_format_t format, FILE *out);
+
+#endif /* STRIPZIP_STATS_H */
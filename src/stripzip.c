@@ -0,0 +1,1017 @@
+/**
+ * @file
+ * StripZIP
+ * Sanitize a ZIP file from all horrible timestamps, UID, and GID nonsense.
+ *
+ * ZIP specification at https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
+ * Additional extended header information available from
+ *   ftp://ftp.info-zip.org/pub/infozip/src/zip30.zip ./proginfo/extrafld.txt
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "err.h"
+#include "stats.h"
+#include "scratch.h"
+#include "io.h"
+#include "zip_format.h"
+#include "archive.h"
+#include "stripzip.h"
+#include "compact.h"
+#include "rewrite.h"
+#include "volume.h"
+
+
+/**
+ * Take either a central directory or local file extra data field and for the
+ * things we know are horrible; purify it!
+ *
+ * The fields are neutralized in place, so nothing moves; --compact removes the
+ * placeholders left behind afterwards, see compact_archive().
+ */
+bool purify_extra_data(size_t len, void* extra_data, stats_t *stats)
+{
+  char *data = extra_data;
+  size_t offset = 0;
+  while (offset < len)
+  {
+    if (len - offset < sizeof(extra_header_t))
+    {
+      printf("\tTruncated extra header\n");
+      return false;
+    }
+    extra_header_t *hdr = (extra_header_t *)(data + offset);
+    uint16_t id = ZIP_GET(hdr, id);
+    uint16_t length = ZIP_GET(hdr, length);
+    offset += sizeof(extra_header_t);
+    stats_count_extra(stats, id);
+    if (len - offset < length)
+    {
+      printf("\tExtra header 0x%x overruns the extra field\n", id);
+      return false;
+    }
+
+    switch (id)
+    {
+      case 0x5455:
+        /* Some sort of extended time data, see
+         * ftp://ftp.info-zip.org/pub/infozip/src/zip30.zip ./proginfo/extrafld.txt
+        .. fallthrough */
+      case 0x7875:
+        /* Unix extra data; UID / GID stuff, see
+         * ftp://ftp.info-zip.org/pub/infozip/src/zip30.zip ./proginfo/extrafld.txt
+         */
+        ZIP_SET(hdr, id, STRIPZIP_OPTION_HEADER);
+        memset(data + offset, 0xFF, length);
+        break;
+
+      case STRIPZIP_OPTION_HEADER:
+      case ALIGNMENT_EXTRA_HEADER:
+        break;
+
+      default:
+        printf("\tUnknown extra header: 0x%x %u\n", id, length);
+        stats->unknown_extra_fields++;
+        return false;
+        break;
+    }
+    offset += length;
+  }
+
+  return true;
+}
+
+
+/** File offset of the extra field of a local header. */
+static inline uint64_t local_extra_offset(const cd_entry_t *entry, const local_file_header_t *lf_header)
+{
+  return entry->local_offset + sizeof(local_file_header_t) + ZIP_GET(lf_header, name_length);
+}
+
+
+/** Whether the local record at \a offset is one several entries point at. */
+static bool shared_record(const strip_ctx_t *ctx, uint64_t offset)
+{
+  size_t lo = 0;
+  size_t hi = ctx->num_shared_records;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ctx->shared_records[mid] < offset)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return lo < ctx->num_shared_records && ctx->shared_records[lo] == offset;
+}
+
+
+/**
+ * Compare a local header with its central directory entry, which is taken to
+ * be authoritative. Sizes and CRC are allowed to be zero in the local header
+ * of entries with a data descriptor. In CHECK_FIX mode the local header, and
+ * the name when both are the same length, are rewritten to match. A record
+ * shared by several entries can't match them all, so it is reported and
+ * left alone.
+ *
+ * @param name The local file name.
+ * @param name_fixed Set if the name was rewritten.
+ */
+static void check_local_header(const cd_entry_t *entry, local_file_header_t *lf_header, char *name,
+                               bool *name_fixed, strip_ctx_t *ctx)
+{
+  const central_directory_header_t *cd_header = entry->header;
+  bool fix = ctx->opts->check == CHECK_FIX;
+  bool descriptor = ZIP_GET(lf_header, gp_bits) & GPB_NOT_SEEKABLE;
+
+  if (shared_record(ctx, entry->local_offset))
+  {
+    printf("%.*s: local record is shared with other entries%s\n", (int)entry->name.len, entry->name.ptr,
+           fix ? "; can't fix" : "");
+    ctx->stats.header_mismatches++;
+    ctx->stats.unfixed_mismatches += fix;
+    return;
+  }
+
+#define CHECK_FIELD(lf_field, cd_field, may_be_zero)                                          \
+  do {                                                                                        \
+    uint32_t lf_value = ZIP_GET(lf_header, lf_field);                                         \
+    uint32_t cd_value = ZIP_GET(cd_header, cd_field);                                         \
+    if (lf_value != cd_value && !((may_be_zero) && lf_value == 0))                            \
+    {                                                                                         \
+      printf("%.*s: local %s is 0x%x, central directory has 0x%x%s\n",                        \
+             (int)entry->name.len, entry->name.ptr, #lf_field, lf_value, cd_value,           \
+             fix ? "; fixed" : "");                                                           \
+      ctx->stats.header_mismatches++;                                                         \
+      if (fix)                                                                                \
+      {                                                                                       \
+        ZIP_SET(lf_header, lf_field, ZIP_GET(cd_header, cd_field));                           \
+      }                                                                                       \
+    }                                                                                         \
+  } while (0)
+
+  CHECK_FIELD(version_needed, version_needed, false);
+  CHECK_FIELD(gp_bits, gp_bits, false);
+  CHECK_FIELD(compression_method, compression_method, false);
+  CHECK_FIELD(crc32, crc32, descriptor);
+  CHECK_FIELD(compressed_size, compressed_size, descriptor);
+  CHECK_FIELD(uncompressed_size, uncompressed_size, descriptor);
+
+#undef CHECK_FIELD
+
+  if (ZIP_GET(lf_header, name_length) != entry->name.len || memcmp(name, entry->name.ptr, entry->name.len) != 0)
+  {
+    bool fixable = fix && ZIP_GET(lf_header, name_length) == entry->name.len;
+    printf("%.*s: local name is \"%.*s\"%s\n", (int)entry->name.len, entry->name.ptr,
+           (int)ZIP_GET(lf_header, name_length), name,
+           fixable ? "; fixed" : fix ? "; lengths differ, can't fix in place" : "");
+    ctx->stats.header_mismatches++;
+    ctx->stats.unfixed_mismatches += fix && !fixable;
+    if (fixable)
+    {
+      memcpy(name, entry->name.ptr, entry->name.len);
+      *name_fixed = true;
+    }
+  }
+}
+
+
+/** Local headers handled per I/O batch; bounds the scratch memory used */
+#define LOCAL_BATCH_ENTRIES 1024
+
+/**
+ * Purify the local file headers belonging to a run of central directory
+ * entries. The headers are read, patched and written back in batches so
+ * that an asynchronous I/O engine can keep many of them in flight at once.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int strip_local_headers(const archive_t *archive, const cd_entry_t *entries, const unsigned *actions,
+                               size_t count, strip_ctx_t *ctx)
+{
+  int fd = archive->fd;
+  scratch_mark_t mark = scratch_mark(&ctx->scratch);
+  bool checking = ctx->opts->check != CHECK_OFF;
+  local_file_header_t *lf_headers;
+  char **local_names;
+  char **local_extras;
+  bool *names_fixed;
+  io_op_t *ops;
+  ERR_RET_IF_NOT(lf_headers = scratch_alloc(&ctx->scratch, count * sizeof(local_file_header_t)), -1);
+  ERR_RET_IF_NOT(local_names = scratch_alloc(&ctx->scratch, count * sizeof(char *)), -1);
+  ERR_RET_IF_NOT(local_extras = scratch_alloc(&ctx->scratch, count * sizeof(char *)), -1);
+  ERR_RET_IF_NOT(names_fixed = scratch_alloc(&ctx->scratch, count * sizeof(bool)), -1);
+  ERR_RET_IF_NOT(ops = scratch_alloc(&ctx->scratch, 2 * count * sizeof(io_op_t)), -1);
+
+  /* Round one: the fixed size part of every local header */
+  for (size_t i = 0; i < count; i++)
+  {
+    ops[i] = (io_op_t){.fd = fd, .write = false, .offset = entries[i].local_offset,
+                       .buf = &lf_headers[i], .len = sizeof(local_file_header_t)};
+  }
+  ERR_RET_IF_NEQ(archive_submit(archive, ctx->io, ops, count, &ctx->stats), 0, -1);
+
+  /* Round two: the local extra fields, which we only now know the size of.
+   * The name comes along in the same read, so that the header, name and
+   * extra field can go back as one contiguous write. */
+  size_t num_ops = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    local_file_header_t *lf_header = &lf_headers[i];
+    ERR_RET_IF_NEQ(ZIP_GET(lf_header, signature), FILE_HEADER_SIGNATURE, -1);
+
+    if ((ZIP_GET(lf_header, gp_bits) & GP_BIT_ENC_MARKERS) != 0x0)
+    {
+      printf("Entry encrypted, I don't know how to deal with that.\n");
+      return -1;
+    }
+    if ((ZIP_GET(lf_header, gp_bits) & GP_BIT_UNKNOWN_FLAG_MASK) != 0)
+    {
+      printf("Entry has strange general purpose bits: %u\n", ZIP_GET(lf_header, gp_bits));
+      return -1;
+    }
+
+    ZIP_SET(lf_header, last_mod_date, 0);
+    ZIP_SET(lf_header, last_mod_time, 0);
+
+    uint16_t name_len = ZIP_GET(lf_header, name_length);
+    uint16_t extra_len = ZIP_GET(lf_header, extra_field_length);
+    local_names[i] = NULL;
+    local_extras[i] = NULL;
+    names_fixed[i] = false;
+    if (name_len + extra_len)
+    {
+      ERR_RET_IF_NOT(local_names[i] = scratch_alloc(&ctx->scratch, name_len + extra_len), -1);
+      local_extras[i] = extra_len ? local_names[i] + name_len : NULL;
+      ops[num_ops++] = (io_op_t){.fd = fd, .write = false,
+                                 .offset = local_extra_offset(&entries[i], lf_header) - name_len,
+                                 .buf = local_names[i], .len = name_len + extra_len};
+    }
+  }
+  ERR_RET_IF_NEQ(archive_submit(archive, ctx->io, ops, num_ops, &ctx->stats), 0, -1);
+
+  /* Round three: check, purify and write everything back */
+  num_ops = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    local_file_header_t *lf_header = &lf_headers[i];
+    if (checking)
+    {
+      check_local_header(&entries[i], lf_header, local_names[i], &names_fixed[i], ctx);
+    }
+
+    ops[num_ops++] = (io_op_t){.fd = fd, .write = true, .offset = entries[i].local_offset,
+                               .buf = lf_header, .len = sizeof(local_file_header_t)};
+    if (actions && (actions[i] & POLICY_KEEP_EXTRA))
+    {
+      local_extras[i] = NULL;
+    }
+    if (local_extras[i])
+    {
+      ERR_RET_IF_NOT(purify_extra_data(ZIP_GET(lf_header, extra_field_length), local_extras[i], &ctx->stats), -1);
+    }
+    if (local_extras[i] || names_fixed[i])
+    {
+      /* Adjacent to the header, so the I/O engine merges the two */
+      ops[num_ops++] = (io_op_t){.fd = fd, .write = true,
+                                 .offset = entries[i].local_offset + sizeof(local_file_header_t),
+                                 .buf = local_names[i],
+                                 .len = (size_t)ZIP_GET(lf_header, name_length) + ZIP_GET(lf_header, extra_field_length)};
+    }
+  }
+  if (ctx->journal)
+  {
+    ERR_RET_IF_NEQ(journal_record(ctx->journal, ops, num_ops, &ctx->stats), 0, -1);
+  }
+  ERR_RET_IF_NEQ(archive_submit(archive, ctx->io, ops, num_ops, &ctx->stats), 0, -1);
+
+  scratch_release(&ctx->scratch, mark);
+  return 0;
+}
+
+
+/** Arenas larger than this are given back after each archive when memory is
+ *  budgeted */
+#define STRIP_SCRATCH_KEEP (1024 * 1024)
+
+/** Bytes of central directory read at once when it doesn't fit the budget */
+#define CD_CHUNK_BYTES (1024 * 1024)
+
+/** Smallest chunk, which still holds the largest possible entry */
+#define CD_CHUNK_MIN (sizeof(central_directory_header_t) + 3 * (size_t)UINT16_MAX)
+
+/** Archives with at least this many entries spread their local headers over
+ *  borrowed threads */
+#define SPLIT_MIN_ENTRIES (4 * LOCAL_BATCH_ENTRIES)
+
+/** Most threads borrowed by one archive */
+#define SPLIT_MAX_HELPERS 63
+
+/**
+ * Memory a thread takes for one batch of local headers of \a archive, taking
+ * local names and extra fields to be as long as the central directory's.
+ */
+static uint64_t local_batch_need(const archive_t *archive)
+{
+  uint64_t count = archive->num_entries < LOCAL_BATCH_ENTRIES ? archive->num_entries : LOCAL_BATCH_ENTRIES;
+  uint64_t var_len = archive->num_entries ? archive->cd_len / archive->num_entries : 0;
+  return count * (sizeof(local_file_header_t) + 2 * sizeof(char *) + sizeof(bool) + 2 * sizeof(io_op_t) + var_len);
+}
+
+
+/** The local header batches of one archive, shared by the threads purifying them */
+typedef struct
+{
+  const archive_t *archive;
+  const cd_entry_t *entries;
+  const unsigned *actions;
+  size_t num_entries;
+  size_t next;          /**< First entry of the next batch to be taken; atomic */
+  bool failed;          /**< Atomic */
+  unsigned *idle_threads;
+  budget_t *budget;     /**< Each borrowed thread reserves helper_need of it, or NULL */
+  uint64_t helper_need;
+} local_split_t;
+
+/** A borrowed thread, with a context of its own */
+typedef struct
+{
+  local_split_t *split;
+  strip_ctx_t ctx;
+  pthread_t thread;
+} local_helper_t;
+
+
+/**
+ * Purify the next batch of local headers in \a split, if any are left.
+ *
+ * @return True if a batch was purified, false if none were left or one
+ *         failed.
+ */
+static bool strip_local_batch(local_split_t *split, strip_ctx_t *ctx)
+{
+  size_t first = __atomic_fetch_add(&split->next, LOCAL_BATCH_ENTRIES, __ATOMIC_RELAXED);
+  if (first >= split->num_entries || __atomic_load_n(&split->failed, __ATOMIC_RELAXED))
+  {
+    return false;
+  }
+  size_t count = split->num_entries - first < LOCAL_BATCH_ENTRIES ? split->num_entries - first : LOCAL_BATCH_ENTRIES;
+  if (strip_local_headers(split->archive, split->entries + first, split->actions ? split->actions + first : NULL,
+                          count, ctx) != 0)
+  {
+    __atomic_store_n(&split->failed, true, __ATOMIC_RELAXED);
+    return false;
+  }
+  return true;
+}
+
+
+static void *local_helper(void *arg)
+{
+  local_helper_t *helper = arg;
+  while (strip_local_batch(helper->split, &helper->ctx))
+  {
+  }
+  /* Lend the thread on as soon as it is done here */
+  __atomic_add_fetch(helper->split->idle_threads, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+
+/** Take up to \a wanted of the \a idle threads. */
+static unsigned borrow_threads(unsigned *idle, unsigned wanted)
+{
+  unsigned avail = __atomic_load_n(idle, __ATOMIC_RELAXED);
+  unsigned taken;
+  do
+  {
+    taken = avail < wanted ? avail : wanted;
+  } while (taken && !__atomic_compare_exchange_n(idle, &avail, avail - taken, false,
+                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return taken;
+}
+
+
+/**
+ * Purify the local headers of all \a num_entries \a entries, batch by
+ * batch. Large archives take on the threads idle workers lend while they
+ * go, so that one huge archive at the end of a batch doesn't keep the
+ * others waiting; each batch is independent of the others. Journaled
+ * archives are done by one thread, to keep the journal in order.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int strip_all_local_headers(const archive_t *archive, const cd_entry_t *entries, const unsigned *actions,
+                                   size_t num_entries, strip_ctx_t *ctx)
+{
+  local_split_t split = {.archive = archive, .entries = entries, .actions = actions, .num_entries = num_entries,
+                         .idle_threads = ctx->opts->idle_threads, .budget = ctx->opts->budget,
+                         .helper_need = local_batch_need(archive)};
+  local_helper_t *helpers = NULL;
+  size_t num_helpers = 0;
+  if (split.idle_threads && num_entries >= SPLIT_MIN_ENTRIES && ctx->journal == NULL)
+  {
+    helpers = calloc(SPLIT_MAX_HELPERS, sizeof(local_helper_t));
+  }
+
+  do
+  {
+    /* Check for lent threads between batches, as workers run out of archives */
+    size_t next = __atomic_load_n(&split.next, __ATOMIC_RELAXED);
+    size_t batches_left = next < num_entries ? (num_entries - next - 1) / LOCAL_BATCH_ENTRIES : 0;
+    size_t wanted = SPLIT_MAX_HELPERS - num_helpers < batches_left ? SPLIT_MAX_HELPERS - num_helpers : batches_left;
+    for (unsigned taken = helpers && wanted ? borrow_threads(split.idle_threads, (unsigned)wanted) : 0; taken; taken--)
+    {
+      local_helper_t *helper = &helpers[num_helpers];
+      *helper = (local_helper_t){.split = &split, .ctx = {.opts = ctx->opts, .shared_records = ctx->shared_records,
+                                                          .num_shared_records = ctx->num_shared_records}};
+      /* A helper never waits for memory; it just isn't started without it */
+      if (split.budget && !budget_try_acquire(split.budget, split.helper_need))
+      {
+        __atomic_add_fetch(split.idle_threads, taken, __ATOMIC_RELAXED);
+        break;
+      }
+      if ((helper->ctx.io = io_engine_clone(ctx->io)) == NULL ||
+          pthread_create(&helper->thread, NULL, local_helper, helper) != 0)
+      {
+        io_engine_close(helper->ctx.io);
+        if (split.budget)
+        {
+          budget_release(split.budget, split.helper_need);
+        }
+        __atomic_add_fetch(split.idle_threads, taken, __ATOMIC_RELAXED);
+        break;
+      }
+      num_helpers++;
+    }
+  } while (strip_local_batch(&split, ctx));
+
+  for (size_t i = 0; i < num_helpers; i++)
+  {
+    pthread_join(helpers[i].thread, NULL);
+    stats_merge(&ctx->stats, &helpers[i].ctx.stats);
+    scratch_free(&helpers[i].ctx.scratch);
+    io_engine_close(helpers[i].ctx.io);
+    if (split.budget)
+    {
+      budget_release(split.budget, split.helper_need);
+    }
+  }
+  free(helpers);
+  return split.failed ? -1 : 0;
+}
+
+
+/**
+ * The attributes of an entry with its permissions reduced to 0644, or 0755
+ * for directories and anything executable, and the other DOS attributes
+ * dropped.
+ */
+static uint32_t normalized_attributes(const cd_entry_t *entry)
+{
+  uint32_t attr = ZIP_GET(entry->header, external_attr);
+  bool dir = (attr & MSDOS_DIR_ATTR) || (entry->name.len && entry->name.ptr[entry->name.len - 1] == '/');
+  uint32_t normalized = dir ? MSDOS_DIR_ATTR : 0;
+  if ((ZIP_GET(entry->header, version_made_by) >> 8) == HOST_UNIX)
+  {
+    uint32_t mode = attr >> 16;
+    uint32_t perms = dir || (mode & 0111) ? 0755 : 0644;
+    normalized |= ((mode & S_IFMT) | perms) << 16;
+  }
+  return normalized;
+}
+
+
+/**
+ * Whether purifying would leave the central directory entry \a entry as it
+ * is: its time is cleared, its attributes are normalized if its policy asks
+ * for that, and it has no extra fields but placeholders and alignment,
+ * unless its policy keeps them.
+ */
+static bool entry_is_pure(const cd_entry_t *entry, const strip_options_t *opts)
+{
+  if (ZIP_GET(entry->header, last_mod_date) || ZIP_GET(entry->header, last_mod_time))
+  {
+    return false;
+  }
+  unsigned actions = opts->policy ? policy_match(opts->policy, entry->name.ptr, entry->name.len) : 0;
+  if ((actions & POLICY_NORMALIZE) && ZIP_GET(entry->header, external_attr) != normalized_attributes(entry))
+  {
+    return false;
+  }
+  if (actions & POLICY_KEEP_EXTRA)
+  {
+    return true;
+  }
+  for (size_t pos = 0; pos < entry->extra.len; )
+  {
+    if (entry->extra.len - pos < sizeof(extra_header_t))
+    {
+      return false;
+    }
+    const extra_header_t *hdr = (const extra_header_t *)(entry->extra.ptr + pos);
+    uint16_t id = ZIP_GET(hdr, id);
+    /* Compacting removes the placeholders */
+    if (id != ALIGNMENT_EXTRA_HEADER && (id != STRIPZIP_OPTION_HEADER || opts->compact))
+    {
+      return false;
+    }
+    pos += sizeof(extra_header_t) + ZIP_GET(hdr, length);
+  }
+  return true;
+}
+
+
+/**
+ * Whether purifying the archive open on \a fd would leave it as it is,
+ * which is when every central directory entry is pure already. The local
+ * headers are purified before the central directory is written back, so
+ * they needn't be read. Split archives are never taken to be purified. The
+ * directory is read a chunk at a time, as this happens before any memory is
+ * reserved for the archive.
+ *
+ * @return 1 if it is purified already, 0 if not, -1 on failure.
+ */
+static int strip_is_pure(int fd, strip_ctx_t *ctx)
+{
+  archive_t archive;
+  if (archive_last_disk(fd, &ctx->stats) != 0)
+  {
+    return 0;
+  }
+  ERR_RET_IF_NEQ(archive_locate(fd, &archive, &ctx->stats), 0, -1);
+
+  uint64_t cd_pos = 0;
+  for (size_t done = 0; done < archive.num_entries; )
+  {
+    scratch_reset(&ctx->scratch);
+    char *cd;
+    cd_entry_t *entries;
+    size_t count;
+    size_t len;
+    ERR_RET_IF_NEQ(archive_read_cd_chunk(&archive, cd_pos, CD_CHUNK_BYTES, archive.num_entries - done,
+                                         &ctx->scratch, &ctx->stats, &cd, &entries, &count, &len), 0, -1);
+    for (size_t i = 0; i < count; i++)
+    {
+      if (!entry_is_pure(&entries[i], ctx->opts))
+      {
+        return 0;
+      }
+    }
+    cd_pos += len;
+    done += count;
+  }
+  return 1;
+}
+
+
+/**
+ * Purify the \a count central directory entries read into \a cd, \a cd_pos
+ * bytes into the central directory, and their local headers. Then write
+ * the \a len bytes back. \a first is the index of the first entry.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int strip_cd_run(const archive_t *archive, char *cd, cd_entry_t *entries, size_t count, size_t len,
+                        size_t first, uint64_t cd_pos, uint64_t phase_start, strip_ctx_t *ctx)
+{
+  stats_t *stats = &ctx->stats;
+  unsigned *actions = NULL;
+  if (ctx->opts->policy)
+  {
+    ERR_RET_IF_NOT(actions = scratch_alloc(&ctx->scratch, count * sizeof(unsigned)), -1);
+  }
+
+  /* For each entry in the central directory; purify it! */
+  for (size_t dir_entry = 0; dir_entry < count; dir_entry++)
+  {
+    cd_entry_t *entry = &entries[dir_entry];
+    central_directory_header_t *cd_header = entry->header;
+    stats->entries++;
+
+    if (!ctx->opts->quiet)
+    {
+      printf("Now purifying entry %lu / %zu (offset 0x%08lx) %.*s\n", first + dir_entry + 1, archive->num_entries,
+             archive->cd_offset + cd_pos + ((char *)cd_header - cd), (int)entry->name.len, entry->name.ptr);
+    }
+
+    if ((ZIP_GET(cd_header, gp_bits) & GP_BIT_ENC_MARKERS) != 0x0)
+    {
+      printf("Entry encrypted, I don't know how to deal with that.\n");
+      return -1;
+    }
+    if ((ZIP_GET(cd_header, gp_bits) & GP_BIT_UNKNOWN_FLAG_MASK) != 0)
+    {
+      printf("Entry has strange general purpose bits: %u\n", ZIP_GET(cd_header, gp_bits));
+      return -1;
+    }
+
+    // Purify time / date of CD header
+    ZIP_SET(cd_header, last_mod_date, 0);
+    ZIP_SET(cd_header, last_mod_time, 0);
+
+    unsigned entry_actions = 0;
+    if (actions)
+    {
+      entry_actions = actions[dir_entry] = policy_match(ctx->opts->policy, entry->name.ptr, entry->name.len);
+    }
+    if (entry_actions & POLICY_NORMALIZE)
+    {
+      ZIP_SET(cd_header, external_attr, normalized_attributes(entry));
+    }
+
+    // Purify the extra data
+    if (entry->extra.len && !(entry_actions & POLICY_KEEP_EXTRA))
+    {
+      ERR_RET_IF_NOT(purify_extra_data(entry->extra.len, entry->extra.ptr, stats), -1);
+    }
+  }
+  stats_phase_end(stats, PHASE_CD_WALK, phase_start);
+
+  // Now deal with the local headers
+  phase_start = stats_now();
+  if (!ctx->opts->cd_only)
+  {
+    ERR_RET_IF_NEQ(strip_all_local_headers(archive, entries, actions, count, ctx), 0, -1);
+  }
+  stats_phase_end(stats, PHASE_LOCAL, phase_start);
+
+  /* Put the purified entries back in one go */
+  io_op_t op = {.fd = archive->fd, .write = true, .offset = archive->cd_offset + cd_pos, .buf = cd, .len = len};
+  if (ctx->journal)
+  {
+    ERR_RET_IF_NEQ(journal_record(ctx->journal, &op, 1, stats), 0, -1);
+  }
+  ERR_RET_IF_NEQ(archive_submit(archive, ctx->io, &op, 1, stats), 0, -1);
+  return 0;
+}
+
+
+/**
+ * Purify the central directory of \a archive, \a chunk_len bytes of it at a
+ * time, and the local headers of each chunk's entries.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int strip_cd(const archive_t *archive, size_t chunk_len, strip_ctx_t *ctx)
+{
+  uint64_t cd_pos = 0;
+  for (size_t done = 0; done < archive->num_entries; )
+  {
+    uint64_t phase_start = stats_now();
+    scratch_reset(&ctx->scratch);
+    char *cd;
+    cd_entry_t *entries;
+    size_t count;
+    size_t len;
+    ERR_RET_IF_NEQ(archive_read_cd_chunk(archive, cd_pos, chunk_len, archive->num_entries - done, &ctx->scratch,
+                                         &ctx->stats, &cd, &entries, &count, &len), 0, -1);
+    ERR_RET_IF_NEQ(strip_cd_run(archive, cd, entries, count, len, done, cd_pos, phase_start, ctx), 0, -1);
+    cd_pos += len;
+    done += count;
+  }
+  return 0;
+}
+
+
+/**
+ * Memory taken by purifying \a archive with \a cd_len bytes of its central
+ * directory read at once: those bytes, their entries parsed, and a batch of
+ * local headers. Local names and extra fields are taken to be as long as
+ * those in the central directory.
+ */
+static uint64_t strip_memory_need(const archive_t *archive, uint64_t cd_len)
+{
+  uint64_t entries = cd_len / sizeof(central_directory_header_t);
+  entries = entries < archive->num_entries ? entries : archive->num_entries;
+  return cd_len + entries * (sizeof(cd_entry_t) + sizeof(unsigned)) + local_batch_need(archive);
+}
+
+
+static int compare_offset(const void *a, const void *b)
+{
+  uint64_t offset_a = *(const uint64_t *)a;
+  uint64_t offset_b = *(const uint64_t *)b;
+  return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+
+/**
+ * Find the local records of \a archive that several central directory
+ * entries point at, for check_local_header(). The directory is walked a
+ * chunk at a time for their offsets, which are then sorted.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int find_shared_records(const archive_t *archive, strip_ctx_t *ctx)
+{
+  uint64_t *offsets;
+  ERR_RET_IF_NOT(offsets = malloc((archive->num_entries + 1) * sizeof(uint64_t)), -1);
+  uint64_t cd_pos = 0;
+  for (size_t done = 0; done < archive->num_entries; )
+  {
+    scratch_reset(&ctx->scratch);
+    char *cd;
+    cd_entry_t *entries;
+    size_t count;
+    size_t len;
+    if (archive_read_cd_chunk(archive, cd_pos, CD_CHUNK_BYTES, archive->num_entries - done, &ctx->scratch,
+                              &ctx->stats, &cd, &entries, &count, &len) != 0)
+    {
+      free(offsets);
+      return -1;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+      offsets[done + i] = entries[i].local_offset;
+    }
+    cd_pos += len;
+    done += count;
+  }
+
+  /* Each shared offset takes at least two slots, so the writes stay behind
+   * the reads */
+  qsort(offsets, archive->num_entries, sizeof(uint64_t), compare_offset);
+  size_t num_shared = 0;
+  for (size_t i = 1; i < archive->num_entries; i++)
+  {
+    if (offsets[i] == offsets[i - 1] && (num_shared == 0 || offsets[num_shared - 1] != offsets[i]))
+    {
+      offsets[num_shared++] = offsets[i];
+    }
+  }
+  ctx->shared_records = offsets;
+  ctx->num_shared_records = num_shared;
+  return 0;
+}
+
+
+/**
+ * Purify the archive found by archive_locate() or archive_locate_split().
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int strip_located(const archive_t *archive, strip_ctx_t *ctx)
+{
+  if (archive->sig_block_len)
+  {
+    switch (ctx->opts->signed_policy)
+    {
+      case SIGNED_REFUSE:
+        printf("APK signing block found; stripping would invalidate its v2/v3 signatures.\n"
+               "Strip before signing, or use --signed=strip or --signed=skip.\n");
+        return -1;
+
+      case SIGNED_SKIP:
+        printf("APK signing block found; leaving the archive untouched.\n");
+        return 0;
+
+      case SIGNED_STRIP:
+        /* The block itself is opaque to us and is never modified */
+        break;
+    }
+  }
+
+  /* Pull in the whole central directory with one read; names, comments and
+   * extra fields are then used in place rather than copied out. When that
+   * wouldn't fit the memory budget, walk it a chunk at a time instead. */
+  const strip_options_t *opts = ctx->opts;
+  size_t chunk_len = (size_t)archive->cd_len;
+  uint64_t reserved = 0;
+  if (opts->budget)
+  {
+    uint64_t limit = budget_limit(opts->budget);
+    uint64_t need = strip_memory_need(archive, archive->cd_len);
+    if (opts->compact)
+    {
+      /* Compaction reads the whole central directory regardless */
+      uint64_t compact_need = compact_memory_need(archive);
+      need = need > compact_need ? need : compact_need;
+    }
+    else if (need > limit)
+    {
+      chunk_len = strip_memory_need(archive, CD_CHUNK_BYTES) <= limit ? CD_CHUNK_BYTES : CD_CHUNK_MIN;
+      need = strip_memory_need(archive, chunk_len);
+    }
+    if (opts->check != CHECK_OFF)
+    {
+      need += archive->num_entries * sizeof(uint64_t);
+    }
+    reserved = budget_acquire(opts->budget, need);
+  }
+
+  int ret = opts->check != CHECK_OFF ? find_shared_records(archive, ctx) : 0;
+  if (ret == 0)
+  {
+    ret = strip_cd(archive, chunk_len, ctx);
+  }
+  free((void *)(uintptr_t)ctx->shared_records);
+  ctx->shared_records = NULL;
+  ctx->num_shared_records = 0;
+  if (ret == 0 && opts->compact)
+  {
+    ret = compact_archive(archive->fd, ctx);
+  }
+  if (opts->budget)
+  {
+    budget_release(opts->budget, reserved);
+    scratch_trim(&ctx->scratch, STRIP_SCRATCH_KEEP);
+  }
+  return ret;
+}
+
+
+/**
+ * Purify a single ZIP archive in place.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int strip_archive(int fd, strip_ctx_t *ctx)
+{
+  stats_t *stats = &ctx->stats;
+  stats->archives++;
+
+  /* Get the EO CenDir header */
+  uint64_t phase_start = stats_now();
+  archive_t archive;
+  int ret = archive_locate(fd, &archive, stats);
+  stats_phase_end(stats, PHASE_EOCD, phase_start);
+  ERR_RET_IF_NEQ(ret, 0, -1);
+  return strip_located(&archive, ctx);
+}
+
+
+/**
+ * Purify the split archive whose last segment is \a path, open on \a fd, in
+ * place. The local headers of every segment go to the I/O engine together,
+ * batch by batch, so they are patched in parallel.
+ */
+static int strip_split(const char *path, int fd, uint32_t last_disk, strip_ctx_t *ctx)
+{
+  const strip_options_t *opts = ctx->opts;
+  if (opts->write_mode != WRITE_IN_PLACE || opts->compact || rewrite_wanted(opts))
+  {
+    printf("%s: split archives can only be purified in place, without --compact, --align or --store-below\n",
+           path);
+    return -1;
+  }
+  stats_t *stats = &ctx->stats;
+  stats->archives++;
+
+  uint64_t phase_start = stats_now();
+  volume_set_t volumes;
+  archive_t archive;
+  ERR_RET_IF_NEQ(volume_open(path, fd, last_disk, &volumes), 0, -1);
+  int ret = archive_locate_split(&volumes, &archive, stats);
+  stats_phase_end(stats, PHASE_EOCD, phase_start);
+  if (ret == 0)
+  {
+    ret = strip_located(&archive, ctx);
+  }
+  if (ret == 0 && opts->sync != SYNC_NONE && !opts->defer_sync)
+  {
+    stats->syncs++;
+    ret = volume_sync(&volumes, opts->sync == SYNC_DATA);
+  }
+  volume_close(&volumes);
+  return ret;
+}
+
+
+/** Purify the archive open on \a fd, going through the cache if there is one. */
+static int strip_cached(int fd, strip_ctx_t *ctx)
+{
+  cache_t *cache = ctx->opts->cache;
+  /* Checking reads the local headers, which the key doesn't cover, so a hit
+   * could pass an archive that would fail */
+  if (cache == NULL || ctx->opts->check != CHECK_OFF)
+  {
+    return strip_archive(fd, ctx);
+  }
+
+  uint64_t key;
+  ERR_RET_IF_NEQ(cache_key(cache, fd, &ctx->scratch, &ctx->stats, &key), 0, -1);
+  /* Serving a hit rewrites the whole file, which the journal can't undo */
+  if (ctx->journal == NULL)
+  {
+    int hit = cache_fetch(cache, key, fd, &ctx->stats);
+    if (hit != 0)
+    {
+      return hit == 1 ? 0 : -1;
+    }
+  }
+
+  int ret = strip_archive(fd, ctx);
+  if (ret == 0)
+  {
+    cache_store(cache, key, fd, &ctx->stats);
+  }
+  return ret;
+}
+
+
+int atomic_begin(const char *path, int fd, char **tmp_path)
+{
+  struct stat st;
+  ERR_RET_ON_ERRNO(fstat(fd, &st), -1);
+  int tmp = io_create_beside(path, fd, tmp_path);
+  if (tmp >= 0 && io_copy_file(tmp, fd, (uint64_t)st.st_size) != 0)
+  {
+    io_replace(path, tmp, *tmp_path, -1);
+    *tmp_path = NULL;
+    return -1;
+  }
+  return tmp;
+}
+
+
+int strip_file(const char *path, strip_ctx_t *ctx)
+{
+  int fd;
+  if (ctx->opts->skip_pure)
+  {
+    /* Read only: closing a file opened for writing counts as changing it
+     * to inotify, even when nothing was written */
+    ERR_RET_ON_ERRNO(fd = open(path, O_RDONLY), -1);
+    int pure = strip_is_pure(fd, ctx);
+    close(fd);
+    if (pure < 0)
+    {
+      return -1;
+    }
+    if (pure)
+    {
+      ctx->stats.already_pure++;
+      return rewrite_wanted(ctx->opts) ? rewrite_file(path, ctx) : 0;
+    }
+  }
+
+  ERR_RET_ON_ERRNO(fd = open(path, O_RDWR), -1);
+
+  /* The cache and the other write modes work on whole files, not segments */
+  uint32_t last_disk = archive_last_disk(fd, &ctx->stats);
+  if (last_disk != 0)
+  {
+    int ret = strip_split(path, fd, last_disk, ctx);
+    close(fd);
+    return ret;
+  }
+
+  char *tmp_path = NULL;
+  int work_fd = fd;
+  if (ctx->opts->write_mode == WRITE_ATOMIC && (work_fd = atomic_begin(path, fd, &tmp_path)) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  if (ctx->opts->write_mode == WRITE_JOURNAL && (ctx->journal = journal_begin(path, fd, &ctx->stats)) == NULL)
+  {
+    close(fd);
+    return -1;
+  }
+
+  int ret = strip_cached(work_fd, ctx);
+
+  /* The atomic and journaled modes sync whatever they need themselves */
+  if (ret == 0 && ctx->opts->write_mode == WRITE_IN_PLACE && ctx->opts->sync != SYNC_NONE && !ctx->opts->defer_sync)
+  {
+    ctx->stats.syncs++;
+    ERR_IF_NEQ(ret = ctx->opts->sync == SYNC_FULL ? fsync(fd) : fdatasync(fd), 0);
+  }
+
+  if (tmp_path)
+  {
+    ret = io_replace(path, work_fd, tmp_path, ret);
+  }
+  if (ctx->journal)
+  {
+    /* Never leave a failed archive half purified */
+    ret = ret == 0 ? journal_commit(ctx->journal) : (journal_rollback(ctx->journal, &ctx->stats), -1);
+    ctx->journal = NULL;
+  }
+  close(fd);
+
+  /* Aligning and storing move entries, so they rewrite the purified archive */
+  if (ret == 0 && rewrite_wanted(ctx->opts))
+  {
+    ret = rewrite_file(path, ctx);
+  }
+  return ret;
+}
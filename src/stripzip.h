@@ -0,0 +1,135 @@
+/**
+ * @file
+ * StripZIP sanitizer core.
+ *
+ * Everything needed to purify an archive lives behind this interface so that
+ * it can be embedded in other programs. The core keeps no large buffers on the
+ * stack; per-entry memory comes from a caller owned scratch arena, so it is
+ * safe to run on small-stack worker threads and coroutines.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_STRIPZIP_H
+#define STRIPZIP_STRIPZIP_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "scratch.h"
+#include "io.h"
+#include "zip_format.h"
+#include "archive.h"
+#include "policy.h"
+#include "cache.h"
+#include "journal.h"
+#include "budget.h"
+
+/**
+ * Take either a central directory or local file extra data field and for the
+ * things we know are horrible; purify it!
+ *
+ * @return False if an extra header that we don't understand was found.
+ */
+bool purify_extra_data(size_t len, void* extra_data, stats_t *stats);
+
+/** What to do with archives carrying an APK signing block */
+typedef enum
+{
+  SIGNED_REFUSE = 0,  /**< Fail; stripping would invalidate the signature */
+  SIGNED_SKIP,        /**< Leave the archive untouched and carry on */
+  SIGNED_STRIP,       /**< Strip anyway; the archive must be re-signed */
+} signed_policy_t;
+
+/** Cross-checking of local headers against the central directory */
+typedef enum
+{
+  CHECK_OFF = 0,
+  CHECK_REPORT,       /**< Report fields that disagree */
+  CHECK_FIX,          /**< Report them and make the local header match */
+} check_mode_t;
+
+/** How changes reach the archive */
+typedef enum
+{
+  WRITE_IN_PLACE = 0, /**< Patch the archive directly */
+  WRITE_ATOMIC,       /**< Purify a reflinked copy and rename it into place */
+  WRITE_JOURNAL,      /**< Patch in place, journaling the original bytes */
+} write_mode_t;
+
+/** Durability wanted once an archive has been purified in place */
+typedef enum
+{
+  SYNC_NONE = 0,      /**< Leave it to the kernel */
+  SYNC_DATA,          /**< fdatasync the archive */
+  SYNC_FULL,          /**< fsync the archive, metadata included */
+} sync_mode_t;
+
+typedef struct
+{
+  bool quiet;               /**< Don't list every entry as it is purified */
+  bool cd_only;             /**< Only purify the central directory */
+  signed_policy_t signed_policy;
+  check_mode_t check;
+  const policy_t *policy;   /**< Per-path rules, or NULL to treat every entry alike */
+  cache_t *cache;           /**< Cache of purified archives, or NULL */
+  write_mode_t write_mode;
+  sync_mode_t sync;
+  bool defer_sync;          /**< The caller syncs whole filesystems afterwards */
+  bool compact;             /**< Remove placeholder extra fields after purifying */
+  unsigned align;           /**< Align stored entries' data to this many bytes, 0 or 1 for none */
+  uint64_t store_below;     /**< Store deflated entries that deflating saves fewer bytes on, 0 for none */
+  unsigned store_below_percent; /**< Or less than this percentage of their size, 0 for none */
+  bool skip_pure;           /**< Leave archives that purifying wouldn't change alone */
+  unsigned *idle_threads;   /**< Threads that large archives may borrow, shared and
+                                 updated atomically; NULL for none */
+  budget_t *budget;         /**< Memory shared by the archives purified at once, or NULL */
+} strip_options_t;
+
+/**
+ * Everything one thread needs to purify archives. Contexts may be reused
+ * for any number of archives but by only one thread at a time.
+ */
+typedef struct
+{
+  const strip_options_t *opts;
+  io_engine_t *io;      /**< I/O engine for archive access */
+  scratch_t scratch;    /**< Arena for per-archive and per-entry buffers */
+  stats_t stats;        /**< Counters to accumulate into */
+  journal_t *journal;   /**< Journal of the archive being purified, or NULL */
+  const uint64_t *shared_records; /**< Sorted local offsets that several entries point at,
+                                       found when checking */
+  size_t num_shared_records;
+} strip_ctx_t;
+
+/**
+ * Purify a single ZIP archive in place.
+ *
+ * @param fd The archive, opened for reading and writing.
+ * @param ctx The calling thread's context.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int strip_archive(int fd, strip_ctx_t *ctx);
+
+/**
+ * Create a copy of the archive at \a path, open on \a fd, next to it for
+ * purifying atomically.
+ *
+ * @param tmp_path Set to the copy's path, to be freed by io_replace().
+ * @return The copy, open for reading and writing, or -1 on failure.
+ */
+int atomic_begin(const char *path, int fd, char **tmp_path);
+
+/**
+ * Open \a path and purify it with strip_archive(), or serve it from the
+ * cache if there is one. With opts->skip_pure, an archive whose central
+ * directory is already purified isn't written to at all.
+ */
+int strip_file(const char *path, strip_ctx_t *ctx);
+
+#endif /* STRIPZIP_STRIPZIP_H */
@@ -1,276 +1,871 @@
 /**
  * @file
- * StripZIP
- * Sanitize a ZIP file from all horrible timestamps, UID, and GID nonsense.
- *
- * ZIP specification at https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
- * Additional extended header information available from
- *   ftp://ftp.info-zip.org/pub/infozip/src/zip30.zip ./proginfo/extrafld.txt
+ * StripZIP command line front end.
  *
  * Copyright (c) 2016, Zee.Aero
  * All rights reserved.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
-#include <unistd.h>
 #include <errno.h>
-#include <inttypes.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
 
 #include "err.h"
-
-const uint32_t FILE_HEADER_SIGNATURE = 0x04034b50;
-const uint32_t CENDIR_HEADER_SIGNATURE = 0x02014b50;
-const uint32_t EO_CENDIR_HEADER_SIGNATURE = 0x06054b50;
-
-#define GPB_ENCRYPTION_MASK        (0x1 <<  0)
-#define GPB_METHOD_6_DETAIL        (0x3 <<  1)
-#define GPB_NOT_SEEKABLE           (0x1 <<  3)
-#define GPB_METHOD_8_ENH_DEFLATE   (0x1 <<  4)
-#define GPB_PATCH_DATA             (0x1 <<  5)
-#define GPB_STRONG_ENCRYPTION_MASK (0x1 <<  6)
-#define GPB_UT8_ENCODING           (0x1 << 11)
-#define GPB_CD_ENCRYPTED_MASK      (0x1 << 13)
-const uint16_t GP_BIT_ENC_MARKERS       = GPB_ENCRYPTION_MASK | GPB_STRONG_ENCRYPTION_MASK | GPB_CD_ENCRYPTED_MASK;
-const uint16_t GP_BIT_UNKNOWN_FLAG_MASK = ~(GPB_ENCRYPTION_MASK | GPB_METHOD_6_DETAIL | GPB_NOT_SEEKABLE | GPB_METHOD_8_ENH_DEFLATE |
-                                            GPB_PATCH_DATA | GPB_STRONG_ENCRYPTION_MASK | GPB_UT8_ENCODING | GPB_CD_ENCRYPTED_MASK);
-
-/** Header ID stripzip will use to replace undesired data.
- *  XXX: I hope nothing else uses this header for anything
- */
-#define STRIPZIP_OPTION_HEADER 0xFFFF
-
-typedef struct __attribute__ ((__packed__))
-{
-  uint32_t signature;
-  uint16_t version_needed;
-  uint16_t gp_bits;
-  uint16_t compression_method;
-  uint16_t last_mod_time;
-  uint16_t last_mod_date;
-  uint32_t crc32;
-  uint32_t compressed_size;
-  uint32_t uncompressed_size;
-  uint16_t name_length;
-  uint16_t extra_field_length;
-} local_file_header_t;
-
-typedef struct __attribute__ ((__packed__))
+#include "stats.h"
+#include "scratch.h"
+#include "io.h"
+#include "stripzip.h"
+#include "policy.h"
+#include "cache.h"
+#include "hash.h"
+#include "verify.h"
+#include "recover.h"
+#include "diff.h"
+#include "dedup.h"
+#include "rewrite.h"
+#include "create.h"
+#include "walk.h"
+#include "watch.h"
+
+/** An archive waiting to be worked on */
+typedef struct
 {
-  uint32_t signature;
-  uint16_t version_made_by;
-  uint16_t version_needed;
-  uint16_t gp_bits;
-  uint16_t compression_method;
-  uint16_t last_mod_time;
-  uint16_t last_mod_date;
-  uint32_t crc32;
-  uint32_t compressed_size;
-  uint32_t uncompressed_size;
-  uint16_t file_name_length;
-  uint16_t extra_field_length;
-  uint16_t file_comment_length;
-  uint16_t disk_number_start;
-  uint16_t internal_attr;
-  uint32_t external_attr;
-  uint32_t rel_offset_local_header;
-} central_directory_header_t;
-
-typedef struct __attribute__ ((__packed__))
-{
-  uint32_t signature;
-  uint16_t disk_number;
-  uint16_t disk_num_start_of_cd;
-  uint16_t num_dir_entries_this_disk;
-  uint16_t total_num_entries_cd;
-  uint32_t size_of_cd;
-  uint32_t cd_offset_in_first_disk;
-  uint16_t zip_file_comment_length;
-} end_of_central_directory_header_t;
-
-typedef struct __attribute__ ((__packed__))
-{
-  uint16_t id;
-  uint16_t length;
-} extra_header_t;
-
+  char *path;
+  uint64_t size;
+  size_t seq;           /**< Order of arrival, which breaks ties */
+} batch_job_t;
 
 /**
- * Convenience function to overwrite a section of data with the file seek at
- * the end of the segment, and then set the seek back to the segment end.
+ * The archives shared by all worker threads. The largest waiting archive is
+ * always handed out first, so that big archives don't start last and hold
+ * up the end of the batch. With -r the queue grows while the workers are
+ * busy, as the walk finds more; with --watch it keeps growing until the
+ * watch is stopped.
  */
-void overwrite_field(void* data, size_t len, FILE *fd)
+typedef struct
+{
+  char **paths;         /**< Every archive, for syncing when done; not kept if transient */
+  size_t count;
+  size_t capacity;      /**< Of paths, when they are being found by a walk */
+  batch_job_t *queue;   /**< Archives not handed out yet, a heap with the largest on top */
+  size_t queued;
+  size_t queue_capacity;
+  size_t arrivals;
+  bool closed;          /**< No more archives are coming */
+  bool transient;       /**< Archives are freed once done */
+  pthread_mutex_t queue_lock;
+  pthread_cond_t more;  /**< Signalled when an archive is added or the list closed */
+  unsigned idle_threads; /**< Workers with nothing left to do, lent to large archives; atomic */
+  size_t failures;      /**< Archives that failed; atomic */
+  const strip_options_t *opts;
+  int (*action)(const char *path, strip_ctx_t *ctx);
+  io_engine_kind_t io_kind;
+  unsigned io_depth;
+  stats_t stats;        /**< Combined statistics, under stats_lock */
+  pthread_mutex_t stats_lock;
+} batch_t;
+
+
+/** Whether \a a goes before \a b: larger, or as large and there first. */
+static inline bool batch_job_before(const batch_job_t *a, const batch_job_t *b)
 {
-  fseek(fd, -1 * len, SEEK_CUR);
-  ERR_IF_NEQ(fwrite(data, len, 1, fd), 1u);
+  return a->size > b->size || (a->size == b->size && a->seq < b->seq);
 }
 
 
 /**
- * Take either a central directory or local file extra data field and for the
- * things we know are horrible; purify it!
+ * Queue \a path, which is \a size bytes, with queue_lock held. Doesn't take
+ * \a path.
  *
- * TODO: It would be better if stripzip removed the headers completely so that the
- * ZIP was invariant regardless of what crazy program created it. But that's hard.
+ * @return 0 on success, -1 on failure.
  */
-bool purify_extra_data(size_t len, void* extra_data)
+static int batch_queue(batch_t *batch, char *path, uint64_t size)
 {
-  size_t offset = 0;
-  while (offset < len)
+  if (batch->queued == batch->queue_capacity)
   {
-    extra_header_t *hdr = extra_data + offset;
-    offset += sizeof(extra_header_t);
-
-    switch (hdr->id)
-    {
-      case 0x5455:
-        /* Some sort of extended time data, see
-         * ftp://ftp.info-zip.org/pub/infozip/src/zip30.zip ./proginfo/extrafld.txt
-        .. fallthrough */
-      case 0x7875:
-        /* Unix extra data; UID / GID stuff, see
-         * ftp://ftp.info-zip.org/pub/infozip/src/zip30.zip ./proginfo/extrafld.txt
-         */
-        hdr->id = STRIPZIP_OPTION_HEADER;
-        memset(extra_data + offset, 0xFF, hdr->length);
-        break;
+    size_t capacity = batch->queue_capacity ? 2 * batch->queue_capacity : 256;
+    batch_job_t *queue = realloc(batch->queue, capacity * sizeof(batch_job_t));
+    ERR_RET_IF_NOT(queue, -1);
+    batch->queue = queue;
+    batch->queue_capacity = capacity;
+  }
+  batch_job_t job = {.path = path, .size = size, .seq = batch->arrivals++};
+  size_t pos = batch->queued++;
+  while (pos > 0 && batch_job_before(&job, &batch->queue[(pos - 1) / 2]))
+  {
+    batch->queue[pos] = batch->queue[(pos - 1) / 2];
+    pos = (pos - 1) / 2;
+  }
+  batch->queue[pos] = job;
+  return 0;
+}
 
-      case STRIPZIP_OPTION_HEADER:
-        break;
 
-      default:
-        printf("\tUnknown extra header: 0x%x %u\n", hdr->id, hdr->length);
-        return false;
+/** Take the largest archive waiting, waiting for one if the list is still growing. */
+static char *batch_next(batch_t *batch)
+{
+  char *path = NULL;
+  pthread_mutex_lock(&batch->queue_lock);
+  while (batch->queued == 0 && !batch->closed)
+  {
+    pthread_cond_wait(&batch->more, &batch->queue_lock);
+  }
+  if (batch->queued)
+  {
+    path = batch->queue[0].path;
+    batch_job_t last = batch->queue[--batch->queued];
+    size_t pos = 0;
+    for (size_t child; (child = 2 * pos + 1) < batch->queued; pos = child)
+    {
+      if (child + 1 < batch->queued && batch_job_before(&batch->queue[child + 1], &batch->queue[child]))
+      {
+        child++;
+      }
+      if (!batch_job_before(&batch->queue[child], &last))
+      {
         break;
+      }
+      batch->queue[pos] = batch->queue[child];
     }
-    offset += hdr->length;
+    batch->queue[pos] = last;
   }
+  pthread_mutex_unlock(&batch->queue_lock);
+  return path;
+}
 
-  return true;
+
+/** Size of the file at \a path for scheduling, 0 if it can't be found. */
+static uint64_t batch_size(const char *path)
+{
+  struct stat st;
+  return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
 }
 
 
-int main(int argc, char** argv)
+/** Add an archive found by the walk or watch. Takes \a path. */
+static void batch_add(char *path, void *arg)
 {
-  if (argc != 2)
+  batch_t *batch = arg;
+  uint64_t size = batch_size(path);
+  pthread_mutex_lock(&batch->queue_lock);
+  if (!batch->transient && batch->count == batch->capacity)
   {
-    printf("Usage: stripzip <in.zip>\n");
-    return -1;
+    size_t capacity = batch->capacity ? 2 * batch->capacity : 256;
+    char **paths = realloc(batch->paths, capacity * sizeof(char *));
+    if (paths != NULL)
+    {
+      batch->paths = paths;
+      batch->capacity = capacity;
+    }
+  }
+  if ((!batch->transient && batch->count == batch->capacity) || batch_queue(batch, path, size) != 0)
+  {
+    pthread_mutex_unlock(&batch->queue_lock);
+    printf("Out of memory; not purifying %s\n", path);
+    __atomic_add_fetch(&batch->failures, 1, __ATOMIC_RELAXED);
+    free(path);
+    return;
+  }
+  if (!batch->transient)
+  {
+    batch->paths[batch->count++] = path;
   }
+  pthread_cond_signal(&batch->more);
+  pthread_mutex_unlock(&batch->queue_lock);
+}
+
+
+/** Arguments for the thread walking or watching the trees given with -r or --watch */
+typedef struct
+{
+  batch_t *batch;
+  char **roots;
+  size_t count;
+  unsigned threads;
+  bool watch;
+  unsigned debounce_ms;
+  int stop_fd;          /**< Stops the watch when readable */
+} batch_walk_t;
 
-  FILE *zf = NULL;
-  ERR_RET_IF_NOT(zf = fopen(argv[1], "r+"), -1);
 
-  /* Get the EO CenDir header */
-  ERR_RET_ON_ERRNO(fseek(zf, -1 * sizeof(end_of_central_directory_header_t), SEEK_END), -1);
-  end_of_central_directory_header_t eocd_header;
-  ERR_RET_IF_NEQ(fread(&eocd_header, sizeof(eocd_header), 1, zf), 1u, -1);
-  if (eocd_header.signature != EO_CENDIR_HEADER_SIGNATURE)
+static void *batch_walker(void *arg)
+{
+  batch_walk_t *walk = arg;
+  batch_t *batch = walk->batch;
+  int ret = walk->watch ? watch_trees(walk->roots, walk->count, walk->debounce_ms, walk->stop_fd, batch_add, batch)
+                        : walk_trees(walk->roots, walk->count, walk->threads, batch_add, batch);
+  if (ret != 0)
   {
-    printf("Did not get a good end of directory header! There might be a ZIP file comment?\n");
-    return -1;
+    __atomic_add_fetch(&batch->failures, 1, __ATOMIC_RELAXED);
   }
-  if (eocd_header.disk_number != 0)
+  pthread_mutex_lock(&batch->queue_lock);
+  batch->closed = true;
+  pthread_cond_broadcast(&batch->more);
+  pthread_mutex_unlock(&batch->queue_lock);
+  return NULL;
+}
+
+
+void *batch_worker(void *arg)
+{
+  batch_t *batch = arg;
+  strip_ctx_t ctx = {.opts = batch->opts};
+  if ((ctx.io = io_engine_open(batch->io_kind, batch->io_depth)) == NULL)
   {
-    printf("Split archive! This tool doesn't deal with those!\n");
-    return -1;
+    printf("Could not create an I/O engine!\n");
+    __atomic_add_fetch(&batch->failures, 1, __ATOMIC_RELAXED);
+    return NULL;
   }
-  if (eocd_header.size_of_cd == 0xFFFFFFFF)
+
+  char *path;
+  while ((path = batch_next(batch)) != NULL)
   {
-    printf("This is a Zip64 file; and I don't know how to deal with those!\n");
-    return -1;
+    if (batch->action(path, &ctx) != 0)
+    {
+      printf("Failed to %s %s\n", batch->action == verify_file ? "verify" :
+                                   batch->action == recover_file ? "recover" :
+                                   batch->action == dedup_file ? "deduplicate" : "purify", path);
+      __atomic_add_fetch(&batch->failures, 1, __ATOMIC_RELAXED);
+    }
+    if (batch->transient)
+    {
+      free(path);
+    }
   }
+  /* Lend this thread to the archives still being purified */
+  __atomic_add_fetch(&batch->idle_threads, 1, __ATOMIC_RELAXED);
 
-  /* For each entry in the central directory; purify it! */
-  char local_filename[UINT16_MAX];
-  char local_filecomment[UINT16_MAX];
-  char local_extra[UINT16_MAX];
-  fseek(zf, eocd_header.cd_offset_in_first_disk, SEEK_SET);
-  for (size_t dir_entry = 0; dir_entry < eocd_header.total_num_entries_cd; dir_entry++)
-  {
-    printf("Now purifying entry %lu / %u (offset 0x08%lx) ", dir_entry + 1, eocd_header.total_num_entries_cd, ftell(zf));
+  pthread_mutex_lock(&batch->stats_lock);
+  stats_merge(&batch->stats, &ctx.stats);
+  pthread_mutex_unlock(&batch->stats_lock);
+
+  scratch_free(&ctx.scratch);
+  io_engine_close(ctx.io);
+  return NULL;
+}
 
-    central_directory_header_t cd_header = {0};
-    ERR_RET_IF_NEQ(fread(&cd_header, sizeof(cd_header), 1, zf), 1u, -1);
+
+/** Sync each distinct filesystem holding one of the \a count \a paths once. */
+static int sync_filesystems(char **paths, size_t count, stats_t *stats)
+{
+  dev_t *synced;
+  size_t num_synced = 0;
+  ERR_RET_IF_NOT(synced = calloc(count, sizeof(dev_t)), -1);
+  int ret = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    struct stat st;
+    if (stat(paths[i], &st) != 0)
+    {
+      continue;
+    }
+    size_t j;
+    for (j = 0; j < num_synced && synced[j] != st.st_dev; j++)
+    {
+    }
+    if (j == num_synced)
     {
-      if (cd_header.signature != CENDIR_HEADER_SIGNATURE)
+      synced[num_synced++] = st.st_dev;
+      stats->syncs++;
+      if (io_sync_filesystem(paths[i]) != 0)
       {
-        printf("File corrupted! Central directory signature bad (0x%x).\n", cd_header.signature);
-        return -1;
+        ret = -1;
       }
+    }
+  }
+  free(synced);
+  return ret;
+}
+
+
+/**
+ * Parse \a arg as a whole number from 1 to \a max.
+ *
+ * @return The number, or 0 if \a arg is anything else.
+ */
+static unsigned long parse_count(const char *arg, unsigned long max)
+{
+  if (!isdigit((unsigned char)*arg))
+  {
+    return 0;
+  }
+  char *end;
+  errno = 0;
+  unsigned long n = strtoul(arg, &end, 10);
+  return errno || *end || n > max ? 0 : n;
+}
+
+
+void usage(void)
+{
+  printf("Usage: stripzip [options] <in.zip>...\n");
+  printf("       stripzip [options] -r <dir>...\n");
+  printf("       stripzip [options] --watch <dir>...\n");
+  printf("       stripzip --diff <a.zip> <b.zip>\n");
+  printf("       stripzip [-j <n>] [-v] create <out.zip> <dir>\n");
+  printf("Options:\n");
+  printf("  -j, --jobs=<n>             Purify up to <n> archives at once (default 1)\n");
+  printf("  --io=auto|pread|uring      I/O engine to use (default auto)\n");
+  printf("  --io-depth=<n>             Operations in flight per io_uring worker (default %u)\n", IO_DEFAULT_DEPTH);
+  printf("  -r, --recursive            Find the archives to work on under the given\n");
+  printf("                             directories, whatever their names\n");
+  printf("  --watch                    Purify archives as they are written under the given\n");
+  printf("                             directories, until interrupted\n");
+  printf("  --debounce=<ms>            Wait until a watched archive has been left alone this\n");
+  printf("                             long (default %u)\n", WATCH_DEFAULT_DEBOUNCE_MS);
+  printf("  -q, --quiet                Don't list every entry\n");
+  printf("  -v, --verbose              List every entry create writes\n");
+  printf("  --verify                   Check the archives' structure instead of purifying\n");
+  printf("  --diff                     Compare two archives, ignoring what stripping removes\n");
+  printf("  --recover                  Rebuild a damaged central directory from local headers\n");
+  printf("  --dedup                    Report entries storing the same data\n");
+  printf("  --check[=report|fix]       Cross-check local headers against the central\n");
+  printf("                             directory, optionally making them agree\n");
+  printf("  --policy=<file>            Per-path rules (keep-extra, keep-mode, normalize)\n");
+  printf("  --cache=<dir>              Reuse results for archives purified before\n");
+  printf("  --cache-size=<n>[K|M|G]    Evict least recently used results beyond this (default 1G)\n");
+  printf("  --max-mem=<n>[K|M|G]       Hold the archives purified at once to about this much\n");
+  printf("                             memory, waiting or walking large ones in chunks\n");
+  printf("  --compact                  Remove the placeholders left by purifying, shrinking\n");
+  printf("                             the archive in place\n");
+  printf("  --align=<n>                Align the data of stored entries to <n> bytes, a\n");
+  printf("                             power of two up to %u, as zipalign does, rewriting\n", ALIGN_MAX);
+  printf("                             the archive if needed\n");
+  printf("  --store-below=<n>[%%]       Store deflated entries that deflating saves fewer\n");
+  printf("                             than <n> bytes, or <n>%% of their size, on\n");
+  printf("  --atomic                   Purify a copy and rename it over the original\n");
+  printf("  --journal                  Purify in place, journaling the original bytes so an\n");
+  printf("                             interrupted run is rolled back on the next one\n");
+  printf("  --sync=none|data|full      How durably to write each archive (default none)\n");
+  printf("  --cd-only                  Only purify the central directory, not local headers\n");
+  printf("  --signed=refuse|skip|strip What to do with APKs that have a signing block\n");
+  printf("                             (default refuse)\n");
+  printf("  --stats[=text|prometheus]  Print timing and I/O statistics when done\n");
+  printf("  --stats-file=<path>        Write statistics to <path> instead of stdout\n");
+}
+
+
+int main(int argc, char** argv)
+{
+  stats_format_t stats_format = STATS_FORMAT_NONE;
+  const char *stats_path = NULL;
+  strip_options_t opts = {0};
+  batch_t batch = {.opts = &opts, .action = strip_file, .io_kind = IO_ENGINE_AUTO, .io_depth = IO_DEFAULT_DEPTH};
+  unsigned long jobs = 1;
+  policy_t *policy = NULL;
+  bool diff = false;
+  bool recursive = false;
+  bool watch = false;
+  unsigned debounce_ms = WATCH_DEFAULT_DEBOUNCE_MS;
+  const char *cache_dir = NULL;
+  uint64_t cache_size = CACHE_DEFAULT_MAX_BYTES;
+  uint64_t max_mem = 0;
+  bool verbose = false;
+
+  static const struct option long_options[] = {
+    {"jobs",       required_argument, NULL, 'j'},
+    {"io",         required_argument, NULL, 'I'},
+    {"io-depth",   required_argument, NULL, 'D'},
+    {"recursive",  no_argument,       NULL, 'r'},
+    {"watch",      no_argument,       NULL, 'W'},
+    {"debounce",   required_argument, NULL, 'E'},
+    {"quiet",      no_argument,       NULL, 'q'},
+    {"verbose",    no_argument,       NULL, 'v'},
+    {"verify",     no_argument,       NULL, 'V'},
+    {"recover",    no_argument,       NULL, 'R'},
+    {"diff",       no_argument,       NULL, 'F'},
+    {"dedup",      optional_argument, NULL, 'U'},
+    {"check",      optional_argument, NULL, 'K'},
+    {"policy",     required_argument, NULL, 'P'},
+    {"cache",      required_argument, NULL, 'A'},
+    {"cache-size", required_argument, NULL, 'Z'},
+    {"max-mem",    required_argument, NULL, 'X'},
+    {"compact",    no_argument,       NULL, 'M'},
+    {"align",      required_argument, NULL, 'L'},
+    {"store-below", required_argument, NULL, 'B'},
+    {"atomic",     no_argument,       NULL, 'T'},
+    {"journal",    no_argument,       NULL, 'J'},
+    {"sync",       required_argument, NULL, 'Y'},
+    {"cd-only",    no_argument,       NULL, 'C'},
+    {"signed",     required_argument, NULL, 'G'},
+    {"stats",      optional_argument, NULL, 's'},
+    {"stats-file", required_argument, NULL, 'S'},
+    {"help",       no_argument,       NULL, 'h'},
+    {0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "j:rqvh", long_options, NULL)) != -1)
+  {
+    switch (opt)
+    {
+      case 'j':
+        jobs = parse_count(optarg, UINT_MAX);
+        if (jobs == 0)
+        {
+          printf("Need at least one job!\n");
+          return -1;
+        }
+        break;
+
+      case 'I':
+        if (strcmp(optarg, "auto") == 0)
+        {
+          batch.io_kind = IO_ENGINE_AUTO;
+        }
+        else if (strcmp(optarg, "pread") == 0)
+        {
+          batch.io_kind = IO_ENGINE_PREAD;
+        }
+        else if (strcmp(optarg, "uring") == 0)
+        {
+          batch.io_kind = IO_ENGINE_URING;
+        }
+        else
+        {
+          printf("Unknown I/O engine: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'D':
+        batch.io_depth = (unsigned)parse_count(optarg, IO_MAX_DEPTH);
+        if (batch.io_depth == 0)
+        {
+          printf("Bad I/O depth: %s (1 to %u)\n", optarg, IO_MAX_DEPTH);
+          return -1;
+        }
+        break;
+
+      case 'r':
+        recursive = true;
+        break;
+
+      case 'W':
+        watch = true;
+        break;
+
+      case 'E':
+        debounce_ms = (unsigned)parse_count(optarg, WATCH_MAX_DEBOUNCE_MS);
+        if (debounce_ms == 0)
+        {
+          printf("Bad debounce interval: %s (1 to %u ms)\n", optarg, WATCH_MAX_DEBOUNCE_MS);
+          return -1;
+        }
+        break;
+
+      case 'q':
+        opts.quiet = true;
+        break;
+
+      case 'v':
+        verbose = true;
+        break;
+
+      case 'V':
+        batch.action = verify_file;
+        break;
+
+      case 'R':
+        batch.action = recover_file;
+        break;
+
+      case 'F':
+        diff = true;
+        break;
+
+      case 'U':
+        batch.action = dedup_file;
+        if (optarg != NULL && strcmp(optarg, "rewrite") == 0)
+        {
+          /* Entries sharing a local record can't all have their names in it */
+          printf("--dedup=rewrite is gone: unzip and Python's zipfile reject entries sharing a local record\n");
+          return -1;
+        }
+        if (optarg != NULL && strcmp(optarg, "report") != 0)
+        {
+          printf("Unknown dedup mode: %s\n", optarg);
+          return -1;
+        }
+        break;
 
-      if ((cd_header.gp_bits & GP_BIT_ENC_MARKERS) != 0x0)
+      case 'K':
+        if (optarg == NULL || strcmp(optarg, "report") == 0)
+        {
+          opts.check = CHECK_REPORT;
+        }
+        else if (strcmp(optarg, "fix") == 0)
+        {
+          opts.check = CHECK_FIX;
+        }
+        else
+        {
+          printf("Unknown check mode: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'P':
+        policy_free(policy);
+        if ((policy = policy_load(optarg)) == NULL)
+        {
+          return -1;
+        }
+        opts.policy = policy;
+        break;
+
+      case 'A':
+        cache_dir = optarg;
+        break;
+
+      case 'Z':
       {
-        printf("Entry encrypted, I don't know how to deal with that.\n");
-        return -1;
+        char *end;
+        cache_size = strtoull(optarg, &end, 10);
+        switch (*end)
+        {
+          case 'G': cache_size <<= 10; /* fallthrough */
+          case 'M': cache_size <<= 10; /* fallthrough */
+          case 'K': cache_size <<= 10; /* fallthrough */
+          case '\0': break;
+          default:
+            printf("Bad cache size: %s\n", optarg);
+            return -1;
+        }
+        break;
       }
-      if ((cd_header.gp_bits & GP_BIT_UNKNOWN_FLAG_MASK) != 0)
+
+      case 'X':
       {
-        printf("Entry has strange general purpose bits: %u\n", cd_header.gp_bits);
-        return -1;
+        char *end;
+        max_mem = strtoull(optarg, &end, 10);
+        switch (*end)
+        {
+          case 'G': max_mem <<= 10; /* fallthrough */
+          case 'M': max_mem <<= 10; /* fallthrough */
+          case 'K': max_mem <<= 10; /* fallthrough */
+          case '\0': break;
+          default:
+            max_mem = 0;
+        }
+        if (max_mem == 0)
+        {
+          printf("Bad memory limit: %s\n", optarg);
+          return -1;
+        }
+        break;
       }
 
-      // Purify time / date of CD header
-      cd_header.last_mod_date = 0;
-      cd_header.last_mod_time = 0;
-      overwrite_field(&cd_header, sizeof(cd_header), zf);
+      case 'M':
+        opts.compact = true;
+        break;
+
+      case 'L':
+        opts.align = (unsigned)parse_count(optarg, ALIGN_MAX);
+        if (opts.align == 0 || (opts.align & (opts.align - 1)))
+        {
+          printf("Alignment must be a power of two from 1 to %u: %s\n", ALIGN_MAX, optarg);
+          return -1;
+        }
+        break;
 
-      // Get the file name and comment
-      ERR_RET_IF_NEQ(fread(local_filename, cd_header.file_name_length, 1, zf), 1u, -1);
-      if (cd_header.file_comment_length > 0)
+      case 'B':
       {
-        ERR_RET_IF_NEQ(fread(local_filecomment, cd_header.file_comment_length, 1, zf), 1u, -1);
+        char *end;
+        uint64_t threshold = strtoull(optarg, &end, 10);
+        if (strcmp(end, "%") == 0 && threshold > 0 && threshold <= 100)
+        {
+          opts.store_below_percent = (unsigned)threshold;
+        }
+        else if (*end == '\0' && threshold > 0)
+        {
+          opts.store_below = threshold;
+        }
+        else
+        {
+          printf("Bad store threshold: %s\n", optarg);
+          return -1;
+        }
+        break;
       }
-      printf("%.*s\n", cd_header.file_name_length, local_filename);
+
+      case 'T':
+        opts.write_mode = WRITE_ATOMIC;
+        break;
+
+      case 'J':
+        opts.write_mode = WRITE_JOURNAL;
+        break;
+
+      case 'Y':
+        if (strcmp(optarg, "none") == 0)
+        {
+          opts.sync = SYNC_NONE;
+        }
+        else if (strcmp(optarg, "data") == 0)
+        {
+          opts.sync = SYNC_DATA;
+        }
+        else if (strcmp(optarg, "full") == 0)
+        {
+          opts.sync = SYNC_FULL;
+        }
+        else
+        {
+          printf("Unknown sync mode: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'C':
+        opts.cd_only = true;
+        break;
+
+      case 'G':
+        if (strcmp(optarg, "refuse") == 0)
+        {
+          opts.signed_policy = SIGNED_REFUSE;
+        }
+        else if (strcmp(optarg, "skip") == 0)
+        {
+          opts.signed_policy = SIGNED_SKIP;
+        }
+        else if (strcmp(optarg, "strip") == 0)
+        {
+          opts.signed_policy = SIGNED_STRIP;
+        }
+        else
+        {
+          printf("Unknown signed archive policy: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 's':
+        if (optarg == NULL || strcmp(optarg, "text") == 0)
+        {
+          stats_format = STATS_FORMAT_TEXT;
+        }
+        else if (strcmp(optarg, "prometheus") == 0)
+        {
+          stats_format = STATS_FORMAT_PROMETHEUS;
+        }
+        else
+        {
+          printf("Unknown statistics format: %s\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'S':
+        stats_path = optarg;
+        break;
+
+      default:
+        usage();
+        return -1;
     }
+  }
 
-    // Get and purify the extra data
-    if (cd_header.extra_field_length)
+  if (argc - optind < 1)
+  {
+    usage();
+    return -1;
+  }
+  batch.paths = argv + optind;
+  batch.count = (size_t)(argc - optind);
+
+  if (diff)
+  {
+    if (batch.count != 2)
+    {
+      usage();
+      return -1;
+    }
+    /* Like cmp: 0 if the same, 1 if different */
+    strip_ctx_t ctx = {.opts = &opts};
+    ERR_RET_IF_NOT(ctx.io = io_engine_open(batch.io_kind, batch.io_depth), -1);
+    int ret = diff_files(batch.paths[0], batch.paths[1], &ctx);
+    if (stats_format != STATS_FORMAT_NONE)
+    {
+      stats_print(&ctx.stats, stats_format, stdout);
+    }
+    scratch_free(&ctx.scratch);
+    io_engine_close(ctx.io);
+    policy_free(policy);
+    return ret;
+  }
+  if (opts.compact && opts.write_mode == WRITE_JOURNAL)
+  {
+    /* The journal only saves the bytes of patched headers */
+    printf("--compact moves the whole archive and can't be journaled; use --atomic\n");
+    return -1;
+  }
+  if (strcmp(batch.paths[0], "create") == 0)
+  {
+    if (batch.count != 3)
     {
-      ERR_RET_IF_NEQ(fread(local_extra, cd_header.extra_field_length, 1, zf), 1u, -1);
-      ERR_RET_IF_NOT(purify_extra_data(cd_header.extra_field_length, local_extra), -1);
-      overwrite_field(local_extra, cd_header.extra_field_length, zf);
+      usage();
+      return -1;
     }
+    /* Unlike purifying, creating is silent unless asked */
+    opts.quiet = !verbose;
+    strip_ctx_t ctx = {.opts = &opts};
+    int ret = create_archive(batch.paths[1], batch.paths[2], (unsigned)jobs, &ctx);
+    if (stats_format != STATS_FORMAT_NONE)
+    {
+      stats_print(&ctx.stats, stats_format, stdout);
+    }
+    scratch_free(&ctx.scratch);
+    policy_free(policy);
+    return ret;
+  }
+  if (watch && (recursive || batch.action != strip_file))
+  {
+    printf("--watch only purifies, and watches the trees below the directories given\n");
+    return -1;
+  }
+  batch_walk_t walk = {.batch = &batch, .threads = (unsigned)jobs, .watch = watch, .debounce_ms = debounce_ms,
+                       .stop_fd = -1};
+  if (watch)
+  {
+    /* Purifying in place closes the archive after writing it, so the watch
+     * sees every archive again once done; it is left alone the second time.
+     * Nothing is kept that a long watch would pile up. */
+    opts.skip_pure = true;
+    batch.transient = true;
+
+    /* Finish the archives being purified, and those waiting, when stopped */
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    ERR_RET_IF_NEQ(pthread_sigmask(SIG_BLOCK, &stop_signals, NULL), 0, -1);
+    ERR_RET_ON_ERRNO(walk.stop_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC), -1);
+  }
+  if (recursive || watch)
+  {
+    /* The archives are handed out as the walk finds them */
+    walk.roots = batch.paths;
+    walk.count = batch.count;
+    batch.paths = NULL;
+    batch.count = 0;
+  }
+  else
+  {
+    for (size_t i = 0; i < batch.count; i++)
+    {
+      ERR_RET_IF_NEQ(batch_queue(&batch, batch.paths[i], batch_size(batch.paths[i])), 0, -1);
+    }
+    batch.closed = true;
+    if (jobs > batch.count)
+    {
+      /* The jobs left over help with large archives straight away */
+      batch.idle_threads = (unsigned)(jobs - batch.count);
+      jobs = batch.count;
+    }
+  }
+  opts.idle_threads = &batch.idle_threads;
 
-    // Now deal with the local header
-    size_t current_cd_position = ftell(zf);
-    fseek(zf, cd_header.rel_offset_local_header, SEEK_SET);
+  if (cache_dir)
+  {
+    /* Only cache results under the same options that shape the output */
+    uint32_t fingerprint[] = {opts.cd_only, opts.signed_policy, opts.compact};
+    uint64_t salt = hash64(fingerprint, sizeof(fingerprint), policy ? policy_digest(policy) : 0);
+    if ((opts.cache = cache_open(cache_dir, cache_size, salt)) == NULL)
     {
-      local_file_header_t lf_header = {0};
-      ERR_RET_IF_NEQ(fread(&lf_header, sizeof(local_file_header_t), 1, zf), 1u, -1);
-      ERR_RET_IF_NEQ(lf_header.signature, FILE_HEADER_SIGNATURE, -1);
+      return -1;
+    }
+  }
 
-      if ((lf_header.gp_bits & GP_BIT_ENC_MARKERS) != 0x0)
-      {
-        printf("Entry encrypted, I don't know how to deal with that.\n");
-        return -1;
-      }
-      if ((lf_header.gp_bits & GP_BIT_UNKNOWN_FLAG_MASK) != 0)
-      {
-        printf("Entry has strange general purpose bits: %u\n", cd_header.gp_bits);
-        return -1;
-      }
+  if (max_mem)
+  {
+    ERR_RET_IF_NOT(opts.budget = budget_open(max_mem), -1);
+  }
 
-      lf_header.last_mod_date = 0;
-      lf_header.last_mod_time = 0;
-      overwrite_field(&lf_header, sizeof(local_file_header_t), zf);
+  /* For a batch, one syncfs per filesystem at the end beats syncing every
+   * archive separately */
+  opts.defer_sync = opts.sync != SYNC_NONE && !watch && (recursive || batch.count > 1);
 
-      // Seek over the filename (assuming there's nothing sensitive in here)
-      fseek(zf, lf_header.name_length, SEEK_CUR);
+  /* The main thread is the first worker */
+  pthread_mutex_init(&batch.stats_lock, NULL);
+  pthread_mutex_init(&batch.queue_lock, NULL);
+  pthread_cond_init(&batch.more, NULL);
+  pthread_t walk_thread;
+  if (recursive || watch)
+  {
+    ERR_RET_IF_NEQ(pthread_create(&walk_thread, NULL, batch_walker, &walk), 0, -1);
+  }
+  pthread_t *threads = NULL;
+  ERR_RET_IF_NOT(threads = calloc(jobs, sizeof(pthread_t)), -1);
+  for (size_t i = 1; i < jobs; i++)
+  {
+    ERR_RET_IF_NEQ(pthread_create(&threads[i], NULL, batch_worker, &batch), 0, -1);
+  }
+  batch_worker(&batch);
+  for (size_t i = 1; i < jobs; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  if (recursive || watch)
+  {
+    pthread_join(walk_thread, NULL);
+  }
+  if (walk.stop_fd >= 0)
+  {
+    close(walk.stop_fd);
+  }
+  pthread_cond_destroy(&batch.more);
+  pthread_mutex_destroy(&batch.queue_lock);
+  pthread_mutex_destroy(&batch.stats_lock);
+  policy_free(policy);
+  cache_close(opts.cache);
+  budget_close(opts.budget);
+
+  if (opts.defer_sync && sync_filesystems(batch.paths, batch.count, &batch.stats) != 0)
+  {
+    batch.failures++;
+  }
+  if (recursive || watch)
+  {
+    /* With --watch, each was freed once done instead */
+    for (size_t i = 0; i < batch.count; i++)
+    {
+      free(batch.paths[i]);
+    }
+    free(batch.paths);
+  }
+  free(batch.queue);
 
-      // Take care of local data extra
-      if (lf_header.extra_field_length)
-      {
-        ERR_RET_IF_NEQ(fread(local_extra, lf_header.extra_field_length, 1, zf), 1u, -1);
-        ERR_RET_IF_NOT(purify_extra_data(lf_header.extra_field_length, local_extra), -1);
-        overwrite_field(local_extra, lf_header.extra_field_length, zf);
-      }
+  if (stats_format != STATS_FORMAT_NONE)
+  {
+    FILE *stats_out = stdout;
+    if (stats_path)
+    {
+      ERR_RET_IF_NOT(stats_out = fopen(stats_path, "w"), -1);
+    }
+    stats_print(&batch.stats, stats_format, stats_out);
+    if (stats_out != stdout)
+    {
+      fclose(stats_out);
     }
-    fseek(zf, current_cd_position, SEEK_SET);
   }
 
-  fclose(zf);
-  return 0;
+  /* Reported (but unfixed) inconsistencies fail the run too */
+  if ((opts.check == CHECK_REPORT && batch.stats.header_mismatches) || batch.stats.unfixed_mismatches)
+  {
+    return -1;
+  }
+  return batch.failures ? -1 : 0;
 }
@@ -0,0 +1,151 @@
+/**
+ * @file
+ * Read-only structural verification of ZIP archives.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "archive.h"
+#include "local.h"
+#include "verify.h"
+
+/** Arenas larger than this are given back after each archive when memory is
+ *  budgeted */
+#define VERIFY_SCRATCH_KEEP (1024 * 1024)
+
+
+static int compare_local_offset(const void *a, const void *b)
+{
+  uint64_t offset_a = (*(const cd_entry_t * const *)a)->local_offset;
+  uint64_t offset_b = (*(const cd_entry_t * const *)b)->local_offset;
+  return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+
+/**
+ * Memory verify_located() takes for \a archive: its central directory, each
+ * entry parsed and sorted, and a local record's extra field, taken to be as
+ * long as the central directory.
+ */
+static uint64_t verify_memory_need(const archive_t *archive)
+{
+  return 2 * archive->cd_len + archive->num_entries * (sizeof(cd_entry_t) + sizeof(cd_entry_t *));
+}
+
+
+/** Verify the archive found by archive_locate(). */
+static int verify_located(int fd, const archive_t *located, strip_ctx_t *ctx)
+{
+  stats_t *stats = &ctx->stats;
+  archive_t archive = *located;
+
+  scratch_reset(&ctx->scratch);
+  char *cd;
+  cd_entry_t *entries;
+  cd_entry_t **by_offset;
+  size_t num_entries = archive.num_entries;
+  ERR_RET_IF_NEQ(archive_read_cd(&archive, &ctx->scratch, stats, &cd, &entries), 0, -1);
+  ERR_RET_IF_NOT(by_offset = scratch_alloc(&ctx->scratch, num_entries * sizeof(cd_entry_t *)), -1);
+  for (size_t i = 0; i < num_entries; i++)
+  {
+    by_offset[i] = &entries[i];
+  }
+  qsort(by_offset, num_entries, sizeof(cd_entry_t *), compare_local_offset);
+
+  /* Local records run up to the signing block if there is one, else the CD */
+  uint64_t region_end = archive.sig_block_len ? archive.sig_block_offset : archive.cd_offset;
+  uint64_t offset = archive.bias;
+  uint64_t previous = UINT64_MAX;
+  size_t problems = 0;
+  for (size_t i = 0; i < num_entries; i++)
+  {
+    const cd_entry_t *entry = by_offset[i];
+    const central_directory_header_t *cd_header = entry->header;
+    uint64_t expected = entry->local_offset;
+    stats->entries++;
+
+    /* Entries may share one record, as some tools leave them */
+    if (expected == previous)
+    {
+      offset = expected;
+    }
+    else if (offset != expected)
+    {
+      printf("%.*s: expected at 0x%08" PRIx64 " but the previous record ends at 0x%08" PRIx64 "\n",
+             (int)entry->name.len, entry->name.ptr, expected, offset);
+      problems++;
+      offset = expected;
+    }
+
+    local_record_t rec;
+    if (local_record_read(fd, offset, region_end, &rec, &ctx->scratch, stats) != 0)
+    {
+      printf("%.*s: bad local record\n", (int)entry->name.len, entry->name.ptr);
+      problems++;
+      continue;
+    }
+    previous = expected;
+
+    if (rec.descriptor_len &&
+        (rec.crc32 != ZIP_GET(cd_header, crc32) ||
+         rec.compressed_size != ZIP_GET(cd_header, compressed_size) ||
+         rec.uncompressed_size != ZIP_GET(cd_header, uncompressed_size)))
+    {
+      printf("%.*s: data descriptor disagrees with the central directory\n",
+             (int)entry->name.len, entry->name.ptr);
+      problems++;
+    }
+    else if (!ctx->opts->quiet)
+    {
+      printf("%.*s: ok%s\n", (int)entry->name.len, entry->name.ptr, rec.descriptor_len ? " (data descriptor)" : "");
+    }
+    offset = rec.end;
+  }
+
+  if (offset != region_end)
+  {
+    printf("%" PRIu64 " bytes of unaccounted data after the last local record\n", region_end - offset);
+    problems++;
+  }
+
+  printf("%zu entries, %zu problems\n", num_entries, problems);
+  return problems ? -1 : 0;
+}
+
+
+int verify_archive(int fd, strip_ctx_t *ctx)
+{
+  ctx->stats.archives++;
+  archive_t archive;
+  ERR_RET_IF_NEQ(archive_locate(fd, &archive, &ctx->stats), 0, -1);
+
+  uint64_t reserved = ctx->opts->budget ? budget_acquire(ctx->opts->budget, verify_memory_need(&archive)) : 0;
+  int ret = verify_located(fd, &archive, ctx);
+  if (reserved)
+  {
+    budget_release(ctx->opts->budget, reserved);
+    scratch_trim(&ctx->scratch, VERIFY_SCRATCH_KEEP);
+  }
+  return ret;
+}
+
+
+int verify_file(const char *path, strip_ctx_t *ctx)
+{
+  int fd;
+  ERR_RET_ON_ERRNO(fd = open(path, O_RDONLY), -1);
+  int ret = verify_archive(fd, ctx);
+  close(fd);
+  return ret;
+}
@@ -0,0 +1,27 @@
+/**
+ * @file
+ * Read-only structural verification of ZIP archives.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_VERIFY_H
+#define STRIPZIP_VERIFY_H
+
+#include "stripzip.h"
+
+/**
+ * Walk the local records of the archive open on \a fd front to back and check
+ * that they tile the space before the central directory, that every record
+ * is where the central directory says it is, and that data descriptors agree
+ * with the central directory.
+ *
+ * @return 0 if the archive is consistent, -1 otherwise.
+ */
+int verify_archive(int fd, strip_ctx_t *ctx);
+
+/** Open \a path read-only and check it with verify_archive(). */
+int verify_file(const char *path, strip_ctx_t *ctx);
+
+#endif /* STRIPZIP_VERIFY_H */
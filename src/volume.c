@@ -0,0 +1,214 @@
+/**
+ * @file
+ * Archives split across several files.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "err.h"
+#include "volume.h"
+
+
+int volume_open(const char *path, int fd, uint32_t last_disk, volume_set_t *set)
+{
+  memset(set, 0, sizeof(*set));
+  size_t count = (size_t)last_disk + 1;
+  set->fds = malloc(count * sizeof(int));
+  set->starts = malloc(count * sizeof(uint64_t));
+  if (set->fds == NULL || set->starts == NULL)
+  {
+    printf("Out of memory opening a split archive of %zu disks\n", count);
+    volume_close(set);
+    return -1;
+  }
+  set->count = count;
+  memset(set->fds, 0xFF, count * sizeof(int));
+
+  /* name.zip is the last disk; the others are name.z01, name.z02, ... */
+  size_t base_len = strlen(path);
+  if (base_len > 4 && strcasecmp(path + base_len - 4, ".zip") == 0)
+  {
+    base_len -= 4;
+  }
+  char segment_path[base_len + 16];
+  uint64_t pos = 0;
+  for (size_t disk = 0; disk < count; disk++)
+  {
+    int segment_fd = fd;
+    if (disk + 1 < count)
+    {
+      snprintf(segment_path, sizeof(segment_path), "%.*s.z%02zu", (int)base_len, path, disk + 1);
+      if ((segment_fd = open(segment_path, O_RDWR)) < 0)
+      {
+        printf("%s: can't open segment %zu of %zu: %s\n", segment_path, disk + 1, count, strerror(errno));
+        volume_close(set);
+        return -1;
+      }
+    }
+    set->fds[disk] = segment_fd;
+
+    struct stat st;
+    if (fstat(segment_fd, &st) != 0)
+    {
+      printf("Can't stat segment %zu of %zu: %s\n", disk + 1, count, strerror(errno));
+      volume_close(set);
+      return -1;
+    }
+    set->starts[disk] = pos;
+    pos += (uint64_t)st.st_size;
+  }
+  set->size = pos;
+  return 0;
+}
+
+
+void volume_close(volume_set_t *set)
+{
+  /* The last segment belongs to the caller */
+  for (size_t disk = 0; disk + 1 < set->count; disk++)
+  {
+    if (set->fds[disk] >= 0)
+    {
+      close(set->fds[disk]);
+    }
+  }
+  free(set->fds);
+  free(set->starts);
+  memset(set, 0, sizeof(*set));
+}
+
+
+int volume_position(const volume_set_t *set, uint32_t disk, uint64_t offset, uint64_t *pos)
+{
+  if (disk >= set->count)
+  {
+    printf("Split archive refers to disk %" PRIu32 " but only has %zu\n", disk, set->count);
+    return -1;
+  }
+  uint64_t end = disk + 1 < set->count ? set->starts[disk + 1] : set->size;
+  if (offset > end - set->starts[disk])
+  {
+    printf("Offset 0x%" PRIx64 " is past the end of disk %" PRIu32 "\n", offset, disk);
+    return -1;
+  }
+  *pos = set->starts[disk] + offset;
+  return 0;
+}
+
+
+/** The segment holding position \a pos of the joined archive. */
+static size_t find_segment(const volume_set_t *set, uint64_t pos)
+{
+  size_t lo = 0;
+  size_t hi = set->count;
+  while (hi - lo > 1)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (set->starts[mid] <= pos)
+    {
+      lo = mid;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+
+/**
+ * Cut the operation \a op, in joined archive positions, into one operation
+ * per segment it touches and append them to \a pieces at \a *num_pieces.
+ * When \a pieces is NULL they are only counted.
+ *
+ * @return 0 on success, -1 if \a op runs past the last segment.
+ */
+static int split_op(const volume_set_t *set, const io_op_t *op, io_op_t *pieces, size_t *num_pieces)
+{
+  if (op->offset > set->size || op->len > set->size - op->offset)
+  {
+    printf("I/O at 0x%" PRIx64 " runs past the end of the split archive\n", op->offset);
+    return -1;
+  }
+  size_t done = 0;
+  for (size_t disk = find_segment(set, op->offset); done < op->len; disk++)
+  {
+    uint64_t pos = op->offset + done;
+    uint64_t end = disk + 1 < set->count ? set->starts[disk + 1] : set->size;
+    size_t len = end - pos < op->len - done ? (size_t)(end - pos) : op->len - done;
+    if (len == 0)
+    {
+      /* An empty segment */
+      continue;
+    }
+    if (pieces)
+    {
+      pieces[*num_pieces] = (io_op_t){.fd = set->fds[disk], .write = op->write, .offset = pos - set->starts[disk],
+                                      .buf = (char *)op->buf + done, .len = len};
+    }
+    (*num_pieces)++;
+    done += len;
+  }
+  return 0;
+}
+
+
+int volume_submit_batch(const volume_set_t *set, io_engine_t *io, const io_op_t *ops, size_t count,
+                        stats_t *stats)
+{
+  size_t num_pieces = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    ERR_RET_IF_NEQ(split_op(set, &ops[i], NULL, &num_pieces), 0, -1);
+  }
+
+  io_op_t *pieces;
+  ERR_RET_IF_NOT(pieces = malloc((num_pieces + 1) * sizeof(io_op_t)), -1);
+  num_pieces = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    split_op(set, &ops[i], pieces, &num_pieces);
+  }
+  int ret = io_submit_batch(io, pieces, num_pieces, stats);
+  free(pieces);
+  return ret;
+}
+
+
+int volume_read_at(const volume_set_t *set, void *buf, size_t len, uint64_t pos, stats_t *stats)
+{
+  io_op_t op = {.write = false, .offset = pos, .buf = buf, .len = len};
+  size_t num_pieces = 0;
+  ERR_RET_IF_NEQ(split_op(set, &op, NULL, &num_pieces), 0, -1);
+  io_op_t pieces[num_pieces + 1];
+  num_pieces = 0;
+  split_op(set, &op, pieces, &num_pieces);
+  for (size_t i = 0; i < num_pieces; i++)
+  {
+    ERR_RET_IF_NEQ(io_read_at(pieces[i].fd, pieces[i].buf, pieces[i].len, pieces[i].offset, stats), 0, -1);
+  }
+  return 0;
+}
+
+
+int volume_sync(const volume_set_t *set, bool data_only)
+{
+  for (size_t disk = 0; disk < set->count; disk++)
+  {
+    ERR_RET_ON_ERRNO(data_only ? fdatasync(set->fds[disk]) : fsync(set->fds[disk]), -1);
+  }
+  return 0;
+}
@@ -0,0 +1,71 @@
+/**
+ * @file
+ * Archives split across several files.
+ *
+ * A split archive of N disks is stored as name.z01 ... name.zNN followed by
+ * name.zip, which holds the last disk and the EOCD. Offsets in the archive
+ * are (disk, offset) pairs. A volume set maps them to positions in the
+ * segments joined end to end, so the rest of StripZIP can treat the archive
+ * as one file while every read and write goes to the segment holding it.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_VOLUME_H
+#define STRIPZIP_VOLUME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "io.h"
+
+typedef struct
+{
+  size_t count;       /**< Number of segments, one per disk */
+  int *fds;           /**< Each segment, opened for reading and writing */
+  uint64_t *starts;   /**< Position of each segment in the joined archive */
+  uint64_t size;      /**< Length of the joined archive */
+} volume_set_t;
+
+/**
+ * Open the segments of the split archive whose last disk, number
+ * \a last_disk, is \a path and is already open on \a fd. The others are
+ * found next to it by replacing the .zip extension with .z01, .z02 and so on.
+ * \a fd is used for the last segment but stays the caller's to close.
+ *
+ * @return 0 on success, -1 if a segment is missing or can't be opened.
+ */
+int volume_open(const char *path, int fd, uint32_t last_disk, volume_set_t *set);
+
+/** Close the segments opened by volume_open() and free \a set. */
+void volume_close(volume_set_t *set);
+
+/**
+ * Set \a pos to the position in the joined archive of \a offset on
+ * \a disk.
+ *
+ * @return 0 on success, -1 if there is no such disk or it is too short.
+ */
+int volume_position(const volume_set_t *set, uint32_t disk, uint64_t offset, uint64_t *pos);
+
+/**
+ * Perform every operation in \a ops, whose offsets are positions in the
+ * joined archive and whose file descriptors are ignored. Operations are
+ * split where they cross from one segment to the next, and the whole lot,
+ * whatever segments it touches, goes to the I/O engine as one batch.
+ *
+ * @return 0 if every operation transferred its full length, -1 otherwise.
+ */
+int volume_submit_batch(const volume_set_t *set, io_engine_t *io, const io_op_t *ops, size_t count,
+                        stats_t *stats);
+
+/** Read exactly \a len bytes at \a pos in the joined archive. @return 0 on success, -1 on failure. */
+int volume_read_at(const volume_set_t *set, void *buf, size_t len, uint64_t pos, stats_t *stats);
+
+/** Flush every segment with fsync, or fdatasync if \a data_only. @return 0 on success, -1 on failure. */
+int volume_sync(const volume_set_t *set, bool data_only);
+
+#endif /* STRIPZIP_VOLUME_H */
@@ -0,0 +1,338 @@
+/**
+ * @file
+ * Finding archives in directory trees.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "err.h"
+#include "zip_format.h"
+#include "walk.h"
+
+/** Longest archive comment, and so the furthest the EOCD can be from the end */
+#define WALK_MAX_COMMENT 0xFFFF
+
+/** Bytes of directory entries fetched per getdents64 call */
+#define WALK_DENTS_BUFFER (64 * 1024)
+
+/** Directory entry as returned by getdents64 */
+struct linux_dirent64
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/** State shared by the walking threads */
+typedef struct
+{
+  char **dirs;          /**< Directories still to be read */
+  size_t num_dirs;
+  size_t capacity;
+  size_t busy;          /**< Threads reading a directory, which may add more */
+  bool failed;
+  walk_found_t found;
+  void *arg;
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+} walker_t;
+
+
+/**
+ * Whether the EOCD \a eocd, found at \a eocd_offset in the file open on
+ * \a fd, describes an archive there. As archive_locate() would have it, the
+ * central directory must end right before the EOCD, leaving room for a
+ * prefix in front of the offset it has stored, and start with a central
+ * directory header. Zip64 and split archives only need their EOCD.
+ */
+static bool plausible_eocd(int fd, const end_of_central_directory_header_t *eocd, uint64_t eocd_offset)
+{
+  uint64_t cd_len = ZIP_GET(eocd, size_of_cd);
+  uint64_t cd_offset = ZIP_GET(eocd, cd_offset_in_first_disk);
+  if (ZIP_GET(eocd, disk_number) != 0 || cd_len == 0xFFFFFFFF || cd_offset == 0xFFFFFFFF)
+  {
+    return true;
+  }
+  if (cd_offset + cd_len > eocd_offset)
+  {
+    return false;
+  }
+  if (cd_len == 0)
+  {
+    return ZIP_GET(eocd, total_num_entries_cd) == 0;
+  }
+  uint32_t signature;
+  return pread(fd, &signature, sizeof(signature), (off_t)(eocd_offset - cd_len)) == sizeof(signature) &&
+         zip_load32(&signature) == CENDIR_HEADER_SIGNATURE;
+}
+
+
+bool walk_sniff(int fd)
+{
+  struct stat st;
+  end_of_central_directory_header_t eocd;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size < sizeof(eocd))
+  {
+    return false;
+  }
+
+  /* Most archives have no comment, so the EOCD is usually the last thing */
+  uint64_t size = (uint64_t)st.st_size;
+  if (pread(fd, &eocd, sizeof(eocd), (off_t)(size - sizeof(eocd))) == sizeof(eocd) &&
+      ZIP_GET(&eocd, signature) == EO_CENDIR_HEADER_SIGNATURE && ZIP_GET(&eocd, zip_file_comment_length) == 0 &&
+      plausible_eocd(fd, &eocd, size - sizeof(eocd)))
+  {
+    return true;
+  }
+
+  /* Otherwise look for one whose comment runs to the end of the file */
+  size_t tail_len = size < sizeof(eocd) + WALK_MAX_COMMENT ? (size_t)size : sizeof(eocd) + WALK_MAX_COMMENT;
+  char *tail = malloc(tail_len);
+  bool found = false;
+  if (tail != NULL && pread(fd, tail, tail_len, (off_t)(size - tail_len)) == (ssize_t)tail_len)
+  {
+    for (size_t pos = tail_len - sizeof(eocd); pos-- > 0 && !found; )
+    {
+      if (zip_load32(tail + pos) == EO_CENDIR_HEADER_SIGNATURE &&
+          zip_load16(tail + pos + offsetof(end_of_central_directory_header_t, zip_file_comment_length)) ==
+            tail_len - pos - sizeof(eocd))
+      {
+        memcpy(&eocd, tail + pos, sizeof(eocd));
+        found = plausible_eocd(fd, &eocd, size - tail_len + pos);
+      }
+    }
+  }
+  free(tail);
+  return found;
+}
+
+
+/** Push \a path onto the stack of directories to read. Takes \a path. */
+static int push_dir(walker_t *walker, char *path)
+{
+  pthread_mutex_lock(&walker->lock);
+  if (walker->num_dirs == walker->capacity)
+  {
+    size_t capacity = walker->capacity ? 2 * walker->capacity : 64;
+    char **dirs = realloc(walker->dirs, capacity * sizeof(char *));
+    if (dirs == NULL)
+    {
+      pthread_mutex_unlock(&walker->lock);
+      free(path);
+      ERR_RET_IF_NOT(dirs, -1);
+    }
+    walker->dirs = dirs;
+    walker->capacity = capacity;
+  }
+  walker->dirs[walker->num_dirs++] = path;
+  pthread_cond_signal(&walker->more);
+  pthread_mutex_unlock(&walker->lock);
+  return 0;
+}
+
+
+/** \a dir and \a name joined with a slash, malloc()ed. */
+static char *join_path(const char *dir, const char *name)
+{
+  size_t dir_len = strlen(dir);
+  size_t name_len = strlen(name);
+  char *path = malloc(dir_len + name_len + 2);
+  if (path)
+  {
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+  }
+  return path;
+}
+
+
+/**
+ * Read the directory \a path, pushing its subdirectories and passing on the
+ * archives in it.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int read_dir(walker_t *walker, const char *path, char *buf)
+{
+  int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0)
+  {
+    printf("%s: can't open directory: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  int ret = 0;
+  long len;
+  while ((len = syscall(SYS_getdents64, dir_fd, buf, WALK_DENTS_BUFFER)) > 0)
+  {
+    for (long pos = 0; pos < len; )
+    {
+      const struct linux_dirent64 *dent = (const struct linux_dirent64 *)(buf + pos);
+      pos += dent->d_reclen;
+      const char *name = dent->d_name;
+      if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strstr(name, WALK_TEMP_MARKER))
+      {
+        continue;
+      }
+
+      unsigned char type = dent->d_type;
+      if (type == DT_UNKNOWN)
+      {
+        /* Not every filesystem fills in d_type */
+        struct stat st;
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          continue;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+      }
+
+      if (type == DT_DIR)
+      {
+        char *sub = join_path(path, name);
+        if (sub == NULL || push_dir(walker, sub) != 0)
+        {
+          ret = -1;
+        }
+      }
+      else if (type == DT_REG)
+      {
+        int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK);
+        if (fd < 0)
+        {
+          continue;
+        }
+        bool archive = walk_sniff(fd);
+        close(fd);
+        char *file;
+        if (archive && (file = join_path(path, name)) != NULL)
+        {
+          walker->found(file, walker->arg);
+        }
+      }
+    }
+  }
+  if (len < 0)
+  {
+    printf("%s: can't read directory: %s\n", path, strerror(errno));
+    ret = -1;
+  }
+  close(dir_fd);
+  return ret;
+}
+
+
+static void *walk_thread(void *arg)
+{
+  walker_t *walker = arg;
+  char *buf = malloc(WALK_DENTS_BUFFER);
+  pthread_mutex_lock(&walker->lock);
+  if (buf == NULL)
+  {
+    walker->failed = true;
+  }
+  for (;;)
+  {
+    while (walker->num_dirs == 0 && walker->busy)
+    {
+      pthread_cond_wait(&walker->more, &walker->lock);
+    }
+    if (walker->num_dirs == 0 || buf == NULL)
+    {
+      /* Nothing left, and nobody reading a directory that might add more */
+      break;
+    }
+    char *path = walker->dirs[--walker->num_dirs];
+    walker->busy++;
+    pthread_mutex_unlock(&walker->lock);
+
+    int ret = read_dir(walker, path, buf);
+    free(path);
+
+    pthread_mutex_lock(&walker->lock);
+    walker->failed |= ret != 0;
+    if (--walker->busy == 0 && walker->num_dirs == 0)
+    {
+      pthread_cond_broadcast(&walker->more);
+    }
+  }
+  pthread_mutex_unlock(&walker->lock);
+  free(buf);
+  return NULL;
+}
+
+
+int walk_trees(char *const *roots, size_t count, unsigned threads, walk_found_t found, void *arg)
+{
+  walker_t walker = {.found = found, .arg = arg};
+  pthread_mutex_init(&walker.lock, NULL);
+  pthread_cond_init(&walker.more, NULL);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    struct stat st;
+    char *root = strdup(roots[i]);
+    if (root == NULL || stat(roots[i], &st) != 0)
+    {
+      printf("%s: %s\n", roots[i], strerror(errno));
+      free(root);
+      walker.failed = true;
+      continue;
+    }
+    for (size_t len = strlen(root); len > 1 && root[len - 1] == '/'; len--)
+    {
+      root[len - 1] = '\0';
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+      found(root, arg);
+    }
+    else if (push_dir(&walker, root) != 0)
+    {
+      walker.failed = true;
+    }
+  }
+
+  /* The calling thread walks too */
+  pthread_t *extra = calloc(threads, sizeof(pthread_t));
+  size_t num_extra = 0;
+  while (extra && num_extra + 1 < threads && pthread_create(&extra[num_extra], NULL, walk_thread, &walker) == 0)
+  {
+    num_extra++;
+  }
+  walk_thread(&walker);
+  for (size_t i = 0; i < num_extra; i++)
+  {
+    pthread_join(extra[i], NULL);
+  }
+  free(extra);
+
+  /* Only left over if no thread could get a buffer */
+  for (size_t i = 0; i < walker.num_dirs; i++)
+  {
+    free(walker.dirs[i]);
+  }
+  free(walker.dirs);
+  pthread_cond_destroy(&walker.more);
+  pthread_mutex_destroy(&walker.lock);
+  return walker.failed ? -1 : 0;
+}
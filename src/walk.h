@@ -0,0 +1,51 @@
+/**
+ * @file
+ * Finding archives in directory trees.
+ *
+ * Several threads walk the trees together, sharing a stack of directories
+ * still to be read. Each directory is read with getdents64 in large chunks,
+ * and every regular file in it is sniffed for a local file header at the
+ * start and an end of central directory record at the end, so archives are
+ * found whatever they are called (.jar, .whl, .aar, .nupkg, .vsix, ...).
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_WALK_H
+#define STRIPZIP_WALK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Marks StripZIP's temporary copies and journals, which are never archives
+ *  to purify in their own right */
+#define WALK_TEMP_MARKER ".stripzip-"
+
+/**
+ * Called with each archive found, from whichever walking thread found it.
+ * \a path is malloc()ed and becomes the callee's.
+ */
+typedef void (*walk_found_t)(char *path, void *arg);
+
+/**
+ * Whether the file open on \a fd holds a ZIP archive: whether it ends with
+ * an end of central directory record, perhaps followed by a comment, whose
+ * central directory is where it says, give or take a prefix such as a
+ * self-extractor stub. Empty archives, which are just the record, count too.
+ */
+bool walk_sniff(int fd);
+
+/**
+ * Find every archive under the \a count \a roots with \a threads threads,
+ * passing each to \a found as soon as it is found. Roots that aren't
+ * directories are passed on without being sniffed. Symbolic links are not
+ * followed, and files that look like StripZIP's own temporary copies are
+ * skipped.
+ *
+ * @return 0 on success, -1 if some directory couldn't be read; everything
+ *         else is still walked.
+ */
+int walk_trees(char *const *roots, size_t count, unsigned threads, walk_found_t found, void *arg);
+
+#endif /* STRIPZIP_WALK_H */
@@ -0,0 +1,530 @@
+/**
+ * @file
+ * Watching directory trees for archives as they are written.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "err.h"
+#include "hash.h"
+#include "stats.h"
+#include "watch.h"
+
+/** Events watched for in every directory. IN_ONLYDIR and IN_DONT_FOLLOW
+ *  keep a directory replaced by something else, or by a link, unwatched. */
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                    IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/** Bytes of inotify events read at once */
+#define WATCH_EVENT_BUFFER (64 * 1024)
+
+/** Sentinel for an empty index slot */
+#define WATCH_NO_ENTRY UINT32_MAX
+
+/** A file waiting to be left alone for long enough */
+typedef struct
+{
+  char *path;
+  uint64_t due;         /**< stats_now() time it may be passed on */
+} watch_pending_t;
+
+/**
+ * An archive as it was when last passed on. Purifying opens it for writing,
+ * and closing it fires IN_CLOSE_WRITE even when nothing was written, as
+ * when purifying fails; only a file that has changed since goes round again.
+ * It is forgotten at its next event, or when it is deleted or moved away.
+ */
+typedef struct
+{
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+} watch_seen_t;
+
+/**
+ * Places in an array of watch_pending_t or watch_seen_t, both of which start
+ * with their path, by path. Linear probing, kept at most half full.
+ */
+typedef struct
+{
+  uint32_t *slots;      /**< Places in the array, WATCH_NO_ENTRY when empty */
+  size_t mask;
+} watch_index_t;
+
+typedef struct
+{
+  int fd;                   /**< The inotify instance */
+  char **dirs;              /**< Path of each watched directory, by watch descriptor */
+  size_t num_dirs;          /**< Length of dirs, not all of it in use */
+  watch_pending_t *pending;
+  size_t num_pending;
+  size_t pending_capacity;
+  watch_index_t pending_index;
+  watch_seen_t *seen;
+  size_t num_seen;
+  size_t seen_capacity;
+  watch_index_t seen_index;
+  uint64_t debounce_ns;
+  walk_found_t found;
+  void *arg;
+} watcher_t;
+
+
+/** Path of the \a i th of the \a size byte items at \a items */
+static const char *item_path(const void *items, size_t size, uint32_t i)
+{
+  return *(char *const *)(const void *)((const char *)items + i * size);
+}
+
+
+static size_t home_slot(const watch_index_t *index, const char *path)
+{
+  return hash64(path, strlen(path), 0) & index->mask;
+}
+
+
+/** Slot of \a index holding \a path, or the empty one it would go in */
+static size_t index_slot(const watch_index_t *index, const void *items, size_t size, const char *path)
+{
+  for (size_t slot = home_slot(index, path); ; slot = (slot + 1) & index->mask)
+  {
+    uint32_t i = index->slots[slot];
+    if (i == WATCH_NO_ENTRY || strcmp(item_path(items, size, i), path) == 0)
+    {
+      return slot;
+    }
+  }
+}
+
+
+/** @return Where \a path is in \a items, or WATCH_NO_ENTRY. */
+static uint32_t index_find(const watch_index_t *index, const void *items, size_t size, const char *path)
+{
+  return index->slots ? index->slots[index_slot(index, items, size, path)] : WATCH_NO_ENTRY;
+}
+
+
+/**
+ * Make room in \a index for one more than the \a count items at \a items,
+ * rebuilding it over them when it grows.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int index_reserve(watch_index_t *index, const void *items, size_t size, size_t count)
+{
+  if (index->slots && 2 * (count + 1) <= index->mask + 1)
+  {
+    return 0;
+  }
+  size_t num_slots = index->slots ? 2 * (index->mask + 1) : 128;
+  uint32_t *slots = malloc(num_slots * sizeof(uint32_t));
+  ERR_RET_IF_NOT(slots, -1);
+  memset(slots, 0xFF, num_slots * sizeof(uint32_t));
+  free(index->slots);
+  index->slots = slots;
+  index->mask = num_slots - 1;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    index->slots[index_slot(index, items, size, item_path(items, size, i))] = i;
+  }
+  return 0;
+}
+
+
+/** Note that the \a i th of \a items, whose path is set, is in \a index. */
+static void index_insert(watch_index_t *index, const void *items, size_t size, uint32_t i)
+{
+  index->slots[index_slot(index, items, size, item_path(items, size, i))] = i;
+}
+
+
+/**
+ * Take the \a i th of the \a count items at \a items out of \a index, and
+ * move the last of them to its place, as the caller then does in the array.
+ */
+static void index_remove(watch_index_t *index, const void *items, size_t size, size_t count, uint32_t i)
+{
+  size_t hole = index_slot(index, items, size, item_path(items, size, i));
+  for (size_t slot = (hole + 1) & index->mask; index->slots[slot] != WATCH_NO_ENTRY; slot = (slot + 1) & index->mask)
+  {
+    /* Anything whose probe passes the hole moves back into it */
+    size_t home = home_slot(index, item_path(items, size, index->slots[slot]));
+    if (((slot - home) & index->mask) >= ((slot - hole) & index->mask))
+    {
+      index->slots[hole] = index->slots[slot];
+      hole = slot;
+    }
+  }
+  index->slots[hole] = WATCH_NO_ENTRY;
+
+  uint32_t last = (uint32_t)(count - 1);
+  if (last != i)
+  {
+    index->slots[index_slot(index, items, size, item_path(items, size, last))] = i;
+  }
+}
+
+
+/** Note an event for \a path, pushing back when it is passed on. Takes \a path. */
+static int touch(watcher_t *watcher, char *path)
+{
+  uint64_t due = stats_now() + watcher->debounce_ns;
+  uint32_t i = index_find(&watcher->pending_index, watcher->pending, sizeof(watch_pending_t), path);
+  if (i != WATCH_NO_ENTRY)
+  {
+    watcher->pending[i].due = due;
+    free(path);
+    return 0;
+  }
+  if (watcher->num_pending == watcher->pending_capacity)
+  {
+    size_t capacity = watcher->pending_capacity ? 2 * watcher->pending_capacity : 64;
+    watch_pending_t *pending = realloc(watcher->pending, capacity * sizeof(watch_pending_t));
+    if (pending == NULL)
+    {
+      free(path);
+      ERR_RET_IF_NOT(pending, -1);
+    }
+    watcher->pending = pending;
+    watcher->pending_capacity = capacity;
+  }
+  if (index_reserve(&watcher->pending_index, watcher->pending, sizeof(watch_pending_t), watcher->num_pending) != 0)
+  {
+    free(path);
+    return -1;
+  }
+  watcher->pending[watcher->num_pending] = (watch_pending_t){.path = path, .due = due};
+  index_insert(&watcher->pending_index, watcher->pending, sizeof(watch_pending_t), (uint32_t)watcher->num_pending);
+  watcher->num_pending++;
+  return 0;
+}
+
+
+/** Forget the \a i th archive passed on. */
+static void forget_seen(watcher_t *watcher, uint32_t i)
+{
+  char *path = watcher->seen[i].path;
+  index_remove(&watcher->seen_index, watcher->seen, sizeof(watch_seen_t), watcher->num_seen, i);
+  watcher->seen[i] = watcher->seen[--watcher->num_seen];
+  free(path);
+}
+
+
+/**
+ * Watch the directory \a path and every directory below it. With
+ * \a take_files, the files already in them are noted too, for directories
+ * that appear while being watched and may have been filled before their
+ * watch was in place.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int watch_dir(watcher_t *watcher, const char *path, bool take_files)
+{
+  int wd = inotify_add_watch(watcher->fd, path, WATCH_MASK);
+  if (wd < 0)
+  {
+    printf("%s: can't watch: %s%s\n", path, strerror(errno),
+           errno == ENOSPC ? "; raise fs.inotify.max_user_watches" : "");
+    return -1;
+  }
+  if ((size_t)wd >= watcher->num_dirs)
+  {
+    size_t num_dirs = 2 * (size_t)wd + 64;
+    char **dirs = realloc(watcher->dirs, num_dirs * sizeof(char *));
+    ERR_RET_IF_NOT(dirs, -1);
+    memset(dirs + watcher->num_dirs, 0, (num_dirs - watcher->num_dirs) * sizeof(char *));
+    watcher->dirs = dirs;
+    watcher->num_dirs = num_dirs;
+  }
+  /* A directory watched again, e.g. after being moved, keeps its descriptor */
+  free(watcher->dirs[wd]);
+  ERR_RET_IF_NOT(watcher->dirs[wd] = strdup(path), -1);
+
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+  {
+    printf("%s: can't open directory: %s\n", path, strerror(errno));
+    return -1;
+  }
+  int ret = 0;
+  struct dirent *dent;
+  while ((dent = readdir(dir)) != NULL)
+  {
+    const char *name = dent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strstr(name, WALK_TEMP_MARKER))
+    {
+      continue;
+    }
+    unsigned char type = dent->d_type;
+    if (type == DT_UNKNOWN)
+    {
+      struct stat st;
+      if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+      {
+        continue;
+      }
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    char *sub;
+    if ((type == DT_DIR || (type == DT_REG && take_files)) && asprintf(&sub, "%s/%s", path, name) < 0)
+    {
+      ret = -1;
+      continue;
+    }
+    if (type == DT_DIR)
+    {
+      ret |= watch_dir(watcher, sub, take_files);
+      free(sub);
+    }
+    else if (type == DT_REG && take_files)
+    {
+      ret |= touch(watcher, sub);
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+
+/** Handle every inotify event that has arrived. */
+static void read_events(watcher_t *watcher, char *buf)
+{
+  ssize_t len;
+  while ((len = read(watcher->fd, buf, WATCH_EVENT_BUFFER)) > 0)
+  {
+    for (ssize_t pos = 0; pos < len; )
+    {
+      const struct inotify_event *event = (const struct inotify_event *)(buf + pos);
+      pos += (ssize_t)(sizeof(struct inotify_event) + event->len);
+
+      if (event->mask & IN_Q_OVERFLOW)
+      {
+        printf("Too many changes at once; some archives may have been missed\n");
+        continue;
+      }
+      if (event->wd < 0 || (size_t)event->wd >= watcher->num_dirs || watcher->dirs[event->wd] == NULL)
+      {
+        continue;
+      }
+      if (event->mask & IN_IGNORED)
+      {
+        /* The directory is gone */
+        free(watcher->dirs[event->wd]);
+        watcher->dirs[event->wd] = NULL;
+        continue;
+      }
+      if (event->len == 0 || strstr(event->name, WALK_TEMP_MARKER))
+      {
+        continue;
+      }
+
+      char *path;
+      if (asprintf(&path, "%s/%s", watcher->dirs[event->wd], event->name) < 0)
+      {
+        continue;
+      }
+      if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+      {
+        watch_dir(watcher, path, true);
+        free(path);
+      }
+      else if (!(event->mask & IN_ISDIR) && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+      {
+        touch(watcher, path);
+      }
+      else if (!(event->mask & IN_ISDIR) && (event->mask & (IN_DELETE | IN_MOVED_FROM)))
+      {
+        uint32_t i = index_find(&watcher->seen_index, watcher->seen, sizeof(watch_seen_t), path);
+        if (i != WATCH_NO_ENTRY)
+        {
+          forget_seen(watcher, i);
+        }
+        free(path);
+      }
+      else
+      {
+        free(path);
+      }
+    }
+  }
+}
+
+
+/**
+ * Note that \a path, whose file is described by \a st, is being passed on.
+ *
+ * @return False if it was passed on before and hasn't changed since.
+ */
+static bool note_seen(watcher_t *watcher, const char *path, const struct stat *st)
+{
+  watch_seen_t now = {.dev = st->st_dev, .ino = st->st_ino, .size = st->st_size, .mtime = st->st_mtim};
+  uint32_t i = index_find(&watcher->seen_index, watcher->seen, sizeof(watch_seen_t), path);
+  if (i != WATCH_NO_ENTRY)
+  {
+    const watch_seen_t *seen = &watcher->seen[i];
+    bool same = seen->dev == now.dev && seen->ino == now.ino && seen->size == now.size &&
+                seen->mtime.tv_sec == now.mtime.tv_sec && seen->mtime.tv_nsec == now.mtime.tv_nsec;
+    /* Either this is the event purifying it caused without writing, or it
+     * was written since and the re-check finds it pure without opening it
+     * for writing: no more events of ours are coming either way */
+    forget_seen(watcher, i);
+    return !same;
+  }
+
+  /* Failing to remember it only risks purifying it again */
+  if (watcher->num_seen == watcher->seen_capacity)
+  {
+    size_t capacity = watcher->seen_capacity ? 2 * watcher->seen_capacity : 64;
+    watch_seen_t *seen = realloc(watcher->seen, capacity * sizeof(watch_seen_t));
+    if (seen == NULL)
+    {
+      return true;
+    }
+    watcher->seen = seen;
+    watcher->seen_capacity = capacity;
+  }
+  if (index_reserve(&watcher->seen_index, watcher->seen, sizeof(watch_seen_t), watcher->num_seen) == 0 &&
+      (now.path = strdup(path)) != NULL)
+  {
+    watcher->seen[watcher->num_seen] = now;
+    index_insert(&watcher->seen_index, watcher->seen, sizeof(watch_seen_t), (uint32_t)watcher->num_seen);
+    watcher->num_seen++;
+  }
+  return true;
+}
+
+
+/**
+ * Pass on the archives that have been left alone until \a now, or all of
+ * them with \a all, and drop anything else, including archives that haven't
+ * changed since they were last passed on.
+ */
+static void pass_on(watcher_t *watcher, uint64_t now, bool all)
+{
+  for (size_t i = 0; i < watcher->num_pending; )
+  {
+    watch_pending_t *pending = &watcher->pending[i];
+    if (!all && pending->due > now)
+    {
+      i++;
+      continue;
+    }
+    int fd = open(pending->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK);
+    struct stat st;
+    bool archive = fd >= 0 && walk_sniff(fd) && fstat(fd, &st) == 0 && note_seen(watcher, pending->path, &st);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    char *path = pending->path;
+    index_remove(&watcher->pending_index, watcher->pending, sizeof(watch_pending_t), watcher->num_pending, (uint32_t)i);
+    *pending = watcher->pending[--watcher->num_pending];
+    if (archive)
+    {
+      watcher->found(path, watcher->arg);
+    }
+    else
+    {
+      free(path);
+    }
+  }
+}
+
+
+int watch_trees(char *const *roots, size_t count, unsigned debounce_ms, int stop_fd,
+                walk_found_t found, void *arg)
+{
+  watcher_t watcher = {.debounce_ns = (uint64_t)debounce_ms * 1000000, .found = found, .arg = arg};
+  char *buf = malloc(WATCH_EVENT_BUFFER);
+  int ret = -1;
+  if (buf == NULL || (watcher.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+  {
+    printf("Can't watch for archives: %s\n", strerror(errno));
+    free(buf);
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++)
+  {
+    /* Root names are kept as given, bar trailing slashes */
+    char *root = strdup(roots[i]);
+    if (root == NULL)
+    {
+      goto out;
+    }
+    for (size_t len = strlen(root); len > 1 && root[len - 1] == '/'; len--)
+    {
+      root[len - 1] = '\0';
+    }
+    int watched = watch_dir(&watcher, root, false);
+    free(root);
+    if (watched != 0)
+    {
+      goto out;
+    }
+  }
+
+  struct pollfd fds[] = {{.fd = watcher.fd, .events = POLLIN}, {.fd = stop_fd, .events = POLLIN}};
+  for (;;)
+  {
+    int timeout = -1;
+    uint64_t now = stats_now();
+    for (size_t i = 0; i < watcher.num_pending; i++)
+    {
+      uint64_t wait = watcher.pending[i].due > now ? watcher.pending[i].due - now : 0;
+      int wait_ms = (int)((wait + 999999) / 1000000);
+      timeout = timeout < 0 || wait_ms < timeout ? wait_ms : timeout;
+    }
+    if (poll(fds, 2, timeout) < 0 && errno != EINTR)
+    {
+      printf("Can't wait for changes: %s\n", strerror(errno));
+      break;
+    }
+    if (fds[1].revents)
+    {
+      ret = 0;
+      break;
+    }
+    if (fds[0].revents & POLLIN)
+    {
+      read_events(&watcher, buf);
+    }
+    pass_on(&watcher, stats_now(), false);
+  }
+
+out:
+  /* Whatever is still waiting was closed after writing, so it is complete */
+  pass_on(&watcher, 0, true);
+  for (size_t i = 0; i < watcher.num_dirs; i++)
+  {
+    free(watcher.dirs[i]);
+  }
+  free(watcher.dirs);
+  free(watcher.pending);
+  free(watcher.pending_index.slots);
+  for (size_t i = 0; i < watcher.num_seen; i++)
+  {
+    free(watcher.seen[i].path);
+  }
+  free(watcher.seen);
+  free(watcher.seen_index.slots);
+  close(watcher.fd);
+  free(buf);
+  return ret;
+}
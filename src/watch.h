@@ -0,0 +1,44 @@
+/**
+ * @file
+ * Watching directory trees for archives as they are written.
+ *
+ * Every directory in the trees gets an inotify watch, and directories made
+ * later get one as they appear. A file is picked up when it is closed after
+ * being written (IN_CLOSE_WRITE) or renamed into a watched directory
+ * (IN_MOVED_TO), as tools that write a temporary file first do. Builds often
+ * write an archive more than once, so a file is only passed on once it has
+ * been left alone for the debounce interval; every new event for it starts
+ * the interval again. Files are then sniffed as walk_sniff() does. An
+ * archive is only passed on again once its inode, size or modification time
+ * has changed, so the events purifying causes, even when it fails and
+ * writes nothing, don't send it round again.
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_WATCH_H
+#define STRIPZIP_WATCH_H
+
+#include <stddef.h>
+
+#include "walk.h"
+
+/** How long an archive must be left alone before it is passed on */
+#define WATCH_DEFAULT_DEBOUNCE_MS 250
+
+/** Longest debounce interval accepted, an hour */
+#define WATCH_MAX_DEBOUNCE_MS (60 * 60 * 1000)
+
+/**
+ * Watch the \a count trees at \a roots, passing each archive written in
+ * them to \a found once nothing has happened to it for \a debounce_ms
+ * milliseconds. Archives already there are left alone. Runs until
+ * \a stop_fd becomes readable, then passes on the archives still waiting.
+ *
+ * @return 0 once stopped, -1 if the trees couldn't be watched.
+ */
+int watch_trees(char *const *roots, size_t count, unsigned debounce_ms, int stop_fd,
+                walk_found_t found, void *arg);
+
+#endif /* STRIPZIP_WATCH_H */
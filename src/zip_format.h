@@ -0,0 +1,252 @@
+/**
+ * @file
+ * ZIP on-disk structures and portable accessors for them.
+ *
+ * The structures below document the exact on-disk layout and are only ever
+ * overlaid on raw bytes read from an archive. ZIP is little-endian and makes
+ * no alignment promises, so fields must be accessed with ZIP_GET() and
+ * ZIP_SET(). On little-endian hosts these compile to plain (unaligned) loads
+ * and stores; on big-endian hosts they byte swap.
+ *
+ * ZIP specification at https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
+ *
+ * Copyright (c) 2016, Zee.Aero
+ * All rights reserved.
+ */
+
+#ifndef STRIPZIP_ZIP_FORMAT_H
+#define STRIPZIP_ZIP_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+static const uint32_t FILE_HEADER_SIGNATURE = 0x04034b50;
+static const uint32_t CENDIR_HEADER_SIGNATURE = 0x02014b50;
+static const uint32_t EO_CENDIR_HEADER_SIGNATURE = 0x06054b50;
+static const uint32_t DATA_DESCRIPTOR_SIGNATURE = 0x08074b50;
+static const uint32_t ZIP64_EOCD_SIGNATURE = 0x06064b50;
+static const uint32_t ZIP64_EOCD_LOCATOR_SIGNATURE = 0x07064b50;
+
+#define GPB_ENCRYPTION_MASK        (0x1 <<  0)
+#define GPB_METHOD_6_DETAIL        (0x3 <<  1)
+#define GPB_NOT_SEEKABLE           (0x1 <<  3)
+#define GPB_METHOD_8_ENH_DEFLATE   (0x1 <<  4)
+#define GPB_PATCH_DATA             (0x1 <<  5)
+#define GPB_STRONG_ENCRYPTION_MASK (0x1 <<  6)
+#define GPB_UT8_ENCODING           (0x1 << 11)
+#define GPB_CD_ENCRYPTED_MASK      (0x1 << 13)
+static const uint16_t GP_BIT_ENC_MARKERS       = GPB_ENCRYPTION_MASK | GPB_STRONG_ENCRYPTION_MASK | GPB_CD_ENCRYPTED_MASK;
+static const uint16_t GP_BIT_UNKNOWN_FLAG_MASK = ~(GPB_ENCRYPTION_MASK | GPB_METHOD_6_DETAIL | GPB_NOT_SEEKABLE | GPB_METHOD_8_ENH_DEFLATE |
+                                            GPB_PATCH_DATA | GPB_STRONG_ENCRYPTION_MASK | GPB_UT8_ENCODING | GPB_CD_ENCRYPTED_MASK);
+
+/** Host system, the high byte of version_made_by, whose permissions live in
+ *  the top half of external_attr */
+#define HOST_UNIX 3
+
+/** Compression methods */
+#define METHOD_STORED   0
+#define METHOD_DEFLATED 8
+
+/** MS-DOS directory attribute, in the low byte of external_attr */
+#define MSDOS_DIR_ATTR 0x10
+
+/** Header ID stripzip will use to replace undesired data.
+ *  XXX: I hope nothing else uses this header for anything
+ */
+#define STRIPZIP_OPTION_HEADER 0xFFFF
+
+/** Zip64 extended information extra field */
+#define ZIP64_EXTRA_HEADER 0x0001
+
+/** Android zipalign padding: a uint16 alignment followed by zeros, which
+ *  pads the local extra field so that the entry's data is aligned */
+#define ALIGNMENT_EXTRA_HEADER 0xd935
+
+typedef struct __attribute__ ((__packed__))
+{
+  uint32_t signature;
+  uint16_t version_needed;
+  uint16_t gp_bits;
+  uint16_t compression_method;
+  uint16_t last_mod_time;
+  uint16_t last_mod_date;
+  uint32_t crc32;
+  uint32_t compressed_size;
+  uint32_t uncompressed_size;
+  uint16_t name_length;
+  uint16_t extra_field_length;
+} local_file_header_t;
+
+typedef struct __attribute__ ((__packed__))
+{
+  uint32_t signature;
+  uint16_t version_made_by;
+  uint16_t version_needed;
+  uint16_t gp_bits;
+  uint16_t compression_method;
+  uint16_t last_mod_time;
+  uint16_t last_mod_date;
+  uint32_t crc32;
+  uint32_t compressed_size;
+  uint32_t uncompressed_size;
+  uint16_t file_name_length;
+  uint16_t extra_field_length;
+  uint16_t file_comment_length;
+  uint16_t disk_number_start;
+  uint16_t internal_attr;
+  uint32_t external_attr;
+  uint32_t rel_offset_local_header;
+} central_directory_header_t;
+
+typedef struct __attribute__ ((__packed__))
+{
+  uint32_t signature;
+  uint16_t disk_number;
+  uint16_t disk_num_start_of_cd;
+  uint16_t num_dir_entries_this_disk;
+  uint16_t total_num_entries_cd;
+  uint32_t size_of_cd;
+  uint32_t cd_offset_in_first_disk;
+  uint16_t zip_file_comment_length;
+} end_of_central_directory_header_t;
+
+/**
+ * Start of a Zip64 end of central directory record. It goes between the
+ * central directory and the locator, which goes just in front of the EOCD.
+ */
+typedef struct __attribute__ ((__packed__))
+{
+  uint32_t signature;
+  uint64_t size;              /**< Of the rest of the record */
+} zip64_eocd_header_t;
+
+typedef struct __attribute__ ((__packed__))
+{
+  uint32_t signature;
+  uint32_t disk_with_zip64_eocd;
+  uint64_t zip64_eocd_offset;
+  uint32_t total_disks;
+} zip64_eocd_locator_t;
+
+/** Length of a version 1 Zip64 end of central directory record */
+#define ZIP64_EOCD_V1_LEN 56
+
+typedef struct __attribute__ ((__packed__))
+{
+  uint16_t id;
+  uint16_t length;
+} extra_header_t;
+
+/**
+ * Data descriptor following the data of entries with GPB_NOT_SEEKABLE set.
+ * It may or may not be preceded by DATA_DESCRIPTOR_SIGNATURE, and uses the
+ * data_descriptor64_t form when the local header has a Zip64 extra field.
+ */
+typedef struct __attribute__ ((__packed__))
+{
+  uint32_t crc32;
+  uint32_t compressed_size;
+  uint32_t uncompressed_size;
+} data_descriptor_t;
+
+typedef struct __attribute__ ((__packed__))
+{
+  uint32_t crc32;
+  uint64_t compressed_size;
+  uint64_t uncompressed_size;
+} data_descriptor64_t;
+
+/** Magic at the very end of an APK signing block, just before the CD */
+#define APK_SIG_BLOCK_MAGIC "APK Sig Block 42"
+
+typedef struct __attribute__ ((__packed__))
+{
+  uint64_t size;              /**< Size of the block, excluding the leading size field */
+  char magic[16];
+} apk_sig_block_footer_t;
+
+
+_Static_assert(sizeof(local_file_header_t) == 30, "local_file_header_t layout");
+_Static_assert(offsetof(local_file_header_t, gp_bits) == 6, "local_file_header_t layout");
+_Static_assert(offsetof(local_file_header_t, last_mod_time) == 10, "local_file_header_t layout");
+_Static_assert(offsetof(local_file_header_t, crc32) == 14, "local_file_header_t layout");
+_Static_assert(offsetof(local_file_header_t, name_length) == 26, "local_file_header_t layout");
+_Static_assert(offsetof(local_file_header_t, extra_field_length) == 28, "local_file_header_t layout");
+
+_Static_assert(sizeof(central_directory_header_t) == 46, "central_directory_header_t layout");
+_Static_assert(offsetof(central_directory_header_t, gp_bits) == 8, "central_directory_header_t layout");
+_Static_assert(offsetof(central_directory_header_t, last_mod_time) == 12, "central_directory_header_t layout");
+_Static_assert(offsetof(central_directory_header_t, crc32) == 16, "central_directory_header_t layout");
+_Static_assert(offsetof(central_directory_header_t, file_name_length) == 28, "central_directory_header_t layout");
+_Static_assert(offsetof(central_directory_header_t, disk_number_start) == 34, "central_directory_header_t layout");
+_Static_assert(offsetof(central_directory_header_t, external_attr) == 38, "central_directory_header_t layout");
+_Static_assert(offsetof(central_directory_header_t, rel_offset_local_header) == 42, "central_directory_header_t layout");
+
+_Static_assert(sizeof(end_of_central_directory_header_t) == 22, "end_of_central_directory_header_t layout");
+_Static_assert(offsetof(end_of_central_directory_header_t, total_num_entries_cd) == 10, "end_of_central_directory_header_t layout");
+_Static_assert(offsetof(end_of_central_directory_header_t, size_of_cd) == 12, "end_of_central_directory_header_t layout");
+_Static_assert(offsetof(end_of_central_directory_header_t, cd_offset_in_first_disk) == 16, "end_of_central_directory_header_t layout");
+
+_Static_assert(sizeof(extra_header_t) == 4, "extra_header_t layout");
+_Static_assert(sizeof(data_descriptor_t) == 12, "data_descriptor_t layout");
+_Static_assert(sizeof(data_descriptor64_t) == 20, "data_descriptor64_t layout");
+_Static_assert(sizeof(apk_sig_block_footer_t) == 24, "apk_sig_block_footer_t layout");
+
+
+/* memcpy of a constant size is a single (unaligned) load or store */
+static inline uint16_t zip_load16(const void *p)
+{
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return le16toh(v);
+}
+
+static inline uint32_t zip_load32(const void *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return le32toh(v);
+}
+
+static inline uint64_t zip_load64(const void *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return le64toh(v);
+}
+
+static inline void zip_store16(void *p, uint16_t v)
+{
+  v = htole16(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void zip_store32(void *p, uint32_t v)
+{
+  v = htole32(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline void zip_store64(void *p, uint64_t v)
+{
+  v = htole64(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+/** Read \a field of the on-disk structure at \a hdr in host byte order. */
+#define ZIP_GET(hdr, field)                                     \
+  _Generic((hdr)->field,                                        \
+           uint16_t: zip_load16,                                \
+           uint32_t: zip_load32,                                \
+           uint64_t: zip_load64)(&(hdr)->field)
+
+/** Write \a value, in host byte order, to \a field of the structure at \a hdr. */
+#define ZIP_SET(hdr, field, value)                              \
+  _Generic((hdr)->field,                                        \
+           uint16_t: zip_store16,                               \
+           uint32_t: zip_store32,                               \
+           uint64_t: zip_store64)(&(hdr)->field, (value))
+
+#endif /* STRIPZIP_ZIP_FORMAT_H */
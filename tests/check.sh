@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# End to end checks of the stripzip binary given as $1: runs killed part way
+# through --journal, and --compact output checked by other tools.
+#
+# Copyright (c) 2016, Zee.Aero
+# All rights reserved.
+
+set -u
+
+STRIPZIP=$(realpath "${1:-./stripzip}")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+FAILED=0
+
+fail()
+{
+  echo "FAIL: $*"
+  FAILED=1
+}
+
+
+# An archive of <count> entries as Info-ZIP writes them, with the extended
+# timestamp and Unix UID/GID fields purifying neutralizes, half of them
+# deflated. It has to stay below 65535 entries, past which it would be Zip64.
+make_archive()
+{
+  python3 - "$1" "$2" <<'EOF'
+import struct, sys, zipfile
+with zipfile.ZipFile(sys.argv[1], 'w') as z:
+    for i in range(int(sys.argv[2])):
+        info = zipfile.ZipInfo('d%d/f%05d.txt' % (i % 7, i), (2016, 1, 2, 3, 4, 6))
+        info.compress_type = zipfile.ZIP_DEFLATED if i % 2 else zipfile.ZIP_STORED
+        info.extra = (struct.pack('<HHBI', 0x5455, 5, 1, 1451703846 + i) +
+                      struct.pack('<HHBBIBI', 0x7875, 11, 1, 4, 1000 + i, 4, 1000))
+        z.writestr(info, b'line %d\n' % i * (i % 50 + 1))
+EOF
+}
+
+
+echo "Journal: killed runs"
+make_archive big.zip 60000
+cp big.zip ref.zip
+"$STRIPZIP" -q ref.zip || fail "plain purify"
+
+# Whether or not a run is caught with a journal in place, the next run has
+# to end with the same bytes as purifying without interruptions does
+interrupted=0
+for delay in 0.01 0.02 0.04 0.06 0.08 0.1 0.15 0.2 0.3; do
+  cp big.zip run.zip
+  # The subshell reports the kill, to where it is told to
+  (timeout -s KILL "$delay" "$STRIPZIP" -q --journal run.zip > /dev/null; true) 2> /dev/null
+  if [ -e run.zip.stripzip-journal ]; then
+    interrupted=$((interrupted + 1))
+  fi
+  "$STRIPZIP" -q --journal run.zip > /dev/null || fail "rerun after a kill at ${delay}s"
+  cmp -s run.zip ref.zip || fail "rerun after a kill at ${delay}s differs from a plain purify"
+  [ ! -e run.zip.stripzip-journal ] || fail "journal left behind after a kill at ${delay}s"
+done
+if [ "$interrupted" -eq 0 ]; then
+  fail "no run was killed with its journal in place"
+fi
+echo "  $interrupted runs left a journal"
+
+
+echo "Compact"
+make_archive small.zip 2000
+for mode in "" --atomic; do
+  what="--compact${mode:+ $mode}"
+  cp small.zip compact.zip
+  "$STRIPZIP" -q --compact $mode compact.zip || fail "$what"
+  [ "$(stat -c %s compact.zip)" -lt "$(stat -c %s small.zip)" ] || fail "$what didn't shrink the archive"
+  unzip -tqq compact.zip > /dev/null || fail "unzip -t rejects $what output"
+  "$STRIPZIP" --verify compact.zip > /dev/null || fail "--verify rejects $what output"
+  "$STRIPZIP" --diff small.zip compact.zip > /dev/null || fail "$what changed the entries"
+done
+
+
+if [ "$FAILED" -ne 0 ]; then
+  echo "Some checks failed"
+  exit 1
+fi
+echo "All checks passed"